@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Copyright (C) 2024, Andrew Moise <andrew.moise@gmail.com>
+#
+# Licensed under GNU Affero General Public License, Version 3
+#
+# Builds ogwatch and ogaccess, then checks on a fresh tmpfs that ogwatch's
+# cached access answers match the kernel's as permissions, owners, ACLs and
+# renames change, with and without resolver threads and privilege
+# separation. Needs root. Arguments are passed to every ogwatch run, e.g.
+# "bench/access.sh -s".
+#
+# Set OGACCESS_UID to run ogwatch as someone other than nobody.
+
+set -e
+cd "$(dirname "$0")/.."
+
+build=$(mktemp -d)
+scratch=$(mktemp -d)
+cleanup() {
+    umount "$scratch" 2>/dev/null || true
+    rmdir "$scratch"
+    rm -rf "$build"
+}
+trap cleanup EXIT
+
+gcc -O2 -pthread fanotify.c watch.c daemon.c loop.c dircache.c privsep.c pool.c coalesce.c filter.c origin.c contents.c trace.c roots.c stats.c journal.c output.c main.c \
+    -o "$build/ogwatch" -lpthread
+gcc -O2 bench/ogaccess.c -o "$build/ogaccess"
+
+# Where the user can get to it, and with ACLs
+chmod 755 "$build"
+mount -t tmpfs -o size=16m,mode=755 ogaccess "$scratch"
+
+status=0
+for mode in "" "-j 4" "-P"; do
+    echo "# ogwatch $mode $*"
+    # shellcheck disable=SC2086
+    "$build/ogaccess" -x "$build/ogwatch" -u "${OGACCESS_UID:-65534}" "$scratch" -- $mode "$@" || status=1
+done
+exit $status
@@ -0,0 +1,566 @@
+/*
+
+Copyright (C) 2024, Andrew Moise <andrew.moise@gmail.com>
+
+Licensed under GNU Affero General Public License, Version 3
+
+*/
+
+/* ogaccess: checks that the access answers ogwatch caches per directory
+   agree with asking the kernel afresh, as access_is_ok() does, for every
+   event. It runs ogwatch the way a setuid binary runs for an ordinary
+   user, over a small tree of directories with different modes and owners,
+   and then changes who may see what: chmod, chown and ACLs on directories
+   in the tree and above it, and renames in and above it.
+
+   After each change it creates a probe file in every directory, and asks
+   the kernel, as the user, whether they can see it. Each probe must be
+   reported if and only if they can. Since the previous step's probes have
+   filled the cache by then, a stale answer shows up as a wrong one.
+
+   Needs root, like ogwatch itself. See access.sh for the usual way to run
+   it. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "../ogwatch.h"
+
+#define MAX_OGWATCH_ARGS 64
+#define DEFAULT_UID 65534
+#define QUIET_MS 300            // No output for this long after the probes means they're all in
+#define READY_NAME ".ogaccess-ready"
+#define READY_TIMEOUT_MS 30000
+#define MAX_RECORDS 4096
+#define SCRATCH_MAX (PATH_MAX - 256)    // Leaves room for the paths made under it
+
+// The directories probed, relative to the root, by their current paths
+enum { DIR_ROOT, DIR_OPEN, DIR_DEEP, DIR_SHUT, DIR_INNER, DIR_MINE, NUM_DIRS };
+
+static struct {
+    char scratch[SCRATCH_MAX];
+    char above[SCRATCH_MAX + 16];   // The root's parent
+    char root[SCRATCH_MAX + 32];    // Watched by ogwatch
+    const char *dirs[NUM_DIRS];
+    uid_t uid;
+    gid_t gid;
+    int acls;                   // Whether the filesystem takes them
+
+    int out_fd;
+    char *records[MAX_RECORDS]; // Paths ogwatch reported since the last step
+    size_t num_records;
+} test;
+
+static void fail(const char *what) {
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+static void path_of(char *path, int dir, const char *name) {
+    const char *rel = test.dirs[dir];
+    snprintf(path, PATH_MAX, "%s%s%s%s%s", test.root, *rel ? "/" : "", rel, *name ? "/" : "", name);
+}
+
+/* Changing who may see what */
+
+static void do_chmod(int dir, mode_t mode) {
+    char path[PATH_MAX];
+    path_of(path, dir, "");
+    if (chmod(path, mode) == -1)
+        fail(path);
+}
+
+static void do_chown(int dir, uid_t uid, gid_t gid) {
+    char path[PATH_MAX];
+    path_of(path, dir, "");
+    if (chown(path, uid, gid) == -1)
+        fail(path);
+}
+
+/* Sets an access ACL of the usual owner, group and other entries from
+   the mode, plus one for the user with the given permissions. It's the
+   kernel's xattr form, so as not to need libacl. */
+static void set_user_acl(int dir, int perms) {
+    struct {
+        uint32_t version;
+        struct { uint16_t tag, perm; uint32_t id; } __attribute__((packed)) entries[5];
+    } __attribute__((packed)) acl = { 2, {
+        { 0x01, 07, (uint32_t) -1 },            // ACL_USER_OBJ
+        { 0x02, perms, test.uid },              // ACL_USER
+        { 0x04, 07, (uint32_t) -1 },            // ACL_GROUP_OBJ
+        { 0x10, 07, (uint32_t) -1 },            // ACL_MASK
+        { 0x20, 0, (uint32_t) -1 },             // ACL_OTHER
+    } };
+    char path[PATH_MAX];
+    path_of(path, dir, "");
+
+    struct stat statbuf;
+    if (stat(path, &statbuf) == -1)
+        fail(path);
+    acl.entries[0].perm = (statbuf.st_mode >> 6) & 07;
+    acl.entries[2].perm = (statbuf.st_mode >> 3) & 07;
+    acl.entries[4].perm = statbuf.st_mode & 07;
+    if (setxattr(path, "system.posix_acl_access", &acl, sizeof(acl), 0) == -1)
+        fail(path);
+}
+
+static void remove_acl(int dir) {
+    char path[PATH_MAX];
+    path_of(path, dir, "");
+    if (removexattr(path, "system.posix_acl_access") == -1)
+        fail(path);
+}
+
+static void do_rename(const char *from, const char *to) {
+    if (rename(from, to) == -1)
+        fail(from);
+}
+
+static void step_baseline() {
+}
+
+static void step_chmod_closed() {
+    do_chmod(DIR_OPEN, 0700);
+}
+
+static void step_chmod_opened() {
+    do_chmod(DIR_OPEN, 0755);
+}
+
+static void step_chown_to_user() {
+    do_chown(DIR_SHUT, test.uid, test.gid);
+}
+
+static void step_chown_to_root() {
+    do_chown(DIR_SHUT, 0, 0);
+}
+
+static void step_acl_grant() {
+    set_user_acl(DIR_SHUT, 05);
+}
+
+static void step_acl_grant_removed() {
+    remove_acl(DIR_SHUT);
+}
+
+static void step_acl_deny() {
+    set_user_acl(DIR_OPEN, 0);
+}
+
+static void step_acl_deny_removed() {
+    remove_acl(DIR_OPEN);
+}
+
+static void step_above_closed() {
+    if (chmod(test.above, 0700) == -1)
+        fail(test.above);
+}
+
+static void step_above_opened() {
+    if (chmod(test.above, 0755) == -1)
+        fail(test.above);
+}
+
+static void step_rename_into_shut() {
+    char from[PATH_MAX], to[PATH_MAX];
+    path_of(from, DIR_DEEP, "");
+    test.dirs[DIR_DEEP] = "shut/deep";
+    path_of(to, DIR_DEEP, "");
+    do_rename(from, to);
+}
+
+static void step_rename_out_of_shut() {
+    char from[PATH_MAX], to[PATH_MAX];
+    path_of(from, DIR_DEEP, "");
+    test.dirs[DIR_DEEP] = "open/deep";
+    path_of(to, DIR_DEEP, "");
+    do_rename(from, to);
+}
+
+/* The root ends up at the same path, under a new parent that the user
+   can't search, and then the new parent opens up. */
+static void step_rename_above_root() {
+    char old_above[SCRATCH_MAX + 16], old_root[SCRATCH_MAX + 32];
+    snprintf(old_above, sizeof(old_above), "%s/above-old", test.scratch);
+    snprintf(old_root, sizeof(old_root), "%s/above-old/root", test.scratch);
+    do_rename(test.above, old_above);
+    if (mkdir(test.above, 0700) == -1)
+        fail(test.above);
+    do_rename(old_root, test.root);
+}
+
+typedef struct {
+    const char *name;
+    void (*run)();
+    int needs_acls;
+} Step;
+
+static Step steps[] = {
+    {"baseline", step_baseline, 0},
+    {"chmod 700 open", step_chmod_closed, 0},
+    {"chmod 755 open", step_chmod_opened, 0},
+    {"chown shut to the user", step_chown_to_user, 0},
+    {"chown shut back to root", step_chown_to_root, 0},
+    {"ACL lets the user into shut", step_acl_grant, 1},
+    {"ACL on shut removed", step_acl_grant_removed, 1},
+    {"ACL keeps the user out of open", step_acl_deny, 1},
+    {"ACL on open removed", step_acl_deny_removed, 1},
+    {"chmod 700 above the root", step_above_closed, 0},
+    {"chmod 755 above the root", step_above_opened, 0},
+    {"rename open/deep into shut", step_rename_into_shut, 0},
+    {"rename it back", step_rename_out_of_shut, 0},
+    {"rename above the root, to a 700 parent", step_rename_above_root, 0},
+    {"chmod 755 the new parent", step_above_opened, 0},
+    {"chmod 700 the new parent", step_above_closed, 0},
+    {NULL, NULL, 0}
+};
+
+/* Setting up */
+
+static void make_dir(const char *path, mode_t mode, uid_t uid, gid_t gid) {
+    if (mkdir(path, mode) == -1 || chmod(path, mode) == -1 || chown(path, uid, gid) == -1)
+        fail(path);
+}
+
+static void remove_tree(const char *path) {
+    pid_t pid = fork();
+    if (pid == -1)
+        fail("fork");
+    if (pid == 0) {
+        execlp("rm", "rm", "-rf", path, (char *) NULL);
+        _exit(EXIT_FAILURE);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+static void make_tree() {
+    char path[PATH_MAX];
+
+    snprintf(test.above, sizeof(test.above), "%s/above", test.scratch);
+    snprintf(test.root, sizeof(test.root), "%s/above/root", test.scratch);
+    remove_tree(test.above);
+    snprintf(path, sizeof(path), "%s/above-old", test.scratch);
+    remove_tree(path);
+
+    test.dirs[DIR_ROOT] = "";
+    test.dirs[DIR_OPEN] = "open";
+    test.dirs[DIR_DEEP] = "open/deep";
+    test.dirs[DIR_SHUT] = "shut";
+    test.dirs[DIR_INNER] = "shut/inner";
+    test.dirs[DIR_MINE] = "mine";
+
+    make_dir(test.above, 0755, 0, 0);
+    make_dir(test.root, 0755, 0, 0);
+    for (int dir = DIR_OPEN; dir < NUM_DIRS; dir++) {
+        path_of(path, dir, "");
+        if (dir == DIR_SHUT)
+            make_dir(path, 0700, 0, 0);
+        else if (dir == DIR_MINE)
+            make_dir(path, 0700, test.uid, test.gid);
+        else
+            make_dir(path, 0755, 0, 0);
+    }
+
+    // Setting an empty ACL removes it, where there are ACLs at all
+    path_of(path, DIR_ROOT, "");
+    test.acls = setxattr(path, "system.posix_acl_access", "", 0, 0) == 0 || errno != EOPNOTSUPP;
+}
+
+/* Running ogwatch as if from a setuid binary: the real ids are the
+   user's, and the effective uid is root. */
+static pid_t start_ogwatch(const char *ogwatch, char **extra_args, int num_extra_args) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) == -1)
+        fail("pipe");
+
+    pid_t pid = fork();
+    if (pid == -1)
+        fail("fork");
+    if (pid == 0) {
+        char *args[MAX_OGWATCH_ARGS + 4];
+        int num_args = 0;
+        args[num_args++] = (char *) ogwatch;
+        for (int i = 0; i < num_extra_args; i++)
+            args[num_args++] = extra_args[i];
+        args[num_args++] = "--format=binary";
+        args[num_args++] = test.root;
+        args[num_args] = NULL;
+
+        // In a group of its own, so its privileged reader can be stopped with it
+        setpgid(0, 0);
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        if (setgroups(0, NULL) == -1 || setresgid(test.gid, test.gid, test.gid) == -1
+            || setresuid(test.uid, 0, 0) == -1)
+        {
+            perror("Failed to become the user");
+            _exit(EXIT_FAILURE);
+        }
+        execv(ogwatch, args);
+        perror(ogwatch);
+        _exit(EXIT_FAILURE);
+    }
+
+    close(pipe_fds[1]);
+    test.out_fd = pipe_fds[0];
+    return pid;
+}
+
+/* Takes in whatever ogwatch writes until it's been quiet for timeout_ms,
+   or, if ready is set, until it reports the ready file. Returns 1 or 2
+   respectively, or 0 at the end of its output. */
+static int read_records(int timeout_ms, int ready) {
+    static char buf[1024 * 1024];
+    static size_t filled = 0;
+
+    while (1) {
+        struct pollfd pfd = { test.out_fd, POLLIN, 0 };
+        int ret = poll(&pfd, 1, timeout_ms);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1)
+            fail("poll");
+        if (ret == 0)
+            return 1;
+
+        ssize_t len = read(test.out_fd, buf + filled, sizeof(buf) - filled);
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len == -1)
+            fail("read");
+        if (len == 0)
+            return 0;
+        filled += len;
+
+        size_t pos = 0;
+        int got_ready = 0;
+        while (filled - pos >= sizeof(OutputRecordHeader)) {
+            OutputRecordHeader header;
+            memcpy(&header, buf + pos, sizeof(header));
+            if (header.length < sizeof(header) || header.length > sizeof(buf)) {
+                fprintf(stderr, "Bad record of length %u from ogwatch\n", header.length);
+                exit(EXIT_FAILURE);
+            }
+            if (filled - pos < header.length)
+                break;
+
+            char *path = strndup(buf + pos + sizeof(header), header.path_len);
+            if (path == NULL)
+                fail("strndup");
+            if (strstr(path, "/" READY_NAME) != NULL) {
+                got_ready = 1;
+                free(path);
+            } else if (test.num_records < MAX_RECORDS) {
+                test.records[test.num_records++] = path;
+            } else {
+                free(path);
+            }
+            pos += header.length;
+        }
+        memmove(buf, buf + pos, filled - pos);
+        filled -= pos;
+        if (ready && got_ready)
+            return 2;
+    }
+}
+
+// Writes the ready file until ogwatch reports it, so its marks are all in place
+static void wait_until_ready() {
+    char path[PATH_MAX];
+    path_of(path, DIR_ROOT, READY_NAME);
+
+    for (int waited = 0; waited < READY_TIMEOUT_MS; waited += QUIET_MS) {
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1)
+            fail(path);
+        close(fd);
+        int ret = read_records(QUIET_MS, 1);
+        if (ret == 0)
+            break;
+        if (ret == 2) {
+            unlink(path);
+            read_records(QUIET_MS, 0);
+            for (size_t i = 0; i < test.num_records; i++)
+                free(test.records[i]);
+            test.num_records = 0;
+            return;
+        }
+    }
+    fprintf(stderr, "ogwatch never started reporting events\n");
+    exit(EXIT_FAILURE);
+}
+
+/* Asks the kernel, as the user in full, whether they can see each path,
+   which is what access_is_ok() asks. */
+static void check_as_user(char paths[NUM_DIRS][PATH_MAX], int visible[NUM_DIRS]) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) == -1)
+        fail("pipe");
+
+    pid_t pid = fork();
+    if (pid == -1)
+        fail("fork");
+    if (pid == 0) {
+        close(pipe_fds[0]);
+        if (setgroups(0, NULL) == -1 || setresgid(test.gid, test.gid, test.gid) == -1
+            || setresuid(test.uid, test.uid, test.uid) == -1)
+        {
+            perror("Failed to become the user");
+            _exit(EXIT_FAILURE);
+        }
+        char answers[NUM_DIRS];
+        for (int dir = 0; dir < NUM_DIRS; dir++) {
+            struct stat statbuf;
+            answers[dir] = lstat(paths[dir], &statbuf) == 0 || errno != EACCES;
+        }
+        if (write(pipe_fds[1], answers, sizeof(answers)) != sizeof(answers))
+            _exit(EXIT_FAILURE);
+        _exit(EXIT_SUCCESS);
+    }
+
+    close(pipe_fds[1]);
+    char answers[NUM_DIRS];
+    if (read(pipe_fds[0], answers, sizeof(answers)) != sizeof(answers)) {
+        fprintf(stderr, "Couldn't check access as the user\n");
+        exit(EXIT_FAILURE);
+    }
+    close(pipe_fds[0]);
+    waitpid(pid, NULL, 0);
+    for (int dir = 0; dir < NUM_DIRS; dir++)
+        visible[dir] = answers[dir];
+}
+
+// Runs one step, and returns how many probes came out wrong
+static int run_step(int index, const Step *step) {
+    char probe[32];
+    char paths[NUM_DIRS][PATH_MAX];
+    int visible[NUM_DIRS];
+
+    step->run();
+
+    snprintf(probe, sizeof(probe), "probe-%d", index);
+    for (int dir = 0; dir < NUM_DIRS; dir++) {
+        path_of(paths[dir], dir, probe);
+        int fd = open(paths[dir], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1)
+            fail(paths[dir]);
+        close(fd);
+    }
+    check_as_user(paths, visible);
+    read_records(QUIET_MS, 0);
+
+    int wrong = 0;
+    for (int dir = 0; dir < NUM_DIRS; dir++) {
+        int reported = 0;
+        for (size_t i = 0; i < test.num_records && !reported; i++)
+            reported = strcmp(test.records[i], paths[dir]) == 0;
+        if (reported != visible[dir]) {
+            printf("  %s: %s, but the user %s see it\n", paths[dir], reported ? "reported" : "not reported",
+                   visible[dir] ? "can" : "can't");
+            wrong++;
+        }
+    }
+    for (size_t i = 0; i < test.num_records; i++)
+        free(test.records[i]);
+    test.num_records = 0;
+    return wrong;
+}
+
+static void print_help() {
+    printf("Usage: ogaccess [options] <scratch_dir> [-- <ogwatch options>]\n");
+    printf("Options:\n");
+    printf("  -x <path>          The ogwatch binary to run (default ./ogwatch).\n");
+    printf("  -u <uid>           The user to run ogwatch as (default %d).\n", DEFAULT_UID);
+    printf("  -h                 Display this help message and exit.\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *ogwatch = "./ogwatch";
+    int opt;
+
+    test.uid = DEFAULT_UID;
+    while ((opt = getopt(argc, argv, "+x:u:h")) != -1) {
+        switch (opt) {
+            case 'x':
+                ogwatch = optarg;
+                break;
+            case 'u':
+                test.uid = strtoul(optarg, NULL, 10);
+                if (test.uid == 0) {
+                    fprintf(stderr, "Invalid user '%s'.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'h':
+                print_help();
+                exit(EXIT_SUCCESS);
+            default:
+                print_help();
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Missing scratch directory. Use -h for help.\n");
+        exit(EXIT_FAILURE);
+    }
+    test.gid = test.uid;
+
+    char scratch[PATH_MAX];
+    if (realpath(argv[optind], scratch) == NULL)
+        fail(argv[optind]);
+    if (snprintf(test.scratch, sizeof(test.scratch), "%s", scratch) >= (int) sizeof(test.scratch)) {
+        fprintf(stderr, "Scratch directory path too long\n");
+        exit(EXIT_FAILURE);
+    }
+    char **extra_args = argv + optind + 1;
+    int num_extra_args = argc - optind - 1;
+    if (num_extra_args > 0 && strcmp(extra_args[0], "--") == 0) {
+        extra_args++;
+        num_extra_args--;
+    }
+    if (num_extra_args > MAX_OGWATCH_ARGS) {
+        fprintf(stderr, "Too many ogwatch options.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    make_tree();
+    pid_t pid = start_ogwatch(ogwatch, extra_args, num_extra_args);
+    wait_until_ready();
+
+    int failed = 0;
+    for (int i = 0; steps[i].name != NULL; i++) {
+        if (steps[i].needs_acls && !test.acls) {
+            printf("skip %s: no ACLs on this filesystem\n", steps[i].name);
+            continue;
+        }
+        int wrong = run_step(i, &steps[i]);
+        printf("%s %s\n", wrong ? "FAIL" : "ok  ", steps[i].name);
+        failed += wrong > 0;
+    }
+
+    kill(-pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    close(test.out_fd);
+    remove_tree(test.above);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/above-old", test.scratch);
+    remove_tree(path);
+
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,774 @@
+/*
+
+Copyright (C) 2024, Andrew Moise <andrew.moise@gmail.com>
+
+Licensed under GNU Affero General Public License, Version 3
+
+*/
+
+/* ogbench: runs ogwatch over a scratch directory while generating a set
+   workload in it, and reports how well it kept up. Each workload gets a
+   fresh ogwatch, reading its --format=binary output on a pipe.
+
+   Every operation the generator does is logged with the time just before
+   the syscall that should produce an event, along with the path the event
+   should carry. Afterwards, each record ogwatch wrote is matched against
+   the log by path:
+
+   - latency is from the syscall to the record being read from the pipe
+   - a path in the log with no record at all is lost
+   - a record beyond the number of operations on its path is a duplicate
+   - a record for a path that isn't in the log at all (a stale path after
+     a rename, or something outside the root) is stray
+
+   Needs root, like ogwatch itself. See run.sh for the usual way to run it. */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../ogwatch.h"
+
+#define DEFAULT_OPS 20000
+#define MAX_OGWATCH_ARGS 64
+#define READY_NAME ".ogbench-ready"
+#define READY_POLL_MS 50
+#define READY_TIMEOUT_MS 30000
+#define QUIET_MS 1000           // No output for this long after the workload means it's all in
+#define DRAIN_TIMEOUT_MS 30000
+#define NOISE_PER_OP 10         // Unrelated operations per watched one, for the noise workload
+#define ROOT_MAX (PATH_MAX - 256)   // Leaves room for the paths the workloads make under it
+
+typedef struct {
+    char *path;
+    uint64_t issued_ns;
+} Op;
+
+typedef struct {
+    char *path;
+    uint64_t received_ns;
+    uint32_t flags;
+} Record;
+
+typedef struct {
+    const char *name;
+    void (*setup)();            // Before ogwatch starts, or NULL
+    void (*run)();
+    const char *description;
+} Workload;
+
+/* The state of one run. The reader thread only touches the records and
+   the ready flag, under the lock. */
+static struct {
+    char root[ROOT_MAX];        // Watched by ogwatch
+    char other[ROOT_MAX];       // Same filesystem, not watched
+    size_t num_ops_wanted;
+
+    Op *ops;
+    size_t num_ops;
+    size_t ops_capacity;
+
+    pthread_mutex_t lock;
+    Record *records;
+    size_t num_records;
+    size_t records_capacity;
+    int ready;
+    int eof;
+} bench = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void *xmalloc(size_t size) {
+    void *ptr = malloc(size);
+    if (ptr == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+static void *xrealloc(void *ptr, size_t size) {
+    ptr = realloc(ptr, size);
+    if (ptr == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_ms(int ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+/* Workload helpers */
+
+static void log_op(const char *path) {
+    if (bench.num_ops == bench.ops_capacity) {
+        bench.ops_capacity = bench.ops_capacity ? bench.ops_capacity * 2 : 4096;
+        bench.ops = xrealloc(bench.ops, bench.ops_capacity * sizeof(*bench.ops));
+    }
+    bench.ops[bench.num_ops].path = strdup(path);
+    if (bench.ops[bench.num_ops].path == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    bench.ops[bench.num_ops].issued_ns = now_ns();
+    bench.num_ops++;
+}
+
+static void make_dir(const char *path) {
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Creates or truncates a file and writes a little to it. Logged, if log is set.
+static void write_file(const char *path, int log) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    if (write(fd, path, strlen(path)) == -1) {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+    if (log)
+        log_op(path);
+    close(fd);
+}
+
+static void remove_tree(const char *path) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        unlink(path);
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        char child[PATH_MAX];
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        remove_tree(child);
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+/* Workloads */
+
+#define STORM_DIRS 16
+#define STORM_BACKLOG 256     // Files written before the oldest is deleted
+
+static void setup_storm() {
+    char path[PATH_MAX];
+
+    for (int d = 0; d < STORM_DIRS; d++) {
+        snprintf(path, sizeof(path), "%s/d%d", bench.root, d);
+        make_dir(path);
+    }
+}
+
+/* Many small files created, written, closed and then deleted again a
+   little later, across a few directories. */
+static void run_storm() {
+    char path[PATH_MAX];
+
+    for (size_t i = 0; i < bench.num_ops_wanted; i++) {
+        snprintf(path, sizeof(path), "%s/d%zu/f%zu", bench.root, i % STORM_DIRS, i);
+        write_file(path, 1);
+        if (i >= STORM_BACKLOG) {
+            snprintf(path, sizeof(path), "%s/d%zu/f%zu", bench.root, (i - STORM_BACKLOG) % STORM_DIRS,
+                     i - STORM_BACKLOG);
+            unlink(path);
+        }
+    }
+}
+
+#define RENAME_DEPTH 16
+
+// Current names of the chain of directories, each flipping between aN and bN
+static char rename_names[RENAME_DEPTH][16];
+
+static void setup_renames() {
+    char path[PATH_MAX];
+
+    for (int level = 0; level < RENAME_DEPTH; level++)
+        snprintf(rename_names[level], sizeof(rename_names[level]), "a%d", level);
+
+    size_t len = snprintf(path, sizeof(path), "%s", bench.root);
+    for (int level = 0; level < RENAME_DEPTH; level++) {
+        len += snprintf(path + len, sizeof(path) - len, "/%s", rename_names[level]);
+        make_dir(path);
+    }
+}
+
+/* Renames directories at every level of a deep chain, writing a file at
+   the bottom after each one. When ogwatch falls behind, it reports paths
+   as they are when it gets to them, which shows up as stray records for
+   paths that never existed together and lost ones for those that did. */
+static void run_renames() {
+    char (*names)[16] = rename_names;
+    char path[PATH_MAX], from[PATH_MAX + sizeof(rename_names[0]) + 1];
+    size_t len;
+
+    for (size_t i = 0; 2 * i < bench.num_ops_wanted; i++) {
+        int renamed = i % RENAME_DEPTH;
+
+        // Path of the renamed directory, before and after
+        len = snprintf(path, sizeof(path), "%s", bench.root);
+        for (int level = 0; level < renamed; level++)
+            len += snprintf(path + len, sizeof(path) - len, "/%s", names[level]);
+        snprintf(from, sizeof(from), "%s/%s", path, names[renamed]);
+        names[renamed][0] = (names[renamed][0] == 'a') ? 'b' : 'a';
+        snprintf(path + len, sizeof(path) - len, "/%s", names[renamed]);
+
+        log_op(path);
+        if (rename(from, path) == -1) {
+            perror("rename");
+            exit(EXIT_FAILURE);
+        }
+
+        len = snprintf(path, sizeof(path), "%s", bench.root);
+        for (int level = 0; level < RENAME_DEPTH; level++)
+            len += snprintf(path + len, sizeof(path) - len, "/%s", names[level]);
+        snprintf(path + len, sizeof(path) - len, "/f%zu", i);
+        write_file(path, 1);
+    }
+}
+
+#define CHECKOUT_DIRS 32
+#define CHECKOUT_FILES_PER_DIR 32
+
+static void setup_checkout() {
+    char path[PATH_MAX];
+
+    for (int d = 0; d < CHECKOUT_DIRS; d++) {
+        snprintf(path, sizeof(path), "%s/src%d", bench.root, d);
+        make_dir(path);
+        for (int f = 0; f < CHECKOUT_FILES_PER_DIR; f++) {
+            snprintf(path, sizeof(path), "%s/src%d/file%d.c", bench.root, d, f);
+            write_file(path, 0);
+        }
+    }
+}
+
+/* Like switching branches back and forth: the same files in a source-like
+   tree deleted and written again, round after round. */
+static void run_checkout() {
+    char path[PATH_MAX];
+
+    for (size_t i = 0; i < bench.num_ops_wanted; i++) {
+        size_t file = i % (CHECKOUT_DIRS * CHECKOUT_FILES_PER_DIR);
+        snprintf(path, sizeof(path), "%s/src%zu/file%zu.c", bench.root,
+                 file / CHECKOUT_FILES_PER_DIR, file % CHECKOUT_FILES_PER_DIR);
+        unlink(path);
+        write_file(path, 1);
+    }
+}
+
+/* A trickle of changes in the tree under a flood of them elsewhere on
+   the same filesystem, which filesystem marks have to wade through. */
+static void run_noise() {
+    char path[PATH_MAX];
+    size_t num_watched = bench.num_ops_wanted / (NOISE_PER_OP + 1);
+
+    for (size_t i = 0; i < num_watched; i++) {
+        for (int j = 0; j < NOISE_PER_OP; j++) {
+            snprintf(path, sizeof(path), "%s/n%zu", bench.other, (i * NOISE_PER_OP + j) % 1024);
+            write_file(path, 0);
+        }
+        snprintf(path, sizeof(path), "%s/f%zu", bench.root, i);
+        write_file(path, 1);
+    }
+}
+
+static Workload workloads[] = {
+    {"storm", setup_storm, run_storm, "create/write/delete storm"},
+    {"renames", setup_renames, run_renames, "deep directory renames"},
+    {"checkout", setup_checkout, run_checkout, "delete and rewrite churn"},
+    {"noise", NULL, run_noise, "unrelated traffic on the same filesystem"},
+    {NULL, NULL, NULL, NULL}
+};
+
+/* Reading ogwatch's output */
+
+static void add_record(const char *path, size_t path_len, uint32_t flags, uint64_t received_ns) {
+    if (bench.num_records == bench.records_capacity) {
+        bench.records_capacity = bench.records_capacity ? bench.records_capacity * 2 : 4096;
+        bench.records = xrealloc(bench.records, bench.records_capacity * sizeof(*bench.records));
+    }
+    Record *record = &bench.records[bench.num_records++];
+    record->path = strndup(path, path_len);
+    if (record->path == NULL) {
+        perror("strndup");
+        exit(EXIT_FAILURE);
+    }
+    record->flags = flags;
+    record->received_ns = received_ns;
+}
+
+static int is_ready_path(const char *path, size_t len) {
+    size_t name_len = strlen("/" READY_NAME);
+    return len >= name_len && memcmp(path + len - name_len, "/" READY_NAME, name_len) == 0;
+}
+
+static void *read_output(void *arg) {
+    int fd = *(int *) arg;
+    size_t buf_size = 1024 * 1024;
+    char *buf = xmalloc(buf_size);
+    size_t filled = 0;
+
+    for (;;) {
+        ssize_t len = read(fd, buf + filled, buf_size - filled);
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            break;
+        uint64_t received_ns = now_ns();
+        filled += len;
+
+        pthread_mutex_lock(&bench.lock);
+        size_t pos = 0;
+        while (filled - pos >= sizeof(OutputRecordHeader)) {
+            OutputRecordHeader header;
+            memcpy(&header, buf + pos, sizeof(header));
+            if (header.length < sizeof(header) || header.length > buf_size) {
+                fprintf(stderr, "Bad record of length %u from ogwatch\n", header.length);
+                exit(EXIT_FAILURE);
+            }
+            if (filled - pos < header.length)
+                break;
+
+            const char *path = buf + pos + sizeof(header);
+            if (is_ready_path(path, header.path_len))
+                bench.ready = 1;
+            else if (bench.ready)
+                add_record(path, header.path_len, header.flags, received_ns);
+            pos += header.length;
+        }
+        pthread_mutex_unlock(&bench.lock);
+
+        memmove(buf, buf + pos, filled - pos);
+        filled -= pos;
+    }
+
+    pthread_mutex_lock(&bench.lock);
+    bench.eof = 1;
+    pthread_mutex_unlock(&bench.lock);
+    free(buf);
+    return NULL;
+}
+
+/* ogwatch's own resource use: it and its direct children, which covers
+   the root reader when it runs with privilege separation. */
+
+static void add_process_usage(pid_t pid, double *cpu_seconds, long *rss_kb) {
+    char path[64], buf[4096];
+    FILE *file;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if ((file = fopen(path, "r")) != NULL) {
+        if (fgets(buf, sizeof(buf), file) != NULL) {
+            // Fields after the command name, which may contain anything
+            char *fields = strrchr(buf, ')');
+            unsigned long utime, stime;
+            if (fields != NULL
+                && sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) == 2)
+            {
+                *cpu_seconds += (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+            }
+        }
+        fclose(file);
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    if ((file = fopen(path, "r")) != NULL) {
+        long kb;
+        while (fgets(buf, sizeof(buf), file) != NULL) {
+            if (sscanf(buf, "VmHWM: %ld kB", &kb) == 1)
+                *rss_kb += kb;
+        }
+        fclose(file);
+    }
+}
+
+static pid_t parent_of(pid_t pid) {
+    char path[64], buf[256];
+    pid_t ppid = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+    while (fgets(buf, sizeof(buf), file) != NULL) {
+        if (sscanf(buf, "PPid: %d", &ppid) == 1)
+            break;
+    }
+    fclose(file);
+    return ppid;
+}
+
+static int sample_usage(pid_t pid, double *cpu_seconds, long *rss_kb, pid_t *children, int max_children) {
+    int num_children = 0;
+    *cpu_seconds = 0;
+    *rss_kb = 0;
+    add_process_usage(pid, cpu_seconds, rss_kb);
+
+    DIR *proc = opendir("/proc");
+    if (proc == NULL)
+        return 0;
+    struct dirent *entry;
+    while ((entry = readdir(proc)) != NULL) {
+        pid_t child = atoi(entry->d_name);
+        if (child > 0 && parent_of(child) == pid) {
+            add_process_usage(child, cpu_seconds, rss_kb);
+            if (num_children < max_children)
+                children[num_children++] = child;
+        }
+    }
+    closedir(proc);
+    return num_children;
+}
+
+/* Results */
+
+static int compare_ops(const void *a, const void *b) {
+    const Op *op_a = a, *op_b = b;
+    int cmp = strcmp(op_a->path, op_b->path);
+    if (cmp != 0)
+        return cmp;
+    return (op_a->issued_ns > op_b->issued_ns) - (op_a->issued_ns < op_b->issued_ns);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Finds the first op on path in the sorted log, or returns -1
+static ssize_t find_ops(const char *path) {
+    size_t lo = 0, hi = bench.num_ops;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(bench.ops[mid].path, path) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo < bench.num_ops && strcmp(bench.ops[lo].path, path) == 0) ? (ssize_t) lo : -1;
+}
+
+static void report(const Workload *workload, uint64_t start_ns, double cpu_seconds, long rss_kb) {
+    size_t lost = 0, duplicates = 0, stray = 0, overflows = 0;
+    uint64_t last_ns = start_ns;
+
+    /* Sort the log by path, then time, and keep a cursor per run of ops on
+       one path: the next op a record for that path would be matched to. */
+
+    qsort(bench.ops, bench.num_ops, sizeof(*bench.ops), compare_ops);
+    size_t *cursor = xmalloc(bench.num_ops * sizeof(*cursor));
+    for (size_t i = 0; i < bench.num_ops; i++)
+        cursor[i] = i;
+
+    uint64_t *latencies = xmalloc((bench.num_ops + 1) * sizeof(*latencies));
+    size_t num_latencies = 0;
+
+    for (size_t i = 0; i < bench.num_records; i++) {
+        Record *record = &bench.records[i];
+        if (record->received_ns > last_ns)
+            last_ns = record->received_ns;
+        if (record->flags & (EVENT_OVERFLOW | EVENT_ESTALE)) {
+            overflows++;
+            continue;
+        }
+
+        ssize_t first = find_ops(record->path);
+        if (first == -1) {
+            stray++;
+            continue;
+        }
+
+        size_t next = cursor[first];
+        if (next < bench.num_ops && strcmp(bench.ops[next].path, record->path) == 0
+            && bench.ops[next].issued_ns <= record->received_ns)
+        {
+            latencies[num_latencies++] = record->received_ns - bench.ops[next].issued_ns;
+            cursor[first] = next + 1;
+        } else {
+            duplicates++;
+        }
+    }
+
+    for (size_t i = 0; i < bench.num_ops; i++) {
+        if ((i == 0 || strcmp(bench.ops[i - 1].path, bench.ops[i].path) != 0) && cursor[i] == i)
+            lost++;
+    }
+
+    qsort(latencies, num_latencies, sizeof(*latencies), compare_u64);
+    double p50 = 0, p90 = 0, p99 = 0, max = 0;
+    if (num_latencies > 0) {
+        p50 = latencies[num_latencies * 50 / 100] / 1000.0;
+        p90 = latencies[num_latencies * 90 / 100] / 1000.0;
+        p99 = latencies[num_latencies * 99 / 100] / 1000.0;
+        max = latencies[num_latencies - 1] / 1000.0;
+    }
+    double seconds = (last_ns - start_ns) / 1e9;
+    double rate = (seconds > 0) ? bench.num_records / seconds : 0;
+
+    printf("%-10s %8zu %8zu %10.0f %9.0f %9.0f %9.0f %9.0f %6zu %6zu %6zu %6zu %8.3f %8ld\n",
+           workload->name, bench.num_ops, bench.num_records, rate, p50, p90, p99, max,
+           lost, duplicates, stray, overflows, cpu_seconds, rss_kb);
+    fflush(stdout);
+
+    free(latencies);
+    free(cursor);
+}
+
+/* Running one workload */
+
+static pid_t start_ogwatch(const char *ogwatch, char **extra_args, int num_extra_args, int *out_fd) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) == -1) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        char *args[MAX_OGWATCH_ARGS + 8];
+        int num_args = 0;
+        args[num_args++] = (char *) ogwatch;
+        for (int i = 0; i < num_extra_args; i++)
+            args[num_args++] = extra_args[i];
+        args[num_args++] = "--format=binary";
+        args[num_args++] = "-f";
+        args[num_args++] = "FAN_CLOSE_WRITE";
+        args[num_args++] = "-d";
+        args[num_args++] = "FAN_MOVED_TO";
+        args[num_args++] = bench.root;
+        args[num_args] = NULL;
+
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        execv(ogwatch, args);
+        perror(ogwatch);
+        _exit(EXIT_FAILURE);
+    }
+
+    close(pipe_fds[1]);
+    *out_fd = pipe_fds[0];
+    return pid;
+}
+
+// Writes the ready file until ogwatch reports it, so its marks are all in place
+static void wait_until_ready() {
+    char path[ROOT_MAX + sizeof(READY_NAME) + 1];
+    snprintf(path, sizeof(path), "%s/" READY_NAME, bench.root);
+
+    for (int waited = 0; ; waited += READY_POLL_MS) {
+        pthread_mutex_lock(&bench.lock);
+        int ready = bench.ready, eof = bench.eof;
+        pthread_mutex_unlock(&bench.lock);
+        if (ready)
+            break;
+        if (eof || waited >= READY_TIMEOUT_MS) {
+            fprintf(stderr, "ogwatch never started reporting events\n");
+            exit(EXIT_FAILURE);
+        }
+        write_file(path, 0);
+        sleep_ms(READY_POLL_MS);
+    }
+    unlink(path);
+}
+
+// Waits for the output to go quiet, which means ogwatch has caught up
+static void wait_until_quiet() {
+    size_t last_count = (size_t) -1;
+    int quiet = 0;
+
+    for (int waited = 0; quiet < QUIET_MS && waited < DRAIN_TIMEOUT_MS; waited += READY_POLL_MS) {
+        sleep_ms(READY_POLL_MS);
+        pthread_mutex_lock(&bench.lock);
+        size_t count = bench.num_records;
+        int eof = bench.eof;
+        pthread_mutex_unlock(&bench.lock);
+        if (eof)
+            break;
+        quiet = (count == last_count) ? quiet + READY_POLL_MS : 0;
+        last_count = count;
+    }
+}
+
+static void run_workload(const Workload *workload, const char *scratch, const char *ogwatch,
+                         char **extra_args, int num_extra_args)
+{
+    if (snprintf(bench.root, sizeof(bench.root), "%s/watch-%s", scratch, workload->name) >= (int) sizeof(bench.root)
+        || snprintf(bench.other, sizeof(bench.other), "%s/other", scratch) >= (int) sizeof(bench.other))
+    {
+        fprintf(stderr, "Scratch directory path too long\n");
+        exit(EXIT_FAILURE);
+    }
+    remove_tree(bench.root);
+    remove_tree(bench.other);
+    make_dir(bench.root);
+    make_dir(bench.other);
+    if (workload->setup != NULL)
+        workload->setup();
+
+    bench.num_ops = 0;
+    bench.num_records = 0;
+    bench.ready = 0;
+    bench.eof = 0;
+
+    int out_fd;
+    pid_t pid = start_ogwatch(ogwatch, extra_args, num_extra_args, &out_fd);
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, read_output, &out_fd) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+
+    wait_until_ready();
+    uint64_t start_ns = now_ns();
+    workload->run();
+    wait_until_quiet();
+
+    double cpu_seconds;
+    long rss_kb;
+    pid_t children[16];
+    int num_children = sample_usage(pid, &cpu_seconds, &rss_kb, children, 16);
+
+    kill(pid, SIGTERM);
+    for (int i = 0; i < num_children; i++)
+        kill(children[i], SIGTERM);
+    waitpid(pid, NULL, 0);
+    pthread_join(reader, NULL);
+    close(out_fd);
+
+    report(workload, start_ns, cpu_seconds, rss_kb);
+
+    for (size_t i = 0; i < bench.num_ops; i++)
+        free(bench.ops[i].path);
+    for (size_t i = 0; i < bench.num_records; i++)
+        free(bench.records[i].path);
+    remove_tree(bench.root);
+    remove_tree(bench.other);
+}
+
+static void print_help() {
+    printf("Usage: ogbench [options] <scratch_dir> [-- <ogwatch options>]\n");
+    printf("Options:\n");
+    printf("  -x <path>          The ogwatch binary to run (default ./ogwatch).\n");
+    printf("  -n <ops>           Operations per workload (default %d).\n", DEFAULT_OPS);
+    printf("  -W <workload>      Run only this workload; can be given more than once.\n");
+    printf("  -h                 Display this help message and exit.\n");
+    printf("\nWorkloads:\n");
+    for (int i = 0; workloads[i].name != NULL; i++)
+        printf("  %-10s %s\n", workloads[i].name, workloads[i].description);
+    printf("\nColumns: operations logged, records read, records/s, latency percentiles\n");
+    printf("in microseconds, lost paths, duplicate and stray records, ESTALE or\n");
+    printf("OVERFLOW records, ogwatch CPU seconds and peak RSS in KB (summed over\n");
+    printf("its processes).\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *ogwatch = "./ogwatch";
+    int selected[sizeof(workloads) / sizeof(workloads[0])] = {0};
+    int any_selected = 0;
+    int opt;
+
+    bench.num_ops_wanted = DEFAULT_OPS;
+
+    // Stop at the scratch directory, so ogwatch's options aren't taken for ours
+    while ((opt = getopt(argc, argv, "+x:n:W:h")) != -1) {
+        switch (opt) {
+            case 'x':
+                ogwatch = optarg;
+                break;
+            case 'n':
+                bench.num_ops_wanted = strtoul(optarg, NULL, 10);
+                if (bench.num_ops_wanted == 0) {
+                    fprintf(stderr, "Invalid operation count '%s'.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'W': {
+                int i;
+                for (i = 0; workloads[i].name != NULL; i++) {
+                    if (strcmp(workloads[i].name, optarg) == 0)
+                        break;
+                }
+                if (workloads[i].name == NULL) {
+                    fprintf(stderr, "Unknown workload '%s'. Use -h for help.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                selected[i] = 1;
+                any_selected = 1;
+                break;
+            }
+            case 'h':
+                print_help();
+                exit(EXIT_SUCCESS);
+            default:
+                print_help();
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Missing scratch directory. Use -h for help.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char scratch[PATH_MAX];
+    if (realpath(argv[optind], scratch) == NULL) {
+        perror(argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    char **extra_args = argv + optind + 1;
+    int num_extra_args = argc - optind - 1;
+    if (num_extra_args > 0 && strcmp(extra_args[0], "--") == 0) {
+        extra_args++;
+        num_extra_args--;
+    }
+    if (num_extra_args > MAX_OGWATCH_ARGS) {
+        fprintf(stderr, "Too many ogwatch options.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%-10s %8s %8s %10s %9s %9s %9s %9s %6s %6s %6s %6s %8s %8s\n",
+           "workload", "ops", "records", "records/s", "p50_us", "p90_us", "p99_us", "max_us",
+           "lost", "dup", "stray", "ovfl", "cpu_s", "rss_kb");
+
+    for (int i = 0; workloads[i].name != NULL; i++) {
+        if (!any_selected || selected[i])
+            run_workload(&workloads[i], scratch, ogwatch, extra_args, num_extra_args);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+# Copyright (C) 2024, Andrew Moise <andrew.moise@gmail.com>
+#
+# Licensed under GNU Affero General Public License, Version 3
+#
+# Builds ogwatch and ogbench, then runs every workload on a fresh tmpfs and
+# writes the results to bench_output.txt. Needs root. Arguments are passed
+# to ogwatch, e.g. "bench/run.sh -s -j 4".
+#
+# Set OGBENCH_DIR to run on an existing directory instead (a loop-mounted
+# ext4 image, say), and OGBENCH_OPS to change the operations per workload.
+# Set OGBENCH_JOBS to a list of thread counts, e.g. "1,2,4,8", to run
+# everything once with each of them as -j, and OGBENCH_WORKLOADS to a list
+# of workloads to run only those.
+
+set -e
+cd "$(dirname "$0")/.."
+
+build=$(mktemp -d)
+scratch=${OGBENCH_DIR:-}
+mounted=
+cleanup() {
+    if [ -n "$mounted" ]; then
+        umount "$scratch"
+        rmdir "$scratch"
+    fi
+    rm -rf "$build"
+}
+trap cleanup EXIT
+
+gcc -O2 -pthread fanotify.c watch.c daemon.c loop.c dircache.c privsep.c pool.c coalesce.c filter.c origin.c contents.c trace.c roots.c stats.c journal.c output.c main.c \
+    -o "$build/ogwatch" -lpthread
+gcc -O2 -pthread bench/ogbench.c -o "$build/ogbench"
+
+if [ -z "$scratch" ]; then
+    scratch=$(mktemp -d)
+    mount -t tmpfs -o size=512m ogbench "$scratch"
+    mounted=1
+fi
+
+selected=
+for workload in $(echo "${OGBENCH_WORKLOADS:-}" | tr ',' ' '); do
+    selected="$selected -W $workload"
+done
+
+{
+    echo "# $(date -u '+%Y-%m-%d %H:%M:%S') $(uname -sr) $(nproc) CPUs $(git rev-parse --short HEAD 2>/dev/null)"
+    if [ -z "${OGBENCH_JOBS:-}" ]; then
+        echo "# ogwatch $*"
+        # shellcheck disable=SC2086
+        "$build/ogbench" -x "$build/ogwatch" -n "${OGBENCH_OPS:-20000}" $selected "$scratch" -- "$@"
+    else
+        for jobs in $(echo "$OGBENCH_JOBS" | tr ',' ' '); do
+            echo "# ogwatch -j $jobs $*"
+            # shellcheck disable=SC2086
+            "$build/ogbench" -x "$build/ogwatch" -n "${OGBENCH_OPS:-20000}" $selected "$scratch" -- -j "$jobs" "$@"
+        done
+    fi
+} | tee bench_output.txt
@@ -0,0 +1,339 @@
+/*
+
+Copyright (C) 2024, Andrew Moise <andrew.moise@gmail.com>
+
+Licensed under GNU Affero General Public License, Version 3
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "coalesce.h"
+
+typedef struct {
+    char *path;         // NULL once folded into a directory
+    size_t path_len;
+    uint64_t hash;
+    int is_dir;
+    int bucket_next;
+} PendingPath;
+
+/* Entries sit in an array in the order they arrived, so output order is
+   stable, with a hash table over it for finding paths. Folded entries
+   leave holes until the array fills up and gets compacted. */
+struct Coalescer {
+    PendingPath *entries;
+    size_t num_entries;     // Including holes
+    size_t num_live;
+    size_t bytes;           // Of live paths
+    size_t max_paths;
+    size_t max_bytes;
+    int *buckets;
+    size_t bucket_mask;
+};
+
+static void *xmalloc(size_t size) {
+    void *ptr = malloc(size);
+    if (ptr == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+// FNV-1a
+static uint64_t hash_path(const char *path, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) path[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+Coalescer *coalescer_create(size_t max_paths, size_t max_bytes) {
+    Coalescer *coalescer = xmalloc(sizeof(*coalescer));
+    coalescer->entries = xmalloc(max_paths * sizeof(*coalescer->entries));
+    coalescer->max_paths = max_paths;
+    coalescer->max_bytes = max_bytes;
+
+    size_t num_buckets = 1;
+    while (num_buckets < max_paths * 2)
+        num_buckets <<= 1;
+    coalescer->buckets = xmalloc(num_buckets * sizeof(*coalescer->buckets));
+    coalescer->bucket_mask = num_buckets - 1;
+
+    coalescer->num_entries = 0;
+    coalescer_clear(coalescer);
+    return coalescer;
+}
+
+void coalescer_clear(Coalescer *coalescer) {
+    for (size_t i = 0; i < coalescer->num_entries; i++)
+        free(coalescer->entries[i].path);
+    for (size_t i = 0; i <= coalescer->bucket_mask; i++)
+        coalescer->buckets[i] = -1;
+    coalescer->num_entries = 0;
+    coalescer->num_live = 0;
+    coalescer->bytes = 0;
+}
+
+int coalescer_is_empty(const Coalescer *coalescer) {
+    return coalescer->num_live == 0;
+}
+
+static PendingPath *find(Coalescer *coalescer, const char *path, size_t len) {
+    uint64_t hash = hash_path(path, len);
+    for (int i = coalescer->buckets[hash & coalescer->bucket_mask]; i != -1; i = coalescer->entries[i].bucket_next) {
+        PendingPath *entry = &coalescer->entries[i];
+        if (entry->hash == hash && entry->path_len == len && memcmp(entry->path, path, len) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+// Adds an entry for a path we've already copied, and takes ownership of it
+static void append_owned(Coalescer *coalescer, char *path, size_t len, int is_dir) {
+    int index = coalescer->num_entries++;
+    PendingPath *entry = &coalescer->entries[index];
+    entry->path = path;
+    entry->path_len = len;
+    entry->hash = hash_path(path, len);
+    entry->is_dir = is_dir;
+
+    int *bucket = &coalescer->buckets[entry->hash & coalescer->bucket_mask];
+    entry->bucket_next = *bucket;
+    *bucket = index;
+
+    coalescer->num_live++;
+    coalescer->bytes += len;
+}
+
+static void append(Coalescer *coalescer, const char *path, size_t len, int is_dir) {
+    char *copy = xmalloc(len);
+    memcpy(copy, path, len);
+    append_owned(coalescer, copy, len, is_dir);
+}
+
+static void remove_entry(Coalescer *coalescer, int index) {
+    PendingPath *entry = &coalescer->entries[index];
+
+    int *link = &coalescer->buckets[entry->hash & coalescer->bucket_mask];
+    while (*link != index)
+        link = &coalescer->entries[*link].bucket_next;
+    *link = entry->bucket_next;
+
+    free(entry->path);
+    entry->path = NULL;
+    coalescer->num_live--;
+    coalescer->bytes -= entry->path_len;
+}
+
+// Whether path is strictly below dir
+static int is_below(const char *path, size_t path_len, const char *dir, size_t dir_len) {
+    if (path_len <= dir_len || memcmp(path, dir, dir_len) != 0)
+        return 0;
+    return path[dir_len] == '/' || dir[dir_len - 1] == '/';
+}
+
+// Whether a directory above path is already pending
+static int covered_by_ancestor(Coalescer *coalescer, const char *path, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (path[i] != '/')
+            continue;
+        size_t prefix_len = (i == 0) ? 1 : i;
+        if (prefix_len >= len)
+            break;
+        PendingPath *entry = find(coalescer, path, prefix_len);
+        if (entry != NULL && entry->is_dir)
+            return 1;
+    }
+    return 0;
+}
+
+static void remove_below(Coalescer *coalescer, const char *dir, size_t len) {
+    for (size_t i = 0; i < coalescer->num_entries; i++) {
+        PendingPath *entry = &coalescer->entries[i];
+        if (entry->path != NULL && is_below(entry->path, entry->path_len, dir, len))
+            remove_entry(coalescer, i);
+    }
+}
+
+// Closes up the holes left by folded entries
+static void compact(Coalescer *coalescer) {
+    size_t live = 0;
+    for (size_t i = 0; i < coalescer->num_entries; i++) {
+        if (coalescer->entries[i].path != NULL)
+            coalescer->entries[live++] = coalescer->entries[i];
+    }
+    coalescer->num_entries = live;
+
+    for (size_t i = 0; i <= coalescer->bucket_mask; i++)
+        coalescer->buckets[i] = -1;
+    for (size_t i = 0; i < live; i++) {
+        int *bucket = &coalescer->buckets[coalescer->entries[i].hash & coalescer->bucket_mask];
+        coalescer->entries[i].bucket_next = *bucket;
+        *bucket = i;
+    }
+}
+
+// Directories between the path and /
+static int path_depth(const PendingPath *entry) {
+    int depth = 0;
+    for (size_t i = 1; i < entry->path_len; i++)
+        depth += entry->path[i] == '/';
+    return entry->path_len > 1 ? depth + 1 : 0;
+}
+
+// Orders paths with everything below a directory straight after it
+static int compare_paths(const void *a, const void *b) {
+    const PendingPath *x = a, *y = b;
+    size_t len = x->path_len < y->path_len ? x->path_len : y->path_len;
+
+    for (size_t i = 0; i < len; i++) {
+        int cx = x->path[i] == '/' ? 0 : (unsigned char) x->path[i] + 1;
+        int cy = y->path[i] == '/' ? 0 : (unsigned char) y->path[i] + 1;
+        if (cx != cy)
+            return cx - cy;
+    }
+    return (x->path_len > y->path_len) - (x->path_len < y->path_len);
+}
+
+// Drops repeats, and paths below a directory that's there too, from paths
+// sorted by compare_paths(). Returns how many are left.
+static size_t remove_covered(PendingPath *paths, size_t count) {
+    size_t kept = 0;
+    ssize_t dir = -1;   // The last directory kept; anything below it is next
+
+    for (size_t i = 0; i < count; i++) {
+        PendingPath *entry = &paths[i];
+        PendingPath *last = kept > 0 ? &paths[kept - 1] : NULL;
+
+        if (last != NULL && last->path_len == entry->path_len && memcmp(last->path, entry->path, entry->path_len) == 0) {
+            if (entry->is_dir && !last->is_dir) {
+                last->is_dir = 1;
+                dir = kept - 1;
+            }
+            free(entry->path);
+        } else if (dir != -1 && is_below(entry->path, entry->path_len, paths[dir].path, paths[dir].path_len)) {
+            free(entry->path);
+        } else {
+            paths[kept] = *entry;
+            if (entry->is_dir)
+                dir = kept;
+            kept++;
+        }
+    }
+    return kept;
+}
+
+/* Out of room: fold the deepest paths into their parent directories, a
+   level at a time, until there's room for as much again. Paths under one
+   directory meet there, so it never widens past the closest directory
+   that covers everything, and usually stops well short of it. */
+static void collapse(Coalescer *coalescer, const char *path, size_t len, int is_dir) {
+    PendingPath *paths = xmalloc((coalescer->num_live + 1) * sizeof(*paths));
+    size_t count = 0;
+
+    for (size_t i = 0; i < coalescer->num_entries; i++) {
+        if (coalescer->entries[i].path != NULL)
+            paths[count++] = coalescer->entries[i];
+    }
+    paths[count].path = xmalloc(len);
+    memcpy(paths[count].path, path, len);
+    paths[count].path_len = len;
+    paths[count].is_dir = is_dir;
+    count++;
+
+    size_t bytes;
+    do {
+        int max_depth = 0;
+        for (size_t i = 0; i < count; i++) {
+            int depth = path_depth(&paths[i]);
+            if (depth > max_depth)
+                max_depth = depth;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            PendingPath *entry = &paths[i];
+            if (max_depth == 0 || path_depth(entry) < max_depth)
+                continue;
+            size_t parent_len = entry->path_len - 1;
+            while (parent_len > 0 && entry->path[parent_len] != '/')
+                parent_len--;
+            entry->path_len = parent_len > 0 ? parent_len : 1;
+            entry->is_dir = 1;
+        }
+
+        qsort(paths, count, sizeof(*paths), compare_paths);
+        count = remove_covered(paths, count);
+
+        bytes = 0;
+        for (size_t i = 0; i < count; i++)
+            bytes += paths[i].path_len;
+    } while (count > 1 && (count > coalescer->max_paths / 2 || bytes > coalescer->max_bytes / 2));
+
+    // Start over with what's left; the order they came in is lost anyway
+    for (size_t i = 0; i <= coalescer->bucket_mask; i++)
+        coalescer->buckets[i] = -1;
+    coalescer->num_entries = 0;
+    coalescer->num_live = 0;
+    coalescer->bytes = 0;
+    for (size_t i = 0; i < count; i++)
+        append_owned(coalescer, paths[i].path, paths[i].path_len, paths[i].is_dir);
+    free(paths);
+}
+
+void coalescer_add(Coalescer *coalescer, const char *path, size_t len, int is_dir) {
+    if (len == 0 || covered_by_ancestor(coalescer, path, len))
+        return;
+
+    PendingPath *entry = find(coalescer, path, len);
+    if (entry != NULL) {
+        if (is_dir && !entry->is_dir) {
+            entry->is_dir = 1;
+            remove_below(coalescer, path, len);
+        }
+        return;
+    }
+
+    if (is_dir)
+        remove_below(coalescer, path, len);
+
+    if (coalescer->num_entries == coalescer->max_paths && coalescer->num_live < coalescer->num_entries)
+        compact(coalescer);
+    if (coalescer->num_entries == coalescer->max_paths || coalescer->bytes + len > coalescer->max_bytes) {
+        collapse(coalescer, path, len, is_dir);
+        return;
+    }
+
+    append(coalescer, path, len, is_dir);
+}
+
+size_t coalescer_drain_some(Coalescer *coalescer, CoalesceEmitFunc emit, void *arg, size_t max_bytes) {
+    size_t emitted = 0;
+    for (size_t i = 0; i < coalescer->num_entries && emitted < max_bytes; i++) {
+        PendingPath *entry = &coalescer->entries[i];
+        if (entry->path != NULL) {
+            emit(entry->path, entry->path_len, entry->is_dir, arg);
+            emitted += entry->path_len;
+            remove_entry(coalescer, i);
+        }
+    }
+    if (coalescer->num_live == 0)
+        coalescer_clear(coalescer);
+    return emitted;
+}
+
+void coalescer_drain(Coalescer *coalescer, CoalesceEmitFunc emit, void *arg) {
+    for (size_t i = 0; i < coalescer->num_entries; i++) {
+        PendingPath *entry = &coalescer->entries[i];
+        if (entry->path != NULL)
+            emit(entry->path, entry->path_len, entry->is_dir, arg);
+    }
+    coalescer_clear(coalescer);
+}
@@ -0,0 +1,32 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <stddef.h>
+
+#define COALESCE_MAX_PATHS 4096
+#define COALESCE_MAX_BYTES (1024 * 1024)
+
+// Changed paths waiting to be reported, each once. A directory stands for
+// everything below it, since it has to be rescanned recursively anyway.
+typedef struct Coalescer Coalescer;
+
+typedef void (*CoalesceEmitFunc)(const char *path, size_t path_len, int is_dir, void *arg);
+
+Coalescer *coalescer_create(size_t max_paths, size_t max_bytes);
+
+// Adds a changed path, unless something pending already covers it. When
+// full, the deepest paths fold into their parent directories until it's
+// half empty.
+void coalescer_add(Coalescer *coalescer, const char *path, size_t path_len, int is_dir);
+
+// Passes every pending path to emit(), in the order first added, and
+// forgets them.
+void coalescer_drain(Coalescer *coalescer, CoalesceEmitFunc emit, void *arg);
+void coalescer_clear(Coalescer *coalescer);
+
+// Like coalescer_drain(), but stops once about max_bytes of paths have gone
+// out, and keeps the rest. Returns how many bytes did.
+size_t coalescer_drain_some(Coalescer *coalescer, CoalesceEmitFunc emit, void *arg, size_t max_bytes);
+int coalescer_is_empty(const Coalescer *coalescer);
+
+#endif
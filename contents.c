@@ -0,0 +1,258 @@
+/*
+
+Copyright (C) 2024, Andrew Moise <andrew.moise@gmail.com>
+
+Licensed under GNU Affero General Public License, Version 3
+
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "contents.h"
+
+// Paths to remember before starting over
+#define CONTENTS_MAX_ENTRIES 65536
+#define CONTENTS_BUCKETS 16384
+
+// Bytes to hash per read(), a whole number of stripes
+#define CONTENTS_READ_SIZE (128 * 1024)
+#define STRIPE_SIZE 32
+
+typedef struct ContentEntry {
+    struct ContentEntry *next;
+    uint64_t path_hash;
+    uint32_t dev_major;
+    uint32_t dev_minor;
+    uint64_t ino;
+    struct statx_timestamp birth;   // Zero where the filesystem doesn't say
+    struct statx_timestamp mtime;
+    uint64_t size;
+    uint64_t hash;
+    time_t hashed_at;               // CLOCK_REALTIME seconds, to compare with mtime
+    char path[];
+} ContentEntry;
+
+struct ContentCache {
+    size_t max_size;
+    ContentEntry *buckets[CONTENTS_BUCKETS];
+    size_t count;
+    unsigned char *buf;
+};
+
+ContentCache *contents_create(size_t max_size) {
+    ContentCache *cache = calloc(1, sizeof(*cache));
+    if (cache == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    cache->max_size = max_size;
+    cache->buf = malloc(CONTENTS_READ_SIZE);
+    if (cache->buf == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    return cache;
+}
+
+static void clear(ContentCache *cache) {
+    for (size_t i = 0; i < CONTENTS_BUCKETS; i++) {
+        while (cache->buckets[i] != NULL) {
+            ContentEntry *entry = cache->buckets[i];
+            cache->buckets[i] = entry->next;
+            free(entry);
+        }
+    }
+    cache->count = 0;
+}
+
+void contents_destroy(ContentCache *cache) {
+    clear(cache);
+    free(cache->buf);
+    free(cache);
+}
+
+/* The hash runs four independent 64-bit lanes over 32-byte stripes, in
+   the manner of xxHash64, so that the multiplies overlap and the loop
+   vectorizes where the compiler can. It only has to tell a rewrite from a
+   change, not stand up to anyone trying to collide it. */
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+
+typedef struct {
+    uint64_t lanes[4];
+    uint64_t total;
+} HashState;
+
+static inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t mix_lane(uint64_t lane, uint64_t input) {
+    return rotl(lane + input * PRIME2, 31) * PRIME1;
+}
+
+static void hash_init(HashState *state) {
+    state->lanes[0] = PRIME1 + PRIME2;
+    state->lanes[1] = PRIME2;
+    state->lanes[2] = 0;
+    state->lanes[3] = -PRIME1;
+    state->total = 0;
+}
+
+// len must be a whole number of stripes
+static void hash_stripes(HashState *state, const unsigned char *data, size_t len) {
+    uint64_t lanes[4] = { state->lanes[0], state->lanes[1], state->lanes[2], state->lanes[3] };
+    for (size_t i = 0; i < len; i += STRIPE_SIZE) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t input;
+            memcpy(&input, data + i + lane * 8, 8);
+            lanes[lane] = mix_lane(lanes[lane], input);
+        }
+    }
+    memcpy(state->lanes, lanes, sizeof(lanes));
+    state->total += len;
+}
+
+// Folds in the last, partial stripe, and mixes the result
+static uint64_t hash_finish(HashState *state, const unsigned char *tail, size_t len) {
+    uint64_t hash = rotl(state->lanes[0], 1) + rotl(state->lanes[1], 7) + rotl(state->lanes[2], 12)
+        + rotl(state->lanes[3], 18);
+    hash += state->total + len;
+
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t input;
+        memcpy(&input, tail + i, 8);
+        hash = rotl(hash ^ mix_lane(0, input), 27) * PRIME1 + PRIME4;
+    }
+    for (; i < len; i++)
+        hash = rotl(hash ^ (tail[i] * PRIME3), 11) * PRIME1;
+
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// Hashes what's left to read of fd, as long as it's no more than max_size
+static int hash_file(ContentCache *cache, int fd, uint64_t *hash) {
+    HashState state;
+    hash_init(&state);
+
+    while (1) {
+        size_t filled = 0;
+        while (filled < CONTENTS_READ_SIZE) {
+            ssize_t len = read(fd, cache->buf + filled, CONTENTS_READ_SIZE - filled);
+            if (len == -1) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            if (len == 0)
+                break;
+            filled += len;
+        }
+
+        // It grew past the limit since we looked
+        if (state.total + filled > cache->max_size)
+            return -1;
+
+        if (filled < CONTENTS_READ_SIZE) {
+            size_t whole = filled - filled % STRIPE_SIZE;
+            hash_stripes(&state, cache->buf, whole);
+            *hash = hash_finish(&state, cache->buf + whole, filled - whole);
+            return 0;
+        }
+        hash_stripes(&state, cache->buf, filled);
+    }
+}
+
+// FNV-1a
+static uint64_t hash_path(const char *path) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *path != '\0'; path++) {
+        hash ^= (unsigned char) *path;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static int same_time(const struct statx_timestamp *a, const struct statx_timestamp *b) {
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+int contents_unchanged(ContentCache *cache, const char *path, int fd) {
+    struct statx stx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_BASIC_STATS | STATX_BTIME, &stx) == -1 || !S_ISREG(stx.stx_mode))
+        return 0;
+    if (!(stx.stx_mask & STATX_BTIME))
+        memset(&stx.stx_btime, 0, sizeof(stx.stx_btime));
+
+    uint64_t path_hash = hash_path(path);
+    ContentEntry **slot = &cache->buckets[path_hash % CONTENTS_BUCKETS];
+    while (*slot != NULL && ((*slot)->path_hash != path_hash || strcmp((*slot)->path, path) != 0))
+        slot = &(*slot)->next;
+    ContentEntry *entry = *slot;
+
+    int same_file = entry != NULL && entry->dev_major == stx.stx_dev_major && entry->dev_minor == stx.stx_dev_minor
+        && entry->ino == stx.stx_ino && same_time(&entry->birth, &stx.stx_btime) && entry->size == stx.stx_size;
+
+    /* Opened for writing and closed again without a write. The mtime only
+       says so if it was well in the past when we hashed, since a write in
+       the same tick of a coarse clock wouldn't have moved it. */
+
+    if (same_file && same_time(&entry->mtime, &stx.stx_mtime) && entry->mtime.tv_sec + 1 < entry->hashed_at)
+        return 1;
+
+    uint64_t hash;
+    if (stx.stx_size > cache->max_size || hash_file(cache, fd, &hash) == -1) {
+        if (entry != NULL) {
+            *slot = entry->next;
+            free(entry);
+            cache->count--;
+        }
+        return 0;
+    }
+    int unchanged = same_file && entry->hash == hash;
+
+    if (entry == NULL) {
+        if (cache->count == CONTENTS_MAX_ENTRIES) {
+            clear(cache);
+            slot = &cache->buckets[path_hash % CONTENTS_BUCKETS];
+        }
+        size_t path_len = strlen(path);
+        entry = malloc(sizeof(*entry) + path_len + 1);
+        if (entry == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(entry->path, path, path_len + 1);
+        entry->path_hash = path_hash;
+        entry->next = NULL;
+        *slot = entry;
+        cache->count++;
+    }
+    entry->dev_major = stx.stx_dev_major;
+    entry->dev_minor = stx.stx_dev_minor;
+    entry->ino = stx.stx_ino;
+    entry->birth = stx.stx_btime;
+    entry->mtime = stx.stx_mtime;
+    entry->size = stx.stx_size;
+    entry->hash = hash;
+    entry->hashed_at = time(NULL);
+    return unchanged;
+}
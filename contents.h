@@ -0,0 +1,20 @@
+#ifndef CONTENTS_H
+#define CONTENTS_H
+
+#include <stddef.h>
+
+// Remembers which file each path last held, and what was in it, so that
+// a file rewritten with the same contents can be told apart from one
+// that changed. Files are known by device, inode and birth time, so one
+// deleted or renamed over and then rewritten counts as changed.
+typedef struct ContentCache ContentCache;
+
+// Files bigger than max_size aren't hashed, and always count as changed
+ContentCache *contents_create(size_t max_size);
+void contents_destroy(ContentCache *cache);
+
+// Whether the file open on fd, at path, holds just what it did the last
+// time it was checked, and remembers what it holds now.
+int contents_unchanged(ContentCache *cache, const char *path, int fd);
+
+#endif
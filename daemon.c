@@ -0,0 +1,686 @@
+/*
+
+Copyright (C) 2024, Andrew Moise <andrew.moise@gmail.com>
+
+Licensed under GNU Affero General Public License, Version 3
+
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fanotify.h>
+#include <sys/fsuid.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "libogwatch.h"
+#include "loop.h"
+#include "stats.h"
+
+// Events to take from the watch at a time
+#define DAEMON_BATCH_SIZE 1024
+
+typedef struct {
+    int fd;                     // -1 once it's gone, until we tidy up
+    int subscribed;
+    char *request;              // The subscription, as far as it's arrived
+    size_t request_len;
+    RootSet *roots;             // Its own, in the order it gave them
+    unsigned int file_events_mask;
+    unsigned int dir_events_mask;
+    PathFilter *filter;
+    char *send_buf;             // Records it hasn't taken yet
+    size_t send_len;
+    unsigned char *overflowed;  // Per root: events were lost, and it owes a rescan
+    int overflow_pending;
+    uint64_t sequence;
+    unsigned int loop_events;   // What we're waiting on it for
+} Client;
+
+static Client *clients[DAEMON_MAX_CLIENTS];
+static int num_clients = 0;
+
+static const WatchOptions *daemon_options;
+static Ogwatch *watch;
+static EventLoop *loop;
+static LoopTimer estale_timer;  // For when the pending ESTALE is due
+
+static void *checked_malloc(size_t size) {
+    void *result = malloc(size);
+    if (result == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+static void fill_address(struct sockaddr_un *addr, const char *socket_path) {
+    if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "%s: Socket path too long\n", socket_path);
+        exit(EXIT_FAILURE);
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, socket_path);
+}
+
+// Whether some daemon is still answering on a socket that's in the way
+static int socket_is_live(const struct sockaddr_un *addr) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return 1;
+    int live = connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) == 0 || errno != ECONNREFUSED;
+    close(fd);
+    return live;
+}
+
+/* Binds the socket as the real user, so that it lands wherever they could
+   have put it themselves, and only they can connect to it. A socket left
+   behind by a daemon that's gone gets replaced. */
+static int listen_on(const char *socket_path) {
+    struct sockaddr_un addr;
+    fill_address(&addr, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+
+    uid_t effective_uid = geteuid();
+    gid_t effective_gid = getegid();
+    if (setegid(getgid()) == -1 || seteuid(getuid()) == -1) {
+        perror("Failed to drop privileges");
+        exit(EXIT_FAILURE);
+    }
+    mode_t old_umask = umask(0077);
+
+    int ret = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    if (ret == -1 && errno == EADDRINUSE && !socket_is_live(&addr)) {
+        unlink(socket_path);
+        ret = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    }
+    int saved_errno = errno;
+
+    umask(old_umask);
+    if (seteuid(effective_uid) == -1 || setegid(effective_gid) == -1) {
+        perror("Failed to restore privileges");
+        exit(EXIT_FAILURE);
+    }
+
+    if (ret == -1) {
+        errno = saved_errno;
+        perror(socket_path);
+        exit(EXIT_FAILURE);
+    }
+    if (listen(fd, SOMAXCONN) == -1) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+static void drop_client(Client *client) {
+    loop_remove(loop, client->fd);
+    close(client->fd);
+    client->fd = -1;
+}
+
+static void free_client(Client *client) {
+    free(client->request);
+    if (client->roots != NULL)
+        roots_destroy(client->roots);
+    if (client->filter != NULL)
+        filter_destroy(client->filter);
+    free(client->send_buf);
+    free(client->overflowed);
+    free(client);
+}
+
+static void handle_client_ready(int fd, unsigned int events, void *arg);
+
+/* Takes new connections. Events are only checked against the real user,
+   so nobody else gets to see them. */
+static void accept_clients(int listen_fd) {
+    while (1) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN)
+                perror("accept");
+            return;
+        }
+
+        struct ucred cred;
+        socklen_t cred_len = sizeof(cred);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1
+            || (cred.uid != getuid() && cred.uid != 0)
+            || num_clients == DAEMON_MAX_CLIENTS) {
+            close(fd);
+            continue;
+        }
+
+        Client *client = calloc(1, sizeof(*client));
+        if (client == NULL) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        client->fd = fd;
+        client->request = checked_malloc(DAEMON_MAX_REQUEST);
+        client->loop_events = EPOLLIN;
+        clients[num_clients++] = client;
+        loop_add(loop, fd, EPOLLIN, handle_client_ready, client);
+    }
+}
+
+// Finds the end of a string within the request, or returns NULL if it runs off the end
+static const char *request_string(const char *start, const char *end) {
+    return memchr(start, '\0', end - start);
+}
+
+/* Canonicalizes a client's root as the real user, as the command line's
+   are, and returns 0 if it's a directory at or below one of the daemon's
+   own roots. Anything else is EACCES, whatever the reason, so a client
+   can't learn what's in directories the user can't search. Only this
+   thread's filesystem uid changes, so resolver threads carry on as root. */
+static int client_root_path(const char *path, char *canonical) {
+    uid_t real_uid = getuid(), effective_uid = geteuid();
+    struct stat statbuf;
+
+    setfsuid(real_uid);
+    if ((uid_t) setfsuid(real_uid) != real_uid)
+        return EACCES;
+
+    int found = realpath(path, canonical) != NULL && stat(canonical, &statbuf) == 0 && S_ISDIR(statbuf.st_mode);
+
+    setfsuid(effective_uid);
+    if ((uid_t) setfsuid(effective_uid) != effective_uid) {
+        perror("Failed to restore privileges");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!found || roots_match(daemon_options->roots, canonical, strlen(canonical)) == -1)
+        return EACCES;
+    return 0;
+}
+
+/* Sets a client up as its request asks, and returns 0, or an errno value
+   if it can't be. Its roots are all under the daemon's, so the watch
+   already covers them, and nothing a client sends changes it. */
+static int subscribe(Client *client) {
+    SubscribeHeader header;
+    memcpy(&header, client->request, sizeof(header));
+    if (header.version != DAEMON_PROTOCOL_VERSION)
+        return EPROTO;
+    if (header.num_roots == 0)
+        return EINVAL;
+
+    const char *pos = client->request + sizeof(header);
+    const char *end = client->request + header.length;
+
+    client->roots = roots_create();
+    for (uint32_t i = 0; i < header.num_roots; i++) {
+        char canonical[PATH_MAX];
+        const char *path_end = request_string(pos, end);
+        if (path_end == NULL)
+            return EINVAL;
+
+        int err = client_root_path(pos, canonical);
+        if (err != 0)
+            return err;
+
+        // Roots answer to their own index, so the same one twice can't work
+        if (roots_add(client->roots, canonical) != (int) i)
+            return EINVAL;
+        pos = path_end + 1;
+    }
+
+    client->filter = filter_create();
+    for (uint32_t i = 0; i < header.num_rules; i++) {
+        if (pos == end || (*pos != 'x' && *pos != 'i'))
+            return EINVAL;
+        const char *pattern_end = request_string(pos + 1, end);
+        if (pattern_end == NULL)
+            return EINVAL;
+        filter_add(client->filter, pos + 1, *pos == 'x');
+        pos = pattern_end + 1;
+    }
+    if (pos != end)
+        return EINVAL;
+
+    client->file_events_mask = header.file_events_mask & daemon_options->file_events_mask;
+    client->dir_events_mask = header.dir_events_mask & daemon_options->dir_events_mask;
+    client->send_buf = checked_malloc(DAEMON_CLIENT_BUF_SIZE);
+    client->overflowed = calloc(header.num_roots, 1);
+    if (client->overflowed == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
+
+// Reads the client's subscription, or notices it going away
+static void read_from_client(Client *client) {
+    char discard[256];
+
+    while (1) {
+        char *buf = client->subscribed ? discard : client->request + client->request_len;
+        size_t size = client->subscribed ? sizeof(discard) : DAEMON_MAX_REQUEST - client->request_len;
+
+        ssize_t len = read(client->fd, buf, size);
+        if (len == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                drop_client(client);
+            return;
+        }
+        if (len == 0) {
+            drop_client(client);
+            return;
+        }
+        if (client->subscribed)
+            continue;
+        client->request_len += len;
+
+        SubscribeHeader header;
+        if (client->request_len < sizeof(header))
+            continue;
+        memcpy(&header, client->request, sizeof(header));
+
+        uint32_t status;
+        if (header.length < sizeof(header) || header.length > DAEMON_MAX_REQUEST) {
+            status = EINVAL;
+        } else if (client->request_len < header.length) {
+            continue;
+        } else if (client->request_len > header.length) {
+            status = EPROTO;    // It didn't wait for an answer
+        } else {
+            status = subscribe(client);
+        }
+
+        /* The answer is the first thing on the socket, so there's always
+           room for it. */
+
+        if (send(client->fd, &status, sizeof(status), MSG_NOSIGNAL) != sizeof(status) || status != 0) {
+            drop_client(client);
+            return;
+        }
+        client->subscribed = 1;
+        free(client->request);
+        client->request = NULL;
+    }
+}
+
+// Adds a record to what the client has yet to take, if there's room
+static int queue_record(Client *client, const Event *event, unsigned int mask, int root) {
+    OutputRecordHeader header;
+    header.length = sizeof(header) + event->path_len + event->from_path_len;
+    if (header.length > DAEMON_CLIENT_BUF_SIZE - client->send_len)
+        return 0;
+
+    header.mask = mask;
+    header.flags = event->flags;
+    header.path_len = event->path_len;
+    header.root = root;
+    header.from_path_len = event->from_path_len;
+    header.timestamp_ns = event->timestamp_ns;
+    header.sequence = ++client->sequence;
+
+    char *record = client->send_buf + client->send_len;
+    memcpy(record, &header, sizeof(header));
+    memcpy(record + sizeof(header), event->path, event->path_len);
+    if (event->from_path_len > 0)
+        memcpy(record + sizeof(header) + event->path_len, event->from_path, event->from_path_len);
+    client->send_len += header.length;
+    stats_add(STAT_OUTPUT_RECORDS, 1);
+    return 1;
+}
+
+/* Queues an event for a client. One that's fallen behind loses events
+   until it catches up, and then gets told to rescan whichever of its roots
+   they were under. */
+static void send_event(Client *client, const Event *event, unsigned int mask, int root) {
+    if (root != -1 && client->overflowed[root])
+        return;
+    if (queue_record(client, event, mask, root))
+        return;
+
+    // An ESTALE could have been anywhere
+    if (root == -1)
+        memset(client->overflowed, 1, roots_count(client->roots));
+    else
+        client->overflowed[root] = 1;
+    client->overflow_pending = 1;
+}
+
+// Which of the client's roots a path is under, or -1 if it's not one it sees
+static int client_root(const Client *client, const char *path, size_t path_len, int is_dir) {
+    int root = roots_match(client->roots, path, path_len);
+    if (root != -1 && !filter_is_empty(client->filter)
+        && filter_excludes(client->filter, roots_relative_path(client->roots, root, path), is_dir))
+    {
+        return -1;
+    }
+    return root;
+}
+
+/* A rename goes to a client as one if it sees both sides of it under the
+   same root. Otherwise whichever side it sees goes as the move it is from
+   there, unless it asked for moves too, which come on their own. */
+static void deliver_rename(Client *client, const Event *event, unsigned int events_mask) {
+    static const unsigned int side_masks[2] = { FAN_MOVED_FROM, FAN_MOVED_TO };
+    const char *paths[2] = { event->from_path, event->path };
+    size_t path_lens[2] = { event->from_path_len, event->path_len };
+    int is_dir = (event->flags & EVENT_IS_DIR) != 0;
+
+    int roots[2];
+    for (int i = 0; i < 2; i++)
+        roots[i] = client_root(client, paths[i], path_lens[i], is_dir);
+    if (roots[0] != -1 && roots[0] == roots[1]) {
+        send_event(client, event, FAN_RENAME, roots[1]);
+        return;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (roots[i] == -1 || (events_mask & side_masks[i]))
+            continue;
+        Event move = { side_masks[i], event->flags, paths[i], path_lens[i], event->timestamp_ns, roots[i], NULL, 0 };
+        send_event(client, &move, side_masks[i], roots[i]);
+    }
+}
+
+// Hands an event to a client if it concerns it
+static void deliver(Client *client, const Event *event) {
+    const RootSet *roots = client->roots;
+    int root;
+    unsigned int mask = event->mask;
+
+    if (event->flags & EVENT_ESTALE) {
+        root = -1;
+    } else if (event->flags & EVENT_OVERFLOW) {
+        // One of the daemon's roots overflowed, so each of the client's below it has to be rescanned
+        for (int i = 0; i < roots_count(roots); i++) {
+            const char *path = roots_path(roots, i);
+            if (strncmp(path, event->path, event->path_len) != 0
+                || (path[event->path_len] != '\0' && path[event->path_len] != '/' && event->path_len != 1))
+            {
+                continue;
+            }
+            Event overflow = { 0, event->flags, path, strlen(path), event->timestamp_ns, i, NULL, 0 };
+            send_event(client, &overflow, 0, i);
+        }
+        return;
+    } else {
+        int is_dir = (event->flags & EVENT_IS_DIR) != 0;
+        unsigned int events_mask = is_dir ? client->dir_events_mask : client->file_events_mask;
+        if (event->from_path != NULL) {
+            if (events_mask & FAN_RENAME)
+                deliver_rename(client, event, events_mask);
+            return;
+        }
+
+        // Moves the daemon wasn't asked for stand in for renames it couldn't report whole
+        unsigned int daemon_mask = is_dir ? daemon_options->dir_events_mask : daemon_options->file_events_mask;
+        if (events_mask & FAN_RENAME)
+            events_mask |= (FAN_MOVED_FROM | FAN_MOVED_TO) & ~daemon_mask;
+        mask &= events_mask;
+        if (!mask)
+            return;
+        root = client_root(client, event->path, event->path_len, is_dir);
+        if (root == -1)
+            return;
+    }
+    send_event(client, event, mask, root);
+}
+
+// Sends the client what it'll take without blocking, then anything it's owed
+static void flush_client(Client *client) {
+    size_t sent = 0;
+    while (sent < client->send_len) {
+        ssize_t len = send(client->fd, client->send_buf + sent, client->send_len - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (len == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN) {
+                drop_client(client);
+                return;
+            }
+            break;
+        }
+        sent += len;
+    }
+    memmove(client->send_buf, client->send_buf + sent, client->send_len - sent);
+    client->send_len -= sent;
+
+    // Wait for it to take a good part of what it has, rather than lose events again straight away
+    if (!client->overflow_pending || client->send_len > DAEMON_CLIENT_BUF_SIZE / 2)
+        return;
+
+    client->overflow_pending = 0;
+    for (int i = 0; i < roots_count(client->roots); i++) {
+        if (!client->overflowed[i])
+            continue;
+        const char *path = roots_path(client->roots, i);
+        Event event = { 0, EVENT_OVERFLOW | EVENT_IS_DIR, path, strlen(path), monotonic_ns(), i, NULL, 0 };
+        if (queue_record(client, &event, 0, i))
+            client->overflowed[i] = 0;
+        else
+            client->overflow_pending = 1;
+    }
+}
+
+// Waits for room to send in only while there's something to send
+static void update_interest(Client *client) {
+    unsigned int events = EPOLLIN | (client->send_len > 0 ? EPOLLOUT : 0);
+    if (client->fd != -1 && events != client->loop_events) {
+        loop_modify(loop, client->fd, events);
+        client->loop_events = events;
+    }
+}
+
+// Frees the clients that have gone
+static void reap_clients() {
+    int kept = 0;
+    for (int i = 0; i < num_clients; i++) {
+        if (clients[i]->fd == -1)
+            free_client(clients[i]);
+        else
+            clients[kept++] = clients[i];
+    }
+    num_clients = kept;
+}
+
+static void handle_client_ready(int fd, unsigned int events, void *arg) {
+    Client *client = arg;
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        read_from_client(client);
+    if (client->fd != -1 && client->subscribed && (events & EPOLLOUT))
+        flush_client(client);
+    update_interest(client);
+    reap_clients();
+}
+
+static void handle_listen_ready(int fd, unsigned int events, void *arg) {
+    accept_clients(fd);
+}
+
+// Passes everything the watch has on to the clients it concerns
+static void read_watch() {
+    static Event events[DAEMON_BATCH_SIZE];
+
+    ssize_t count;
+    while ((count = ogwatch_read_batch(watch, events, DAEMON_BATCH_SIZE)) > 0) {
+        for (int i = 0; i < num_clients; i++) {
+            Client *client = clients[i];
+            if (client->fd == -1 || !client->subscribed)
+                continue;
+            for (ssize_t j = 0; j < count; j++)
+                deliver(client, &events[j]);
+            flush_client(client);
+            update_interest(client);
+        }
+    }
+    if (count == -1) {
+        perror("Reading events");
+        exit(EXIT_FAILURE);
+    }
+
+    reap_clients();
+    loop_set_timer(loop, &estale_timer, ogwatch_timeout(watch));
+}
+
+static void handle_watch_ready(int fd, unsigned int events, void *arg) {
+    read_watch();
+}
+
+static void handle_estale_due(void *arg) {
+    read_watch();
+}
+
+void daemon_serve(const WatchOptions *options) {
+    int listen_fd = listen_on(options->listen_path);
+    if (stats_start("daemon", options->stats_fd, options->stats_interval_ms, -1) == -1) {
+        perror("Failed to start stats");
+        exit(EXIT_FAILURE);
+    }
+
+    OgwatchConfig config;
+    config.file_events_mask = options->file_events_mask;
+    config.dir_events_mask = options->dir_events_mask;
+    config.read_buffer_size = options->read_buffer_size;
+    config.scoped_marks = options->scoped_marks;
+    config.threads = options->threads;
+    config.bounded_queue = options->bounded_queue;
+    config.filter = NULL;   // Clients bring their own
+    config.ignore = options->ignore;
+    config.unchanged_max_size = options->unchanged_max_size;
+
+    watch = ogwatch_open(&config);
+    if (watch == NULL) {
+        perror("Failed to start watching");
+        exit(EXIT_FAILURE);
+    }
+
+    // Clients can only subscribe below these, so they're all the watch ever has
+    for (int i = 0; i < roots_count(options->roots); i++) {
+        const char *root = roots_path(options->roots, i);
+        if (ogwatch_add_root(watch, root) == -1) {
+            perror(root);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    daemon_options = options;
+    loop = loop_create();
+    estale_timer = (LoopTimer) { handle_estale_due, NULL, 0 };
+    loop_add(loop, listen_fd, EPOLLIN, handle_listen_ready, NULL);
+    loop_add(loop, ogwatch_fd(watch), EPOLLIN, handle_watch_ready, NULL);
+    loop_run(loop);
+    exit(EXIT_SUCCESS);
+}
+
+// Writes all of a buffer to a blocking socket
+static void write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("write to daemon");
+            exit(EXIT_FAILURE);
+        }
+        data += written;
+        len -= written;
+    }
+}
+
+// Appends a string and its terminator to a request being built
+static size_t add_request_string(char *request, size_t len, const char *str) {
+    size_t str_len = strlen(str) + 1;
+    if (str_len > DAEMON_MAX_REQUEST - len) {
+        fprintf(stderr, "Too many roots and rules to subscribe with\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(request + len, str, str_len);
+    return len + str_len;
+}
+
+void daemon_subscribe(const WatchOptions *options, ReportFunc report, TickFunc tick) {
+    // The daemon does everything that needs root
+    privsep_drop_privileges();
+    if (stats_start("client", options->stats_fd, options->stats_interval_ms, -1) == -1) {
+        perror("Failed to start stats");
+        exit(EXIT_FAILURE);
+    }
+
+    struct sockaddr_un addr;
+    fill_address(&addr, options->connect_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror(options->connect_path);
+        exit(EXIT_FAILURE);
+    }
+
+    SubscribeHeader header;
+    char *request = checked_malloc(DAEMON_MAX_REQUEST);
+    size_t len = sizeof(header);
+
+    for (int i = 0; i < roots_count(options->roots); i++)
+        len = add_request_string(request, len, roots_path(options->roots, i));
+
+    int num_rules = options->filter != NULL ? filter_count(options->filter) : 0;
+    for (int i = 0; i < num_rules; i++) {
+        int exclude;
+        const char *pattern = filter_rule(options->filter, i, &exclude);
+        len = add_request_string(request, len, exclude ? "x" : "i") - 1;
+        len = add_request_string(request, len, pattern);
+    }
+
+    header.length = len;
+    header.version = DAEMON_PROTOCOL_VERSION;
+    header.file_events_mask = options->file_events_mask;
+    header.dir_events_mask = options->dir_events_mask;
+    header.num_roots = roots_count(options->roots);
+    header.num_rules = num_rules;
+    memcpy(request, &header, sizeof(header));
+    write_all(fd, request, len);
+    free(request);
+
+    uint32_t status;
+    size_t received = 0;
+    while (received < sizeof(status)) {
+        ssize_t ret = read(fd, (char *) &status + received, sizeof(status) - received);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            fprintf(stderr, "%s: Daemon hung up\n", options->connect_path);
+            exit(EXIT_FAILURE);
+        }
+        received += ret;
+    }
+    if (status != 0) {
+        errno = status;
+        perror("Subscribing");
+        exit(EXIT_FAILURE);
+    }
+
+    privsep_report_records(fd, options, report, tick);
+
+    fprintf(stderr, "%s: Daemon went away\n", options->connect_path);
+    exit(EXIT_FAILURE);
+}
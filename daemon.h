@@ -0,0 +1,49 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdint.h>
+
+#include "privsep.h"
+
+/* With --listen, one ogwatch owns the fanotify group, and any number of
+   clients subscribe to parts of it over a Unix socket. Each event is
+   resolved once, then passed to every client it concerns.
+
+   A client connects and sends a SubscribeHeader followed by its roots,
+   each a NUL-terminated path to a directory at or below one of the
+   daemon's own that the daemon's real user can get to (anything else is
+   refused with EACCES), and then its rules, each an 'x' (exclude) or
+   'i' (include) followed by a NUL-terminated pattern. The daemon
+   answers with a 32-bit errno value, 0 once the subscription is in place,
+   and then sends events as --format=binary records, with root as the
+   index of a root in the order the client gave them. A FAN_RENAME goes to
+   a client whole only if it sees both paths under the same one of its
+   roots; otherwise, it gets the side it does see as a FAN_MOVED_FROM or
+   FAN_MOVED_TO, unless it asked for those too. A client that falls
+   too far behind loses events, and gets an EVENT_OVERFLOW record for each
+   root it needs to rescan. Clients must run as the same user as the
+   daemon, since that's who events are checked against, or as root. */
+
+#define DAEMON_PROTOCOL_VERSION 2
+#define DAEMON_MAX_REQUEST (64 * 1024)
+#define DAEMON_MAX_CLIENTS 64
+#define DAEMON_CLIENT_BUF_SIZE (1024 * 1024)
+
+typedef struct {
+    uint32_t length;            // Of header, roots and rules together
+    uint32_t version;           // DAEMON_PROTOCOL_VERSION
+    uint32_t file_events_mask;  // Only events the daemon watches for ever come
+    uint32_t dir_events_mask;
+    uint32_t num_roots;
+    uint32_t num_rules;
+} SubscribeHeader;
+
+// Listens on options->listen_path and serves clients. Never returns.
+void daemon_serve(const WatchOptions *options);
+
+// Subscribes to the daemon at options->connect_path with the options'
+// roots, masks and filter, and reports what it sends like any other
+// events. Never returns.
+void daemon_subscribe(const WatchOptions *options, ReportFunc report, TickFunc tick);
+
+#endif
@@ -0,0 +1,387 @@
+/*
+
+Copyright (C) 2024, Andrew Moise <andrew.moise@gmail.com>
+
+Licensed under GNU Affero General Public License, Version 3
+
+*/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dircache.h"
+
+// fsid, handle type, handle length, handle bytes
+#define DIRCACHE_KEY_MAX (sizeof(__kernel_fsid_t) + 2 * sizeof(unsigned int) + MAX_HANDLE_SZ)
+
+typedef struct {
+    unsigned char key[DIRCACHE_KEY_MAX];
+    size_t key_len;
+    uint64_t hash;
+    DirInfo info;
+    int bucket_next;
+    int lru_prev;
+    int lru_next;
+    int path_left;      // In the path tree
+    int path_right;
+} DirCacheEntry;
+
+struct DirCache {
+    DirCacheEntry *entries;
+    size_t capacity;
+    int bounded;    // Evict when full, rather than growing
+    int *buckets;
+    size_t bucket_mask;
+    int lru_head;   // Most recently used
+    int lru_tail;   // Least recently used, evicted first
+    int free_list;  // Chained through lru_next
+    int path_root;  // Of every entry, ordered by path
+    unsigned int access_generation;
+};
+
+static void *xmalloc(size_t size) {
+    void *ptr = malloc(size);
+    if (ptr == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+// Builds the lookup key; returns 0 if the handle is too big to cache.
+static size_t make_key(unsigned char *key, const __kernel_fsid_t *fsid, const struct file_handle *handle) {
+    if (handle->handle_bytes > MAX_HANDLE_SZ)
+        return 0;
+
+    size_t len = 0;
+    memcpy(key + len, fsid, sizeof(*fsid));
+    len += sizeof(*fsid);
+    memcpy(key + len, &handle->handle_type, sizeof(handle->handle_type));
+    len += sizeof(handle->handle_type);
+    memcpy(key + len, &handle->handle_bytes, sizeof(handle->handle_bytes));
+    len += sizeof(handle->handle_bytes);
+    memcpy(key + len, handle->f_handle, handle->handle_bytes);
+    len += handle->handle_bytes;
+    return len;
+}
+
+// FNV-1a
+static uint64_t hash_key(const unsigned char *key, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Puts entries [first, last) on the free list
+static void add_free_entries(DirCache *cache, size_t first, size_t last) {
+    for (size_t i = last; i > first; i--) {
+        cache->entries[i - 1].info.path = NULL;
+        cache->entries[i - 1].lru_next = cache->free_list;
+        cache->free_list = i - 1;
+    }
+}
+
+// Sizes the hash table for the current capacity and rehashes every entry
+static void rebuild_buckets(DirCache *cache) {
+    size_t num_buckets = 1;
+    while (num_buckets < cache->capacity * 2)
+        num_buckets <<= 1;
+
+    free(cache->buckets);
+    cache->buckets = xmalloc(num_buckets * sizeof(*cache->buckets));
+    cache->bucket_mask = num_buckets - 1;
+    for (size_t i = 0; i < num_buckets; i++)
+        cache->buckets[i] = -1;
+
+    for (int i = cache->lru_head; i != -1; i = cache->entries[i].lru_next) {
+        int *bucket = &cache->buckets[cache->entries[i].hash & cache->bucket_mask];
+        cache->entries[i].bucket_next = *bucket;
+        *bucket = i;
+    }
+}
+
+DirCache *dircache_create(size_t capacity) {
+    DirCache *cache = xmalloc(sizeof(*cache));
+    cache->bounded = capacity != 0;
+    cache->capacity = cache->bounded ? capacity : DIRCACHE_DEFAULT_CAPACITY;
+    cache->entries = xmalloc(cache->capacity * sizeof(*cache->entries));
+    cache->buckets = NULL;
+
+    cache->lru_head = -1;
+    cache->lru_tail = -1;
+    cache->free_list = -1;
+    cache->path_root = -1;
+    cache->access_generation = 0;
+    add_free_entries(cache, 0, cache->capacity);
+    rebuild_buckets(cache);
+
+    return cache;
+}
+
+static void grow(DirCache *cache) {
+    size_t old_capacity = cache->capacity;
+    cache->capacity *= 2;
+    cache->entries = realloc(cache->entries, cache->capacity * sizeof(*cache->entries));
+    if (cache->entries == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    add_free_entries(cache, old_capacity, cache->capacity);
+    rebuild_buckets(cache);
+}
+
+void dircache_destroy(DirCache *cache) {
+    for (int i = cache->lru_head; i != -1; i = cache->entries[i].lru_next)
+        free(cache->entries[i].info.path);
+    free(cache->buckets);
+    free(cache->entries);
+    free(cache);
+}
+
+static void lru_unlink(DirCache *cache, int index) {
+    DirCacheEntry *entry = &cache->entries[index];
+    if (entry->lru_prev != -1)
+        cache->entries[entry->lru_prev].lru_next = entry->lru_next;
+    else
+        cache->lru_head = entry->lru_next;
+    if (entry->lru_next != -1)
+        cache->entries[entry->lru_next].lru_prev = entry->lru_prev;
+    else
+        cache->lru_tail = entry->lru_prev;
+}
+
+static void lru_push_front(DirCache *cache, int index) {
+    DirCacheEntry *entry = &cache->entries[index];
+    entry->lru_prev = -1;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head != -1)
+        cache->entries[cache->lru_head].lru_prev = index;
+    cache->lru_head = index;
+    if (cache->lru_tail == -1)
+        cache->lru_tail = index;
+}
+
+/* Every entry is also in a treap ordered by path, and then by index to
+   tell apart two handles with the same path, so that a directory and
+   everything below it can be found without going through the rest. Its
+   priorities come from the key hashes. */
+
+static int path_before(DirCache *cache, int a, int b) {
+    int cmp = strcmp(cache->entries[a].info.path, cache->entries[b].info.path);
+    return cmp < 0 || (cmp == 0 && a < b);
+}
+
+// The key hash, mixed again, since FNV leaves similar handles' hashes alike
+static uint32_t path_priority(DirCache *cache, int index) {
+    uint64_t hash = cache->entries[index].hash;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return (uint32_t) hash;
+}
+
+// Splits the tree at t into what comes before index and what comes after
+static void path_split(DirCache *cache, int t, int index, int *before, int *after) {
+    if (t == -1) {
+        *before = *after = -1;
+    } else if (path_before(cache, t, index)) {
+        path_split(cache, cache->entries[t].path_right, index, &cache->entries[t].path_right, after);
+        *before = t;
+    } else {
+        path_split(cache, cache->entries[t].path_left, index, before, &cache->entries[t].path_left);
+        *after = t;
+    }
+}
+
+// Joins two trees, where everything in a comes before everything in b
+static int path_merge(DirCache *cache, int a, int b) {
+    if (a == -1)
+        return b;
+    if (b == -1)
+        return a;
+    if (path_priority(cache, a) > path_priority(cache, b)) {
+        cache->entries[a].path_right = path_merge(cache, cache->entries[a].path_right, b);
+        return a;
+    }
+    cache->entries[b].path_left = path_merge(cache, a, cache->entries[b].path_left);
+    return b;
+}
+
+static int path_insert(DirCache *cache, int t, int index) {
+    DirCacheEntry *entry = &cache->entries[index];
+    if (t == -1) {
+        entry->path_left = entry->path_right = -1;
+        return index;
+    }
+    if (path_priority(cache, index) > path_priority(cache, t)) {
+        path_split(cache, t, index, &entry->path_left, &entry->path_right);
+        return index;
+    }
+    if (path_before(cache, index, t))
+        cache->entries[t].path_left = path_insert(cache, cache->entries[t].path_left, index);
+    else
+        cache->entries[t].path_right = path_insert(cache, cache->entries[t].path_right, index);
+    return t;
+}
+
+static int path_remove(DirCache *cache, int t, int index) {
+    DirCacheEntry *node = &cache->entries[t];
+    if (t == index)
+        return path_merge(cache, node->path_left, node->path_right);
+    if (path_before(cache, index, t))
+        node->path_left = path_remove(cache, node->path_left, index);
+    else
+        node->path_right = path_remove(cache, node->path_right, index);
+    return t;
+}
+
+// The first entry whose path isn't before path, or -1
+static int path_lower_bound(DirCache *cache, const char *path) {
+    int found = -1;
+    for (int t = cache->path_root; t != -1; ) {
+        if (strcmp(cache->entries[t].info.path, path) >= 0) {
+            found = t;
+            t = cache->entries[t].path_left;
+        } else {
+            t = cache->entries[t].path_right;
+        }
+    }
+    return found;
+}
+
+// Frees an entry that's already out of the path tree
+static void release_entry(DirCache *cache, int index) {
+    DirCacheEntry *entry = &cache->entries[index];
+
+    int *link = &cache->buckets[entry->hash & cache->bucket_mask];
+    while (*link != index)
+        link = &cache->entries[*link].bucket_next;
+    *link = entry->bucket_next;
+
+    lru_unlink(cache, index);
+    free(entry->info.path);
+    entry->info.path = NULL;
+    entry->lru_next = cache->free_list;
+    cache->free_list = index;
+}
+
+static void remove_entry(DirCache *cache, int index) {
+    cache->path_root = path_remove(cache, cache->path_root, index);
+    release_entry(cache, index);
+}
+
+static int find_entry(DirCache *cache, const unsigned char *key, size_t key_len, uint64_t hash) {
+    for (int i = cache->buckets[hash & cache->bucket_mask]; i != -1; i = cache->entries[i].bucket_next) {
+        DirCacheEntry *entry = &cache->entries[i];
+        if (entry->hash == hash && entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0)
+            return i;
+    }
+    return -1;
+}
+
+DirInfo *dircache_lookup(DirCache *cache, const __kernel_fsid_t *fsid, const struct file_handle *handle) {
+    unsigned char key[DIRCACHE_KEY_MAX];
+    size_t key_len = make_key(key, fsid, handle);
+    if (key_len == 0)
+        return NULL;
+
+    int index = find_entry(cache, key, key_len, hash_key(key, key_len));
+    if (index == -1)
+        return NULL;
+
+    lru_unlink(cache, index);
+    lru_push_front(cache, index);
+    return &cache->entries[index].info;
+}
+
+DirInfo *dircache_insert(DirCache *cache, const __kernel_fsid_t *fsid, const struct file_handle *handle, const char *path) {
+    unsigned char key[DIRCACHE_KEY_MAX];
+    size_t key_len = make_key(key, fsid, handle);
+    if (key_len == 0)
+        return NULL;
+
+    uint64_t hash = hash_key(key, key_len);
+    int index = find_entry(cache, key, key_len, hash);
+    if (index != -1)
+        remove_entry(cache, index);
+
+    if (cache->free_list == -1) {
+        if (cache->bounded)
+            remove_entry(cache, cache->lru_tail);
+        else
+            grow(cache);
+    }
+
+    index = cache->free_list;
+    DirCacheEntry *entry = &cache->entries[index];
+    cache->free_list = entry->lru_next;
+
+    memcpy(entry->key, key, key_len);
+    entry->key_len = key_len;
+    entry->hash = hash;
+    entry->info.path = strdup(path);
+    if (entry->info.path == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    entry->info.access = -1;
+    entry->info.excluded = -1;
+
+    int *bucket = &cache->buckets[hash & cache->bucket_mask];
+    entry->bucket_next = *bucket;
+    *bucket = index;
+    lru_push_front(cache, index);
+    cache->path_root = path_insert(cache, cache->path_root, index);
+    return &entry->info;
+}
+
+/* The entries for path itself come first in the tree, then, past any
+   siblings like path-old, everything under path/. Each one found takes a
+   walk down the tree, so this only costs as much as what it drops. */
+void dircache_invalidate_path(DirCache *cache, const char *path) {
+    size_t len = strlen(path);
+    int index;
+
+    while ((index = path_lower_bound(cache, path)) != -1 && strcmp(cache->entries[index].info.path, path) == 0)
+        remove_entry(cache, index);
+
+    // Only "/" already ends in a slash
+    char below[len + 2];
+    memcpy(below, path, len);
+    if (len == 0 || path[len - 1] != '/')
+        below[len++] = '/';
+    below[len] = '\0';
+    while ((index = path_lower_bound(cache, below)) != -1
+           && strncmp(cache->entries[index].info.path, below, len) == 0)
+    {
+        remove_entry(cache, index);
+    }
+}
+
+void dircache_clear(DirCache *cache) {
+    cache->path_root = -1;
+    while (cache->lru_head != -1)
+        release_entry(cache, cache->lru_head);
+}
+
+int dircache_get_access(DirCache *cache, const DirInfo *info) {
+    if (info->access_generation != cache->access_generation)
+        return -1;
+    return info->access;
+}
+
+void dircache_set_access(DirCache *cache, DirInfo *info, int access) {
+    info->access = access;
+    info->access_generation = cache->access_generation;
+}
+
+void dircache_forget_access(DirCache *cache) {
+    cache->access_generation++;
+}
@@ -0,0 +1,43 @@
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/fanotify.h>
+
+#define DIRCACHE_DEFAULT_CAPACITY 4096
+
+// A map from directory file handles (fsid + handle bytes) to their paths.
+// Either a bounded LRU cache of resolved paths, or (with capacity 0) an
+// unbounded table of every directory we know about.
+typedef struct DirCache DirCache;
+
+// What we know about one directory
+typedef struct {
+    char *path;
+    int access;                     // See dircache_get_access()
+    unsigned int access_generation;
+    int excluded;                   // By the path filter: 1 or 0, or -1 if not checked yet
+} DirInfo;
+
+DirCache *dircache_create(size_t capacity);
+void dircache_destroy(DirCache *cache);
+
+// Returns what we know about the directory, or NULL if it is not cached.
+// The result is only good until the cache is next modified.
+DirInfo *dircache_lookup(DirCache *cache, const __kernel_fsid_t *fsid, const struct file_handle *handle);
+DirInfo *dircache_insert(DirCache *cache, const __kernel_fsid_t *fsid, const struct file_handle *handle, const char *path);
+
+// Drops the entry for path and for every directory below it.
+void dircache_invalidate_path(DirCache *cache, const char *path);
+void dircache_clear(DirCache *cache);
+
+// Cached results of the real user's access check for a directory: 1 or 0,
+// or -1 if it needs checking again.
+int dircache_get_access(DirCache *cache, const DirInfo *info);
+void dircache_set_access(DirCache *cache, DirInfo *info, int access);
+
+// Forgets every access result at once, for when permissions change.
+void dircache_forget_access(DirCache *cache);
+
+#endif
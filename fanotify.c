@@ -11,23 +11,52 @@ Licensed under GNU Affero General Public License, Version 3
 */
 
 #define _GNU_SOURCE
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <ftw.h>
 #include <limits.h>
+#include <linux/openat2.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/fanotify.h>
+#include <sys/fsuid.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/time.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
-#include "ogwatch.h"
+#include "libogwatch.h"
+#include "contents.h"
+#include "dircache.h"
+#include "pool.h"
+#include "stats.h"
+#include "trace.h"
 
-#define BUF_SIZE 256
 #define ESTALE_DEBOUNCE_DELAY 50
 
+// Directory events we always need to see, to keep the path cache coherent
+#define DIRCACHE_INVALIDATE_MASK (FAN_MOVED_FROM | FAN_MOVED_TO | FAN_DELETE)
+
+// Events that need directory entry info, which mount marks can't report
+#define DIRENT_EVENTS_MASK (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_RENAME)
+
+// The most events one record turns into: a rename split across roots, and
+// the move it was paired from
+#define MAX_EVENTS_PER_RECORD 3
+
+// Processes to remember the --ignore-* verdict on, per read()
+#define ORIGIN_CACHE_SIZE 16
+
+// How tightly the kernel marks are scoped to the watched tree
+enum {
+    MARK_FILESYSTEM,    // Whole filesystem, filtered by path prefix
+    MARK_MOUNT,         // The mount rooted at the watch path
+    MARK_INODES         // Every directory in the tree, kept up to date
+};
+
 // Define the full list of fanotify events
 static EventMap fanotify_events[] = {
     {"FAN_CREATE", FAN_CREATE},
@@ -39,6 +68,7 @@ static EventMap fanotify_events[] = {
     {"FAN_CLOSE_NOWRITE", FAN_CLOSE_NOWRITE},
     {"FAN_MOVED_FROM", FAN_MOVED_FROM},
     {"FAN_DELETE", FAN_DELETE},
+    {"FAN_RENAME", FAN_RENAME},
     {NULL, 0}
 };
 
@@ -48,11 +78,11 @@ EventMap *get_full_events_list() {
 }
 
 unsigned int get_default_file_events_mask() {
-    return FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_CLOSE_WRITE;
+    return FAN_CREATE | FAN_DELETE | FAN_RENAME | FAN_CLOSE_WRITE;
 }
 
 unsigned int get_default_dir_events_mask() {
-    return FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO;
+    return FAN_CREATE | FAN_DELETE | FAN_RENAME;
 }
 
 unsigned int get_generic_file_events_mask() {
@@ -63,237 +93,1993 @@ unsigned int get_generic_dir_events_mask() {
     return FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO;
 }
 
-int access_is_ok(uid_t real_uid, uid_t effective_uid, const char *path) {
+
+// Results of an access check, besides 1 and 0
+#define ACCESS_GONE -1      // It no longer exists
+#define ACCESS_QUEUED -2    // A resolver thread is checking it
+#define ACCESS_ERROR -3     // The check failed; see errno
+
+/* lstat()s path with the real user's permissions, returning 0 or the
+   errno it failed with. We switch the filesystem uid rather than the
+   effective one: it's all lstat() looks at, and unlike seteuid() under
+   glibc it only affects the calling thread, so resolver threads can do
+   this concurrently. */
+int lstat_as_real_user(uid_t real_uid, uid_t effective_uid, const char *path) {
     struct stat statbuf;
     int result;
 
-    // Drop privileges
-    if (seteuid(real_uid) == -1) {
-        perror("Failed to drop privileges");
-        exit(EXIT_FAILURE);
+    // Drop privileges (setfsuid() returns the previous fsuid, not errors)
+    setfsuid(real_uid);
+    if ((uid_t) setfsuid(real_uid) != real_uid)
+        return EPERM;
+
+    result = lstat(path, &statbuf) == -1 ? errno : 0;
+
+    // Restore privileges
+    setfsuid(effective_uid);
+    if ((uid_t) setfsuid(effective_uid) != effective_uid)
+        return EPERM;
+
+    return result;
+}
+
+/* Opens a file for reading with the real user's permissions, or returns
+   -1. It's only read to see what's in it, so leave its atime alone where
+   we're allowed to. */
+static int open_as_real_user(uid_t real_uid, uid_t effective_uid, const char *path) {
+    setfsuid(real_uid);
+    if ((uid_t) setfsuid(real_uid) != real_uid)
+        return -1;
+
+    int flags = O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC;
+    int fd = open(path, flags | O_NOATIME);
+    if (fd == -1 && errno == EPERM)
+        fd = open(path, flags);
+
+    setfsuid(effective_uid);
+    if ((uid_t) setfsuid(effective_uid) != effective_uid) {
+        if (fd != -1)
+            close(fd);
+        return -1;
     }
-    
-    if (lstat(path, &statbuf) == -1) {
-        if (errno == EACCES) {
-            result = 0;
-        } else if (errno == ENOENT) {
-            result = 1;
-        } else {
-            perror("stat failed");
-            exit(EXIT_FAILURE);
-        }
+    return fd;
+}
+
+// Whether the real user can see path: 1 or 0, or ACCESS_ERROR
+int access_is_ok(uid_t real_uid, uid_t effective_uid, const char *path) {
+    int err = lstat_as_real_user(real_uid, effective_uid, path);
+
+    if (err == 0 || err == ENOENT) {
+        return 1;
+    } else if (err == EACCES) {
+        return 0;
     } else {
-        result = 1;
+        errno = err;
+        return ACCESS_ERROR;
     }
+}
 
-    // Restore privileges
-    if (seteuid(effective_uid) == -1) {
-        perror("Failed to restore privileges");
-        exit(EXIT_FAILURE);
+/* Whether the real user can search dir_path and everything above it, or
+   ACCESS_GONE if it's gone. */
+int check_dir_access(uid_t real_uid, uid_t effective_uid, const char *dir_path) {
+    char dot_path[PATH_MAX + 3];
+    snprintf(dot_path, sizeof(dot_path), "%s/.", dir_path);
+
+    int err = lstat_as_real_user(real_uid, effective_uid, dot_path);
+    if (err == ENOENT || err == ENOTDIR) {
+        return ACCESS_GONE;
+    } else if (err != 0 && err != EACCES) {
+        errno = err;
+        return ACCESS_ERROR;
     }
+    return err == 0;
+}
 
-    return result;
+/* Checks the real user can see an event in the given directory, which is
+   the same as asking whether they can search it and everything above it.
+   That only changes when some directory's permissions or place in the
+   tree do, so we ask the kernel once per directory and keep the answer
+   until we see such a change. */
+int dir_access_is_ok(DirCache *dir_cache, DirInfo *dir, uid_t real_uid, uid_t effective_uid) {
+    int access = dircache_get_access(dir_cache, dir);
+    if (access != -1) {
+        stats_add(STAT_ACCESS_CACHE_HITS, 1);
+        return access;
+    }
+    stats_add(STAT_ACCESS_CACHE_MISSES, 1);
+
+    access = check_dir_access(real_uid, effective_uid, dir->path);
+    if (access == ACCESS_GONE) {
+        // Gone since; fine to report, as with access_is_ok(), but not to remember
+        return 1;
+    } else if (access == ACCESS_ERROR) {
+        return ACCESS_ERROR;
+    }
+
+    dircache_set_access(dir_cache, dir, access);
+    return access;
 }
 
-// Debouncing for ESTALE messages
-int should_print_estale(int fd, struct timeval *estale_timestamp) {
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(fd, &fds);
+#ifndef AT_HANDLE_FID
+#define AT_HANDLE_FID AT_REMOVEDIR
+#endif
 
-    struct timeval now, timeout;
-    gettimeofday(&now, NULL);
+/* Where each watch root lives. Roots on the same filesystem share one
+   mount fd, which is all open_by_handle_at() needs to know. */
+typedef struct {
+    __kernel_fsid_t fsid;
+    int mount_fd;
+    int handle_flags;           // Flags for the handles in the tree table
+} RootInfo;
 
-    long elapsed = (now.tv_sec - estale_timestamp->tv_sec) * 1000 + (now.tv_usec - estale_timestamp->tv_usec) / 1000;
-    long remaining = ESTALE_DEBOUNCE_DELAY - elapsed;
+typedef struct Prefetcher Prefetcher;
 
-    if (remaining > 0) {
-        timeout.tv_sec = remaining / 1000;
-        timeout.tv_usec = (remaining % 1000) * 1000;
-    } else {
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 0;
+struct Ogwatch {
+    OgwatchConfig config;
+    int fd;
+
+    /* One fanotify group serves every root. The roots are kept canonical,
+       as are the paths we get back from the kernel. */
+    RootSet *roots;
+    RootInfo *root_info;
+    int root_info_capacity;
+
+    int mark_mode;
+    int pair_renames;           // No FAN_RENAME here, so renames are paired up from their moves
+    unsigned int tree_mask;     // The mark on every directory, in MARK_INODES mode
+    DirCache *dir_cache;
+    int tree_mode;              // dir_cache is a table of every directory in the tree
+    struct file_handle *handle; // Room for name_to_handle_at()
+
+    uid_t real_uid;
+    uid_t effective_uid;
+    Prefetcher *prefetcher;     // With more than one thread, or NULL
+
+    // What the last read() brought in, and how far through it we are
+    char *events_buf;
+    size_t events_len;
+    size_t events_pos;
+    uint64_t batch_time;
+
+    int estale_pending;
+    uint64_t estale_time_ns;    // When we last reported one
+    int overflow_next;          // The next root to report an overflow for, or -1
+    ssize_t paired_move_pos;    // Where in events_buf a move already reported as a rename is, or -1
+
+    // The paths of the events from the current ogwatch_read_batch()
+    char *arena;
+    size_t arena_used;
+
+    // Events from the last record that didn't fit in the caller's array
+    Event held[MAX_EVENTS_PER_RECORD];
+    int num_held;
+    int held_next;
+
+    // Whether to ignore the processes behind the events of the last read()
+    pid_t origin_pids[ORIGIN_CACHE_SIZE];
+    char origin_ignored[ORIGIN_CACHE_SIZE];
+    int origins_cached;
+
+    // With --skip-unchanged, what each file held at its last close-write
+    ContentCache *contents;
+    pid_t own_pid;              // What our own reads of those files show up as
+
+    // With --record, where what we read goes; with --replay, where it comes from instead of the kernel
+    TraceWriter *recording;
+    TraceReader *replay;
+    int replay_ended;
+
+    int error;                  // Held back for the next ogwatch_read_batch(), or 0
+};
+
+// Enough for any one path, with a name on the end
+#define ARENA_ENTRY_MAX (PATH_MAX + NAME_MAX + 2)
+#define ARENA_SIZE (64 * ARENA_ENTRY_MAX)
+
+// Enough for every path one record can turn into
+#define ARENA_RECORD_MAX (MAX_EVENTS_PER_RECORD * ARENA_ENTRY_MAX)
+
+// The fd to resolve handles from a filesystem against, or -1 if no root is on it
+int mount_fd_for(const Ogwatch *watch, const __kernel_fsid_t *fsid) {
+    for (int i = 0; i < roots_count(watch->roots); i++) {
+        if (memcmp(&watch->root_info[i].fsid, fsid, sizeof(*fsid)) == 0)
+            return watch->root_info[i].mount_fd;
+    }
+    return -1;
+}
+
+/* What scan_tree() does with each directory it finds. nftw() has no
+   context argument, so this is passed through here, from whichever watch
+   is scanning. */
+static struct {
+    int fanotify_fd;            // Mark each directory, unless -1
+    unsigned int mark_mask;
+    DirCache *tree_dirs;        // Record each directory's handle, unless NULL
+    __kernel_fsid_t fsid;
+    int handle_flags;
+    struct file_handle *handle;
+    const PathFilter *filter;   // Leave out excluded subtrees, unless NULL
+    const RootSet *roots;
+    int root;
+    int error;                  // What stopped the walk, or 0
+} tree_scan = { .fanotify_fd = -1 };
+
+/* Adds a directory to the table of directories in the tree, keyed by the
+   same handle fanotify will report for it. */
+int add_tree_dir(const char *path) {
+    int mount_id;
+
+    tree_scan.handle->handle_bytes = MAX_HANDLE_SZ;
+    if (name_to_handle_at(AT_FDCWD, path, tree_scan.handle, &mount_id, tree_scan.handle_flags) == -1)
+        return -1;
+
+    dircache_insert(tree_scan.tree_dirs, &tree_scan.fsid, tree_scan.handle, path);
+    return 0;
+}
+
+static int scan_directory(const char *path, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    if (typeflag != FTW_D && typeflag != FTW_DNR)
+        return FTW_CONTINUE;
+
+    /* Excluded directories get no marks and no table entries, so nothing
+       below them costs us anything again until one is moved out. */
+
+    if (tree_scan.filter != NULL
+        && filter_check_path(tree_scan.filter, roots_relative_path(tree_scan.roots, tree_scan.root, path), 1) == FILTER_EXCLUDE)
+    {
+        return FTW_SKIP_SUBTREE;
+    }
+
+    if (tree_scan.fanotify_fd != -1
+        && fanotify_mark(tree_scan.fanotify_fd, FAN_MARK_ADD, tree_scan.mark_mask, AT_FDCWD, path) == -1)
+    {
+        // It may have gone away while we were walking to it
+        if (errno == ENOENT || errno == ENOTDIR)
+            return FTW_CONTINUE;
+        tree_scan.error = errno;
+        return FTW_STOP;
+    }
+
+    /* Recorded after marking, so anything created inside it from here
+       on will turn up as an event in a directory we know. */
+
+    if (tree_scan.tree_dirs != NULL && add_tree_dir(path) == -1
+        && errno != ENOENT && errno != ENOTDIR)
+    {
+        tree_scan.error = errno;
+        return FTW_STOP;
+    }
+    return FTW_CONTINUE;
+}
+
+// Points tree_scan at a watch's state, for one root
+static void start_scan(Ogwatch *watch, int root) {
+    tree_scan.fanotify_fd = watch->mark_mode == MARK_INODES ? watch->fd : -1;
+    tree_scan.mark_mask = watch->tree_mask;
+    tree_scan.tree_dirs = watch->tree_mode ? watch->dir_cache : NULL;
+    tree_scan.fsid = watch->root_info[root].fsid;
+    tree_scan.handle_flags = watch->root_info[root].handle_flags;
+    tree_scan.handle = watch->handle;
+    tree_scan.filter = watch->config.filter;
+    tree_scan.roots = watch->roots;
+    tree_scan.root = root;
+    tree_scan.error = 0;
+}
+
+// Marks and/or records every directory at or below path, on the same mount
+int scan_tree(Ogwatch *watch, int root, const char *path) {
+    // A replay has no tree; the trace has whatever came of walking it
+    if (watch->replay != NULL)
+        return 0;
+
+    start_scan(watch, root);
+
+    if (nftw(path, scan_directory, 64, FTW_PHYS | FTW_MOUNT | FTW_ACTIONRETVAL) == -1
+        && errno != ENOENT && errno != ENOTDIR)
+    {
+        return -1;
+    }
+    if (tree_scan.error != 0) {
+        errno = tree_scan.error;
+        return -1;
+    }
+    return 0;
+}
+
+// Starts over on every root
+int scan_all_trees(Ogwatch *watch) {
+    for (int i = 0; i < roots_count(watch->roots); i++) {
+        if (scan_tree(watch, i, roots_path(watch->roots, i)) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+/* Renaming the watch root or one of its ancestors changes the path of
+   every directory we know about, and changing their permissions changes
+   who may see what. Both happen outside the tree, so watch for them
+   separately. */
+int mark_ancestors(int fd, const char *root) {
+    char ancestor[PATH_MAX];
+
+    if (realpath(root, ancestor) == NULL)
+        return -1;
+
+    while (1) {
+        if (fanotify_mark(fd, FAN_MARK_ADD, FAN_MOVE_SELF | FAN_ATTRIB | FAN_ONDIR, AT_FDCWD, ancestor) == -1)
+            return -1;
+
+        char *slash = strrchr(ancestor, '/');
+        if (slash == NULL || slash == ancestor)
+            break;
+        *slash = '\0';
+    }
+    return 0;
+}
+
+// 1 or 0, or -1 if we can't tell
+int is_mountpoint(const char *path) {
+    struct statx stx;
+
+    if (statx(AT_FDCWD, path, 0, 0, &stx) == -1)
+        return -1;
+    return (stx.stx_attributes_mask & STATX_ATTR_MOUNT_ROOT)
+        && (stx.stx_attributes & STATX_ATTR_MOUNT_ROOT);
+}
+
+/* Turns a handle into a path the slow way, through the kernel. Returns -1
+   with errno set to ESTALE if the object no longer exists. Safe to call
+   from resolver threads. */
+int open_handle_path(int mount_fd, struct file_handle *file_handle, char *path, size_t path_size) {
+    char procfd_path[PATH_MAX];
+    ssize_t path_len;
+    int event_fd;
+
+    /* metadata->fd is set to FAN_NOFD when the group identifies
+       objects by file handles.  To obtain a file descriptor for
+       the file object corresponding to an event you can use the
+       struct file_handle that's provided within the
+       fanotify_event_info_fid in conjunction with the
+       open_by_handle_at(2) system call.  A check for ESTALE is
+       done to accommodate for the situation where the file handle
+       for the object was deleted prior to this system call. */
+
+    event_fd = open_by_handle_at(mount_fd, file_handle, O_RDONLY);
+    if (event_fd == -1)
+        return -1;
+
+    snprintf(procfd_path, sizeof(procfd_path), "/proc/self/fd/%d",
+            event_fd);
+
+    /* Retrieve the path of the modified dentry. */
+
+    path_len = readlink(procfd_path, path, path_size - 1);
+    if (path_len == -1) {
+        int saved_errno = errno;
+        close(event_fd);
+        errno = saved_errno;
+        return -1;
     }
+    path[path_len] = 0;
+
+    close(event_fd);
+    return 0;
+}
+
+/* Resolves the directory handle in an event info record to a path. Returns
+   -1 with errno set to ESTALE if the directory no longer exists. */
+int resolve_handle(DirCache *dir_cache, int mount_fd, struct fanotify_event_info_fid *fid, char *path, size_t path_size, DirInfo **dir) {
+    struct file_handle *file_handle = (struct file_handle *) fid->handle;
+
+    /* Only directory handles are cached; those are invalidated by the
+       directory move and delete events we always subscribe to. */
+
+    *dir = NULL;
+    int cacheable = dir_cache != NULL && fid->hdr.info_type != FAN_EVENT_INFO_TYPE_FID;
+    if (cacheable) {
+        *dir = dircache_lookup(dir_cache, &fid->fsid, file_handle);
+        if (*dir != NULL) {
+            stats_add(STAT_DIR_CACHE_HITS, 1);
+            snprintf(path, path_size, "%s", (*dir)->path);
+            return 0;
+        }
+        stats_add(STAT_DIR_CACHE_MISSES, 1);
+    }
+
+    if (open_handle_path(mount_fd, file_handle, path, path_size) == -1)
+        return -1;
+
+    if (cacheable)
+        *dir = dircache_insert(dir_cache, &fid->fsid, file_handle, path);
+
+    return 0;
+}
+
+/* Walks the info records in an event for the first one of a type we
+   handle, or of just the given type if that's not 0, and finds the name in
+   it if there is one. Returns NULL if there's no such record. */
+struct fanotify_event_info_fid *find_event_info(struct fanotify_event_metadata *metadata, int info_type, const char **file_name) {
+    char *end = (char *) metadata + metadata->event_len;
+    char *pos = (char *) metadata + metadata->metadata_len;
+
+    while (end - pos >= (ssize_t) sizeof(struct fanotify_event_info_fid)) {
+        struct fanotify_event_info_fid *fid = (struct fanotify_event_info_fid *) pos;
+        if (fid->hdr.len < sizeof(*fid) || fid->hdr.len > end - pos)
+            return NULL;
+        pos += fid->hdr.len;
+
+        int type = fid->hdr.info_type;
+        if (info_type != 0 && type != info_type)
+            continue;
+        struct file_handle *file_handle = (struct file_handle *) fid->handle;
+        if (type == FAN_EVENT_INFO_TYPE_FID || type == FAN_EVENT_INFO_TYPE_DFID) {
+            *file_name = NULL;
+            return fid;
+        } else if (type == FAN_EVENT_INFO_TYPE_DFID_NAME
+            || type == FAN_EVENT_INFO_TYPE_OLD_DFID_NAME
+            || type == FAN_EVENT_INFO_TYPE_NEW_DFID_NAME)
+        {
+            *file_name = (const char *) file_handle->f_handle + file_handle->handle_bytes;
+            return fid;
+        }
+    }
+    return NULL;
+}
+
+/* Finds the info record for what an event happened to, and the name in it
+   if there is one. Returns -1 if there's none we handle. */
+int parse_event_info(struct fanotify_event_metadata *metadata, struct fanotify_event_info_fid **fid, const char **file_name) {
+    *fid = find_event_info(metadata, 0, file_name);
+    return *fid == NULL ? -1 : 0;
+}
+
+// The bits of an event the user asked to see
+unsigned int wanted_bits(const OgwatchConfig *config, unsigned int mask) {
+    return mask & ((mask & FAN_ONDIR) ? config->dir_events_mask : config->file_events_mask);
+}
+
+/* Checks an event against the path filter by its name alone, which is all
+   we know before resolving its directory. */
+int check_event_name(const OgwatchConfig *config, unsigned int mask, const char *file_name) {
+    if (config->filter == NULL)
+        return FILTER_INCLUDE;
+    if (file_name == NULL)
+        return FILTER_NEEDS_PATH;
+    return filter_check_name(config->filter, file_name, (mask & FAN_ONDIR) != 0);
+}
 
-    /* Note - by design this will also not print ESTALE while there are messages waiting to read */
-    int res = select(fd + 1, &fds, NULL, NULL, &timeout);
-    if (res <= 0) {
-        *estale_timestamp = now;
+// The bits of an event the user asked to see, unless its name is excluded
+unsigned int reportable_bits(const OgwatchConfig *config, unsigned int mask, const char *file_name) {
+    if (check_event_name(config, mask, file_name) == FILTER_EXCLUDE)
+        return 0;
+    return wanted_bits(config, mask);
+}
+
+/* Whether the process behind an event is one whose changes we leave out.
+   A handful of processes usually make most of a read's events, so the
+   answers are kept for the rest of it, but no longer, since pids get
+   reused. */
+int ignores_origin(Ogwatch *watch, pid_t pid) {
+    if (watch->contents != NULL && pid == watch->own_pid)
         return 1;
-    } else {
+    if (watch->config.ignore == NULL)
         return 0;
+
+    for (int i = 0; i < watch->origins_cached; i++) {
+        if (watch->origin_pids[i] == pid)
+            return watch->origin_ignored[i];
+    }
+    int ignored = origin_ignores(watch->config.ignore, pid);
+    if (watch->origins_cached < ORIGIN_CACHE_SIZE) {
+        watch->origin_pids[watch->origins_cached] = pid;
+        watch->origin_ignored[watch->origins_cached] = ignored;
+        watch->origins_cached++;
     }
+    return ignored;
+}
+
+// Whether an event changes the set of directories in the tree or their paths
+int changes_dirs(unsigned int mask) {
+    return (mask & FAN_ONDIR) && (mask & (DIRCACHE_INVALIDATE_MASK | FAN_CREATE));
 }
 
-void event_watch_loop(const char *watch_path, unsigned int file_events_mask, unsigned int dir_events_mask, int generic_mode, char terminator) {
-    int fd, ret, event_fd, mount_fd;
-    ssize_t len, path_len;
+/* With -j, the slow kernel calls a batch of events needs (resolving
+   handles we haven't seen, and access checks for directories we haven't
+   checked) are made up front by a pool of threads, and the results left
+   in the cache. The events are then processed in order as usual, so the
+   output is exactly what a single thread would produce. Anything that
+   fails here is left for the main loop to try again and report. */
+
+typedef struct {
+    struct fanotify_event_info_fid *fid;
+    int mount_fd;
+    char *path;         // NULL if it's gone
+} ResolveJob;
+
+typedef struct {
+    DirInfo *dir;
+    int access;
+} AccessJob;
+
+struct Prefetcher {
+    WorkerPool *pool;
+    uid_t real_uid;
+    uid_t effective_uid;
+    DirCache *queued;   // Handles already in resolve_jobs
+    ResolveJob *resolve_jobs;
+    AccessJob *access_jobs;
+    size_t max_jobs;
+};
+
+Prefetcher *prefetcher_create(int threads, size_t read_buffer_size) {
+    Prefetcher *prefetcher = malloc(sizeof(*prefetcher));
+    if (prefetcher == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    prefetcher->pool = pool_create(threads);
+    if (prefetcher->pool == NULL) {
+        free(prefetcher);
+        return NULL;
+    }
+    prefetcher->real_uid = getuid();
+    prefetcher->effective_uid = geteuid();
+    prefetcher->queued = dircache_create(DIRCACHE_DEFAULT_CAPACITY);
+    prefetcher->max_jobs = read_buffer_size / FAN_EVENT_METADATA_LEN;
+    prefetcher->resolve_jobs = malloc(prefetcher->max_jobs * sizeof(ResolveJob));
+    prefetcher->access_jobs = malloc(prefetcher->max_jobs * sizeof(AccessJob));
+    if (prefetcher->resolve_jobs == NULL || prefetcher->access_jobs == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    return prefetcher;
+}
+
+void prefetcher_destroy(Prefetcher *prefetcher) {
+    pool_destroy(prefetcher->pool);
+    dircache_destroy(prefetcher->queued);
+    free(prefetcher->resolve_jobs);
+    free(prefetcher->access_jobs);
+    free(prefetcher);
+}
+
+static void run_resolve_job(size_t index, void *arg) {
+    Prefetcher *prefetcher = arg;
+    ResolveJob *job = &prefetcher->resolve_jobs[index];
     char path[PATH_MAX];
-    char procfd_path[PATH_MAX];
-    char events_buf[BUF_SIZE];
-    struct file_handle *file_handle;
+
+    job->path = NULL;
+    if (open_handle_path(job->mount_fd, (struct file_handle *) job->fid->handle, path, sizeof(path)) == 0) {
+        job->path = strdup(path);
+        if (job->path == NULL) {
+            perror("strdup");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void run_access_job(size_t index, void *arg) {
+    Prefetcher *prefetcher = arg;
+    AccessJob *job = &prefetcher->access_jobs[index];
+
+    job->access = check_dir_access(prefetcher->real_uid, prefetcher->effective_uid, job->dir->path);
+    if (job->access < 0)
+        job->access = -1;
+}
+
+void prefetch_batch(Ogwatch *watch, char *events_buf, ssize_t len) {
+    Prefetcher *prefetcher = watch->prefetcher;
+    DirCache *dir_cache = watch->dir_cache;
+    const OgwatchConfig *config = &watch->config;
     struct fanotify_event_metadata *metadata;
     struct fanotify_event_info_fid *fid;
     const char *file_name;
-    struct stat sb;
+    size_t num_jobs;
+    ssize_t remaining;
+
+    if (dir_cache == NULL)
+        return;
+
+    /* Resolve every directory handle the cache doesn't know, once each.
+       (The tree table already knows every directory that matters.) */
+
+    if (!watch->tree_mode) {
+        num_jobs = 0;
+        remaining = len;
+        for (metadata = (struct fanotify_event_metadata *) events_buf;
+                FAN_EVENT_OK(metadata, remaining);
+                metadata = FAN_EVENT_NEXT(metadata, remaining)) {
+            if (parse_event_info(metadata, &fid, &file_name) == -1
+                || fid->hdr.info_type == FAN_EVENT_INFO_TYPE_FID
+                || ((!reportable_bits(config, metadata->mask, file_name) || ignores_origin(watch, metadata->pid))
+                    && !changes_dirs(metadata->mask)))
+            {
+                continue;
+            }
+
+            struct file_handle *file_handle = (struct file_handle *) fid->handle;
+            int mount_fd = mount_fd_for(watch, &fid->fsid);
+            if (mount_fd == -1
+                || dircache_lookup(dir_cache, &fid->fsid, file_handle) != NULL
+                || dircache_lookup(prefetcher->queued, &fid->fsid, file_handle) != NULL)
+            {
+                continue;
+            }
+            dircache_insert(prefetcher->queued, &fid->fsid, file_handle, "");
+            prefetcher->resolve_jobs[num_jobs].fid = fid;
+            prefetcher->resolve_jobs[num_jobs].mount_fd = mount_fd;
+            num_jobs++;
+        }
+
+        pool_run(prefetcher->pool, num_jobs, run_resolve_job, prefetcher);
 
-    mount_fd = open(watch_path, O_DIRECTORY | O_RDONLY);
-    if (mount_fd == -1) {
-        perror(watch_path);
+        for (size_t i = 0; i < num_jobs; i++) {
+            ResolveJob *job = &prefetcher->resolve_jobs[i];
+            if (job->path != NULL) {
+                dircache_insert(dir_cache, &job->fid->fsid, (struct file_handle *) job->fid->handle, job->path);
+                free(job->path);
+            }
+        }
+        dircache_clear(prefetcher->queued);
+    }
+
+    /* Then check access to every directory in the tree with a reportable
+       event whose access we don't already know. */
+
+    num_jobs = 0;
+    remaining = len;
+    for (metadata = (struct fanotify_event_metadata *) events_buf;
+            FAN_EVENT_OK(metadata, remaining);
+            metadata = FAN_EVENT_NEXT(metadata, remaining)) {
+        if (parse_event_info(metadata, &fid, &file_name) == -1
+            || file_name == NULL
+            || !reportable_bits(config, metadata->mask, file_name)
+            || ignores_origin(watch, metadata->pid))
+        {
+            continue;
+        }
+
+        DirInfo *dir = dircache_lookup(dir_cache, &fid->fsid, (struct file_handle *) fid->handle);
+        if (dir == NULL || dircache_get_access(dir_cache, dir) != -1
+            || (!watch->tree_mode && roots_match(watch->roots, dir->path, strlen(dir->path)) == -1))
+        {
+            continue;
+        }
+        dircache_set_access(dir_cache, dir, ACCESS_QUEUED);
+        prefetcher->access_jobs[num_jobs++].dir = dir;
+    }
+
+    pool_run(prefetcher->pool, num_jobs, run_access_job, prefetcher);
+
+    for (size_t i = 0; i < num_jobs; i++) {
+        AccessJob *job = &prefetcher->access_jobs[i];
+        dircache_set_access(dir_cache, job->dir, job->access);
+    }
+}
+
+// The events to mark for, of those asked for. Without FAN_RENAME, the
+// moves we always mark for stand in for it.
+static unsigned int mark_bits(const Ogwatch *watch, unsigned int mask) {
+    return watch->pair_renames ? mask & ~FAN_RENAME : mask;
+}
+
+// What reading and resolving events needs, whatever they come from
+static void init_buffers(Ogwatch *watch) {
+    watch->handle = malloc(sizeof(struct file_handle) + MAX_HANDLE_SZ);
+    watch->events_buf = malloc(watch->config.read_buffer_size);
+    watch->arena = malloc(ARENA_SIZE);
+    if (watch->handle == NULL || watch->events_buf == NULL || watch->arena == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    watch->estale_time_ns = monotonic_ns();
+    watch->overflow_next = -1;
+    watch->paired_move_pos = -1;
+}
+
+Ogwatch *ogwatch_open(const OgwatchConfig *config) {
+    Ogwatch *watch = calloc(1, sizeof(*watch));
+    if (watch == NULL) {
+        perror("calloc");
         exit(EXIT_FAILURE);
     }
+    watch->config = *config;
+    if (watch->config.read_buffer_size == 0)
+        watch->config.read_buffer_size = DEFAULT_READ_BUFFER_SIZE;
 
     /* Create an fanotify file descriptor with FAN_REPORT_DFID_NAME as
        a flag so that program can receive fid events with directory
        entry name. */
 
-    fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_UNLIMITED_QUEUE, 0);
-    if (fd == -1) {
-        perror("fanotify_init");
-        exit(EXIT_FAILURE);
+    unsigned int init_flags = FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_UNLIMITED_MARKS | FAN_NONBLOCK;
+    if (!config->bounded_queue)
+        init_flags |= FAN_UNLIMITED_QUEUE;
+
+    watch->fd = fanotify_init(init_flags, 0);
+    if (watch->fd == -1) {
+        free(watch);
+        return NULL;
     }
 
-    if (file_events_mask != 0) {
-        ret = fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
-			    file_events_mask | FAN_EVENT_ON_CHILD,
-                            AT_FDCWD, watch_path);
-        if (ret == -1) {
-            perror("fanotify_mark");
-            exit(EXIT_FAILURE);
+    /* FAN_RENAME gives us both sides of a rename in one event, but only
+       since Linux 5.17. Before that, we pair up the two moves a rename
+       makes by the thread that made them, which the group then has to
+       report instead of the process. Removing a mark that isn't there
+       tells us which kernel this is without changing anything. */
+
+    if (((config->file_events_mask | config->dir_events_mask) & FAN_RENAME)
+        && fanotify_mark(watch->fd, FAN_MARK_REMOVE, FAN_RENAME | FAN_ONDIR, AT_FDCWD, "/") == -1
+        && errno == EINVAL)
+    {
+        close(watch->fd);
+        watch->fd = fanotify_init(init_flags | FAN_REPORT_TID, 0);
+        if (watch->fd == -1) {
+            free(watch);
+            return NULL;
         }
+        watch->pair_renames = 1;
     }
 
-    if (dir_events_mask != 0) {
-        ret = fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
-			    dir_events_mask | FAN_ONDIR,
-                            AT_FDCWD, watch_path);
-        if (ret == -1) {
-            perror("fanotify_mark");
-            exit(EXIT_FAILURE);
+    /* Scoped marks keep events from outside the tree from ever reaching
+       us. A mount mark is the cheapest, but can't report directory entry
+       events, so without those we need a mark on every directory. Roots
+       that aren't mountpoints can change that as they're added. */
+
+    watch->mark_mode = MARK_FILESYSTEM;
+    if (config->scoped_marks) {
+        watch->mark_mode = MARK_MOUNT;
+        if ((config->file_events_mask | config->dir_events_mask) & DIRENT_EVENTS_MASK)
+            watch->mark_mode = MARK_INODES;
+    }
+
+    /* All directories get the same mark in MARK_INODES mode, and new ones
+       are found through their create and move events. */
+
+    watch->tree_mask = mark_bits(watch, config->file_events_mask | config->dir_events_mask) | DIRCACHE_INVALIDATE_MASK
+        | FAN_CREATE | FAN_ATTRIB | FAN_EVENT_ON_CHILD | FAN_ONDIR;
+
+    /* Where the filesystem can give us directory handles, we keep a table
+       of every directory in the tree. Events are then placed in or out of
+       the tree with one lookup, and in-tree paths come for free. Without
+       it, we fall back on a cache of resolved paths and a prefix check.
+       Mount marks carry no directory moves to keep either one right. */
+
+    if (watch->mark_mode != MARK_MOUNT) {
+        watch->dir_cache = dircache_create(0);
+        watch->tree_mode = 1;
+    }
+
+    watch->roots = roots_create();
+    init_buffers(watch);
+
+    watch->real_uid = getuid();
+    watch->effective_uid = geteuid();
+    if (config->threads > 1) {
+        watch->prefetcher = prefetcher_create(config->threads, watch->config.read_buffer_size);
+        if (watch->prefetcher == NULL) {
+            int saved_errno = errno;
+            ogwatch_close(watch);
+            errno = saved_errno;
+            return NULL;
         }
     }
+    if (config->unchanged_max_size > 0)
+        watch->contents = contents_create(config->unchanged_max_size);
+    return watch;
+}
 
-    uid_t real_uid = getuid();
-    uid_t effective_uid = geteuid();
+/* A replay is a watch with no kernel behind it: reads come from the trace,
+   and so does what each directory handle resolves to, with everything in
+   between just as it was. It has no tree to walk or check access in, so
+   it starts with neither the tree table nor the path cache. */
+Ogwatch *ogwatch_open_replay(const OgwatchConfig *config, int fd) {
+    Ogwatch *watch = calloc(1, sizeof(*watch));
+    if (watch == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    watch->config = *config;
+    watch->config.ignore = NULL;
+    watch->config.unchanged_max_size = 0;
+    watch->fd = -1;
 
-    struct timeval estale_timestamp;
-    gettimeofday(&estale_timestamp, NULL);
-    int estale_pending = 0;
+    TraceInfo info;
+    watch->roots = roots_create();
+    watch->replay = trace_reader_create(fd, &info, watch->roots);
+    if (watch->replay != NULL
+        && (info.read_buffer_size < MIN_READ_BUFFER_SIZE || info.read_buffer_size > MAX_READ_BUFFER_SIZE))
+    {
+        trace_reader_destroy(watch->replay);
+        watch->replay = NULL;
+        errno = EINVAL;
+    }
+    if (watch->replay == NULL) {
+        roots_destroy(watch->roots);
+        free(watch);
+        return NULL;
+    }
 
-    while(1) {
-        /* Print an ESTALE if we have one, subject to debouncing */
-        if (estale_pending) {
-            if (should_print_estale(fd, &estale_timestamp)) {
-                if (!generic_mode)
-                    printf("ESTALE\n");
-                estale_pending = 0;
-            }
+    // Every read has to fit as it did
+    watch->config.read_buffer_size = info.read_buffer_size;
+    watch->mark_mode = info.mark_mode;
+    watch->pair_renames = info.pair_renames;
+
+    watch->root_info_capacity = roots_count(watch->roots) ? roots_count(watch->roots) : 1;
+    watch->root_info = calloc(watch->root_info_capacity, sizeof(*watch->root_info));
+    if (watch->root_info == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < roots_count(watch->roots); i++)
+        watch->root_info[i].mount_fd = -1;
+
+    init_buffers(watch);
+    return watch;
+}
+
+/* Finds the handle flags that give us the handles fanotify reports for a
+   root. Returns -1 if its filesystem can't give us handles at all. */
+static int init_tree_root(Ogwatch *watch, int root) {
+    const char *path = roots_path(watch->roots, root);
+
+    /* AT_HANDLE_FID gives exactly the handles fanotify reports, but older
+       kernels don't have it; the plain handle is the same for a directory. */
+
+    start_scan(watch, root);
+    tree_scan.handle_flags = AT_HANDLE_FID;
+    int ret = add_tree_dir(path);
+    if (ret == -1 && errno == EINVAL) {
+        tree_scan.handle_flags = 0;
+        ret = add_tree_dir(path);
+    }
+    if (ret == -1)
+        return -1;
+    watch->root_info[root].handle_flags = tree_scan.handle_flags;
+    return 0;
+}
+
+// Marks, records and scans a root that's new to the watch
+static int start_root(Ogwatch *watch, int root) {
+    const char *path = roots_path(watch->roots, root);
+    unsigned int file_events_mask = mark_bits(watch, watch->config.file_events_mask);
+    unsigned int dir_events_mask = mark_bits(watch, watch->config.dir_events_mask);
+
+    if (watch->mark_mode != MARK_INODES) {
+        unsigned int mark_flags = FAN_MARK_ADD | (watch->mark_mode == MARK_MOUNT ? FAN_MARK_MOUNT : FAN_MARK_FILESYSTEM);
+
+        /* Roots on the same filesystem get the same filesystem mark,
+           which the kernel merges into one. */
+
+        if (file_events_mask != 0
+            && fanotify_mark(watch->fd, mark_flags, file_events_mask | FAN_EVENT_ON_CHILD, AT_FDCWD, path) == -1)
+        {
+            return -1;
+        }
+
+        /* A mount mark can't carry the directory moves the path cache
+           relies on, so that mode goes without the cache. */
+
+        unsigned int dir_mark_mask = dir_events_mask;
+        if (watch->mark_mode == MARK_FILESYSTEM)
+            dir_mark_mask |= DIRCACHE_INVALIDATE_MASK | FAN_CREATE | FAN_ATTRIB;
+        if (dir_mark_mask != 0
+            && fanotify_mark(watch->fd, mark_flags, dir_mark_mask | FAN_ONDIR, AT_FDCWD, path) == -1)
+        {
+            return -1;
         }
+    }
+
+    /* A filesystem that can't give us handles leaves us with just the
+       cache, for this root and all the others. */
+
+    if (watch->tree_mode && init_tree_root(watch, root) == -1) {
+        dircache_destroy(watch->dir_cache);
+        watch->dir_cache = dircache_create(DIRCACHE_DEFAULT_CAPACITY);
+        watch->tree_mode = 0;
+    }
+
+    /* The marks are in place first, so any directory the walk misses
+       will show up as an event instead. */
+
+    if ((watch->tree_mode || watch->mark_mode == MARK_INODES) && scan_tree(watch, root, path) == -1)
+        return -1;
+    if (watch->dir_cache != NULL && mark_ancestors(watch->fd, path) == -1)
+        return -1;
+    return 0;
+}
+
+/* A mount mark only covers roots that are mountpoints. Once there's one
+   that isn't, every root has to be watched directory by directory,
+   including the one that isn't. */
+static int switch_to_inode_marks(Ogwatch *watch) {
+    if (fanotify_mark(watch->fd, FAN_MARK_FLUSH | FAN_MARK_MOUNT, 0, AT_FDCWD, "/") == -1)
+        return -1;
+
+    watch->mark_mode = MARK_INODES;
+    watch->dir_cache = dircache_create(0);
+    watch->tree_mode = 1;
+    for (int i = 0; i < roots_count(watch->roots); i++) {
+        if (start_root(watch, i) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+/* Takes back a root that couldn't be set up, leaving the watch as it
+   was. Directory marks it already has stay, since other roots may share
+   them; what they report is under no root, and dropped. */
+static void forget_root(Ogwatch *watch, int root, const char *path, int owns_mount_fd) {
+    int saved_errno = errno;
+
+    if (owns_mount_fd) {
+        if (watch->mark_mode != MARK_INODES) {
+            unsigned int mark_flags = FAN_MARK_REMOVE | (watch->mark_mode == MARK_MOUNT ? FAN_MARK_MOUNT : FAN_MARK_FILESYSTEM);
+            unsigned int mask = mark_bits(watch, watch->config.file_events_mask | watch->config.dir_events_mask)
+                | DIRCACHE_INVALIDATE_MASK | FAN_CREATE | FAN_ATTRIB | FAN_EVENT_ON_CHILD | FAN_ONDIR;
+            fanotify_mark(watch->fd, mark_flags, mask, AT_FDCWD, path);
+        }
+        close(watch->root_info[root].mount_fd);
+    }
 
-        /* Read events from the event queue into a buffer. */
-        len = read(fd, events_buf, sizeof(events_buf));
-        if (len == -1 && errno != EAGAIN) {
-            perror("read");
+    // Its directories can go from the cache too, unless another root needs them
+    roots_remove_last(watch->roots);
+    size_t path_len = strlen(path);
+    int overlaps = roots_match(watch->roots, path, path_len) != -1;
+    for (int i = 0; i < roots_count(watch->roots) && !overlaps; i++) {
+        const char *other = roots_path(watch->roots, i);
+        overlaps = strncmp(other, path, path_len) == 0 && (other[path_len] == '/' || path_len == 1);
+    }
+    if (watch->dir_cache != NULL && !overlaps)
+        dircache_invalidate_path(watch->dir_cache, path);
+
+    errno = saved_errno;
+}
+
+int ogwatch_add_root(Ogwatch *watch, const char *path) {
+    char canonical[PATH_MAX];
+    struct statfs sfs;
+
+    if (realpath(path, canonical) == NULL || statfs(canonical, &sfs) == -1)
+        return -1;
+
+    int existing = roots_match(watch->roots, canonical, strlen(canonical));
+    if (existing != -1 && strcmp(roots_path(watch->roots, existing), canonical) == 0)
+        return existing;
+
+    // Whatever can fail without changing the watch goes first
+    int mountpoint = 1;
+    if (watch->mark_mode == MARK_MOUNT && (mountpoint = is_mountpoint(canonical)) == -1)
+        return -1;
+
+    __kernel_fsid_t fsid;
+    memcpy(&fsid, &sfs.f_fsid, sizeof(fsid));
+    int mount_fd = mount_fd_for(watch, &fsid);
+    int owns_mount_fd = mount_fd == -1;
+    if (owns_mount_fd) {
+        mount_fd = open(canonical, O_DIRECTORY | O_RDONLY);
+        if (mount_fd == -1)
+            return -1;
+    }
+
+    int num_roots = roots_count(watch->roots);
+    if (num_roots == watch->root_info_capacity) {
+        watch->root_info_capacity = watch->root_info_capacity ? watch->root_info_capacity * 2 : 16;
+        watch->root_info = realloc(watch->root_info, watch->root_info_capacity * sizeof(*watch->root_info));
+        if (watch->root_info == NULL) {
+            perror("realloc");
             exit(EXIT_FAILURE);
         }
+    }
 
-        /* Process all events within the buffer. */
+    int root = roots_add(watch->roots, canonical);
+    RootInfo *info = &watch->root_info[root];
+    info->fsid = fsid;
+    info->handle_flags = 0;
+    info->mount_fd = mount_fd;
 
-        for (metadata = (struct fanotify_event_metadata *) events_buf;
-                FAN_EVENT_OK(metadata, len);
-                metadata = FAN_EVENT_NEXT(metadata, len)) {
-            fid = (struct fanotify_event_info_fid *) (metadata + 1);
-            file_handle = (struct file_handle *) fid->handle;
-
-            /* Ensure that the event info is of the correct type. */
-
-            if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_FID ||
-                fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID) {
-                file_name = NULL;
-            } else if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME
-                || fid->hdr.info_type == FAN_EVENT_INFO_TYPE_OLD_DFID_NAME
-                || fid->hdr.info_type == FAN_EVENT_INFO_TYPE_NEW_DFID_NAME)
-            {
-                file_name = file_handle->f_handle +
-                            file_handle->handle_bytes;
+    int ret = mountpoint ? start_root(watch, root) : switch_to_inode_marks(watch);
+    if (ret == -1) {
+        forget_root(watch, root, canonical, owns_mount_fd);
+        return -1;
+    }
+    return root;
+}
+
+int ogwatch_record(Ogwatch *watch, int fd) {
+    TraceInfo info = { watch->mark_mode, watch->pair_renames, watch->config.read_buffer_size };
+    watch->recording = trace_writer_create(fd, &info, watch->roots);
+    return watch->recording == NULL ? -1 : 0;
+}
+
+int ogwatch_root_count(const Ogwatch *watch) {
+    return roots_count(watch->roots);
+}
+
+const char *ogwatch_root_path(const Ogwatch *watch, int root) {
+    return roots_path(watch->roots, root);
+}
+
+int ogwatch_fd(const Ogwatch *watch) {
+    return watch->fd;
+}
+
+/* ESTALEs are debounced: one goes out once the queue has gone quiet, and
+   no sooner than ESTALE_DEBOUNCE_DELAY after the last. */
+int ogwatch_timeout(const Ogwatch *watch) {
+    if (!watch->estale_pending)
+        return -1;
+    // A replay's queue only goes quiet at the end of the trace
+    if (watch->replay != NULL)
+        return 0;
+
+    long elapsed = (monotonic_ns() - watch->estale_time_ns) / 1000000;
+    return elapsed < ESTALE_DEBOUNCE_DELAY ? ESTALE_DEBOUNCE_DELAY - elapsed : 0;
+}
+
+/* Maps the directory handle in an event to a path. Directories outside the
+   tree aren't in the table, so in tree mode this is also the tree check.
+   Returns 1 if it found the directory, 0 if it's outside the tree, or -1
+   on error, with errno set to ESTALE if the directory no longer exists. */
+static int lookup_event_dir(Ogwatch *watch, struct fanotify_event_info_fid *fid, char *path, DirInfo **dir) {
+    *dir = NULL;
+    if (watch->tree_mode) {
+        *dir = dircache_lookup(watch->dir_cache, &fid->fsid, (struct file_handle *) fid->handle);
+        if (*dir == NULL)
+            return 0;
+        snprintf(path, PATH_MAX, "%s", (*dir)->path);
+        return 1;
+    }
+
+    int mount_fd = mount_fd_for(watch, &fid->fsid);
+    if (mount_fd == -1)
+        return 0;
+    return resolve_handle(watch->dir_cache, mount_fd, fid, path, PATH_MAX, dir) == -1 ? -1 : 1;
+}
+
+/* Recording keeps what each lookup came to, by where its handle is in
+   the buffer, and replaying gives it back from there. */
+static int resolve_event_dir(Ogwatch *watch, struct fanotify_event_info_fid *fid, char *path, DirInfo **dir) {
+    size_t offset = (char *) fid - watch->events_buf;
+
+    if (watch->replay != NULL) {
+        const char *found_path;
+        *dir = NULL;
+        switch (trace_lookup_dir(watch->replay, offset, &found_path)) {
+            case TRACE_DIR_FOUND:
+                snprintf(path, PATH_MAX, "%s", found_path);
+                return 1;
+            case TRACE_DIR_GONE:
+                errno = ESTALE;
+                return -1;
+            default:
+                return 0;
+        }
+    }
+
+    int found = lookup_event_dir(watch, fid, path, dir);
+    if (watch->recording != NULL) {
+        if (found == 1)
+            trace_write_dir(watch->recording, offset, TRACE_DIR_FOUND, path);
+        else if (found == 0)
+            trace_write_dir(watch->recording, offset, TRACE_DIR_OUTSIDE, NULL);
+        else if (errno == ESTALE)
+            trace_write_dir(watch->recording, offset, TRACE_DIR_GONE, NULL);
+    }
+    return found;
+}
+
+// Whether an entry in the tree can be reported
+enum {
+    ENTRY_VISIBLE,
+    ENTRY_EXCLUDED,     // By the path filter
+    ENTRY_NO_ACCESS     // The real user can't see it
+};
+
+/* Checks an entry in the tree against the rest of the path filter, which
+   needs to know where it is: the directories above, and rules on the whole
+   path. Excluded directories never make it into the tree table, so in tree
+   mode the directories are already taken care of. Then checks that the
+   real user can see it. The directory part of full_path is dir_len long.
+   Returns one of the ENTRY_* values, or -1 on error. */
+static int check_entry(Ogwatch *watch, int root, char *full_path, size_t dir_len, DirInfo *dir,
+                       const char *file_name, int is_dir, int name_verdict)
+{
+    const OgwatchConfig *config = &watch->config;
+
+    if (config->filter != NULL) {
+        int excluded = 0;
+
+        // The directory part of the path is cut off at the slash while we look
+        if (!watch->tree_mode) {
+            char saved = full_path[dir_len];
+            full_path[dir_len] = '\0';
+            if (dir != NULL) {
+                if (dir->excluded == -1)
+                    dir->excluded = filter_excludes(config->filter, roots_relative_path(watch->roots, root, full_path), 1);
+                excluded = dir->excluded;
             } else {
-                printf("Skipping info type %d\n", fid->hdr.info_type);
+                excluded = filter_excludes(config->filter, roots_relative_path(watch->roots, root, full_path), 1);
+            }
+            full_path[dir_len] = saved;
+        }
+        if (!excluded && file_name != NULL && name_verdict == FILTER_NEEDS_PATH)
+            excluded = filter_check_path(config->filter, roots_relative_path(watch->roots, root, full_path), is_dir) == FILTER_EXCLUDE;
+        if (excluded)
+            return ENTRY_EXCLUDED;
+    }
+
+    // Only root can record, and root can see everything
+    if (watch->replay != NULL)
+        return ENTRY_VISIBLE;
+
+    int access_ok;
+    if (dir != NULL && file_name != NULL)
+        access_ok = dir_access_is_ok(watch->dir_cache, dir, watch->real_uid, watch->effective_uid);
+    else
+        access_ok = access_is_ok(watch->real_uid, watch->effective_uid, full_path);
+    if (access_ok == ACCESS_ERROR)
+        return -1;
+    return access_ok ? ENTRY_VISIBLE : ENTRY_NO_ACCESS;
+}
+
+// One side of a rename, and whether we can report it
+typedef struct {
+    char *path;
+    size_t path_len;
+    int root;               // -1 if it can't be reported
+    StatCounter dropped;    // Why not, if so, or NUM_STATS
+} RenameSide;
+
+/* Finds where one side of a rename is, if it's given, putting its path
+   together at path. Returns -1 on error. */
+static int locate_rename_side(Ogwatch *watch, struct fanotify_event_info_fid *fid, const char *file_name, int is_dir,
+                              char *path, RenameSide *side)
+{
+    side->path = path;
+    side->path_len = 0;
+    side->root = -1;
+
+    // Without a mark on its directory, the kernel leaves a side out
+    if (fid == NULL) {
+        side->dropped = STAT_DROPPED_OUTSIDE;
+        return 0;
+    }
+
+    int name_verdict = check_event_name(&watch->config, is_dir ? FAN_ONDIR : 0, file_name);
+    if (name_verdict == FILTER_EXCLUDE) {
+        side->dropped = STAT_DROPPED_FILTER;
+        return 0;
+    }
+
+    DirInfo *dir;
+    int found = resolve_event_dir(watch, fid, path, &dir);
+    if (found == -1) {
+        if (errno != ESTALE)
+            return -1;
+        stats_add(STAT_ESTALE, 1);
+        watch->estale_pending = 1;
+        side->dropped = NUM_STATS;  // Counted already
+        return 0;
+    }
+    size_t dir_len = found ? strlen(path) : 0;
+    int root = found ? roots_match(watch->roots, path, dir_len) : -1;
+    if (root == -1) {
+        side->dropped = STAT_DROPPED_OUTSIDE;
+        return 0;
+    }
+    side->path_len = dir_len + snprintf(path + dir_len, ARENA_ENTRY_MAX - dir_len, "/%s", file_name);
+
+    int verdict = check_entry(watch, root, path, dir_len, dir, file_name, is_dir, name_verdict);
+    if (verdict == -1)
+        return -1;
+    if (verdict != ENTRY_VISIBLE) {
+        side->dropped = verdict == ENTRY_EXCLUDED ? STAT_DROPPED_FILTER : STAT_DROPPED_ACCESS;
+        return 0;
+    }
+    side->root = root;
+    return 0;
+}
+
+/* Reports a rename as one event, from one path to the other, if we can see
+   both sides of it under the same root. Otherwise whichever side we can
+   see is reported as the move it is from there, unless moves were asked
+   for too, and come as events of their own. Renames don't change the tree
+   themselves; that's left to the moves. Returns how many events it filled
+   in, or -1 on error. */
+static int report_rename(Ogwatch *watch, int is_dir, struct fanotify_event_info_fid *old_fid, const char *old_name,
+                         struct fanotify_event_info_fid *new_fid, const char *new_name, Event *events)
+{
+    static const unsigned int side_masks[2] = { FAN_MOVED_FROM, FAN_MOVED_TO };
+    unsigned int flags = is_dir ? EVENT_IS_DIR : 0;
+    RenameSide sides[2];
+
+    char *path = watch->arena + watch->arena_used;
+    if (locate_rename_side(watch, old_fid, old_name, is_dir, path, &sides[0]) == -1)
+        return -1;
+    if (sides[0].root != -1)
+        path += sides[0].path_len + 1;
+    if (locate_rename_side(watch, new_fid, new_name, is_dir, path, &sides[1]) == -1)
+        return -1;
+    if (sides[1].root != -1)
+        path += sides[1].path_len + 1;
+
+    int count = 0;
+    if (sides[0].root != -1 && sides[0].root == sides[1].root) {
+        Event rename = { FAN_RENAME, flags, sides[1].path, sides[1].path_len, watch->batch_time, sides[1].root,
+                         sides[0].path, sides[0].path_len };
+        events[count++] = rename;
+    } else {
+        for (int i = 0; i < 2; i++) {
+            if (sides[i].root == -1)
+                continue;
+            if (wanted_bits(&watch->config, side_masks[i] | (is_dir ? FAN_ONDIR : 0))) {
+                sides[i].dropped = STAT_DROPPED_MASK;
                 continue;
             }
+            Event move = { side_masks[i], flags, sides[i].path, sides[i].path_len, watch->batch_time, sides[i].root, NULL, 0 };
+            events[count++] = move;
+        }
+    }
+
+    if (count == 0) {
+        if (sides[1].dropped != NUM_STATS)
+            stats_add(sides[1].dropped, 1);
+        return 0;
+    }
+    watch->arena_used = path - watch->arena;
+    stats_add(STAT_EMITTED, count);
+    return count;
+}
+
+// How far ahead to look for the other half of a move
+#define PAIR_SEARCH_MAX 64
+
+/* Without FAN_RENAME, a rename is a FAN_MOVED_FROM and then a FAN_MOVED_TO,
+   queued one straight after the other by the thread making it. Other
+   threads' events can come in between, but none of its own, so a thread's
+   next event after moving something away is where it went, if it's a
+   move at all. That only holds if the kernel reports both, as it always
+   does with a filesystem mark, and neither was merged into an earlier
+   event. When the other half is in the buffer, the two are reported
+   together here as a rename, ahead of them, just as the kernel would have
+   reported it. Returns how many events it filled in, or -1 on error. */
+static int pair_rename(Ogwatch *watch, struct fanotify_event_metadata *metadata, Event *events) {
+    if ((metadata->mask & ~FAN_ONDIR) != FAN_MOVED_FROM || watch->mark_mode != MARK_FILESYSTEM)
+        return 0;
+
+    struct fanotify_event_metadata *next = (struct fanotify_event_metadata *) (watch->events_buf + watch->events_pos);
+    ssize_t remaining = watch->events_len - watch->events_pos;
+    for (int i = 0; i < PAIR_SEARCH_MAX && FAN_EVENT_OK(next, remaining); i++) {
+        if (next->pid == metadata->pid)
+            break;
+        next = FAN_EVENT_NEXT(next, remaining);
+    }
+    if (!FAN_EVENT_OK(next, remaining) || next->pid != metadata->pid
+        || next->mask != ((metadata->mask & FAN_ONDIR) | FAN_MOVED_TO))
+    {
+        return 0;
+    }
+
+    const char *old_name, *new_name;
+    struct fanotify_event_info_fid *old_fid = find_event_info(metadata, FAN_EVENT_INFO_TYPE_DFID_NAME, &old_name);
+    struct fanotify_event_info_fid *new_fid = find_event_info(next, FAN_EVENT_INFO_TYPE_DFID_NAME, &new_name);
+    if (old_fid == NULL || new_fid == NULL)
+        return 0;
+
+    watch->paired_move_pos = (char *) next - watch->events_buf;
+    return report_rename(watch, (metadata->mask & FAN_ONDIR) != 0, old_fid, old_name, new_fid, new_name, events);
+}
+
+/* Handles one event record, and fills in the events it turns into, up to
+   MAX_EVENTS_PER_RECORD. Returns how many, or -1 on error. */
+static int process_event(Ogwatch *watch, struct fanotify_event_metadata *metadata, Event *events) {
+    const OgwatchConfig *config = &watch->config;
+    DirCache *dir_cache = watch->dir_cache;
+    struct fanotify_event_info_fid *fid;
+    const char *file_name;
+
+    stats_add(STAT_EVENTS, 1);
+    uint64_t event_start = monotonic_ns();
+
+    /* With a bounded queue, the kernel's queue filled up and events were
+       lost. Anything could have changed, including the directories we
+       know about, so start over and have every root rescanned. */
+
+    if (metadata->mask & FAN_Q_OVERFLOW) {
+        stats_add(STAT_OVERFLOWS, 1);
+        if (dir_cache != NULL)
+            dircache_clear(dir_cache);
+        if ((watch->tree_mode || watch->mark_mode == MARK_INODES) && scan_all_trees(watch) == -1)
+            return -1;
+        watch->overflow_next = 0;
+        return 0;
+    }
+
+    /* A watch root or one of its ancestors was renamed, so every
+       path we know about may have changed. Start over from
+       whatever is at the watch paths now, including whatever is
+       above them, whose permissions we now have to watch instead. */
+
+    if (metadata->mask & FAN_MOVE_SELF) {
+        if (dir_cache != NULL)
+            dircache_clear(dir_cache);
+        if (watch->tree_mode && scan_all_trees(watch) == -1)
+            return -1;
+        for (int i = 0; dir_cache != NULL && watch->replay == NULL && i < roots_count(watch->roots); i++) {
+            if (mark_ancestors(watch->fd, roots_path(watch->roots, i)) == -1 && errno != ENOENT)
+                return -1;
+        }
+        return 0;
+    }
+
+    /* A rename carries a record for each side, and comes ahead of the
+       moves it's made of. */
+
+    if (metadata->mask & FAN_RENAME) {
+        const char *old_name, *new_name;
+        struct fanotify_event_info_fid *old_fid = find_event_info(metadata, FAN_EVENT_INFO_TYPE_OLD_DFID_NAME, &old_name);
+        struct fanotify_event_info_fid *new_fid = find_event_info(metadata, FAN_EVENT_INFO_TYPE_NEW_DFID_NAME, &new_name);
+        if (!(wanted_bits(config, metadata->mask) & FAN_RENAME)) {
+            stats_add(STAT_DROPPED_MASK, 1);
+            return 0;
+        }
+        if (ignores_origin(watch, metadata->pid)) {
+            stats_add(STAT_DROPPED_ORIGIN, 1);
+            return 0;
+        }
+        int count = report_rename(watch, (metadata->mask & FAN_ONDIR) != 0, old_fid, old_name, new_fid, new_name, events);
+        if (count > 0)
+            stats_record(HIST_RESOLVE_NS, monotonic_ns() - event_start);
+        return count;
+    }
+
+    /* Cached access checks hold until some directory's permissions
+       or place in the tree change, wherever it is. */
+
+    if ((metadata->mask & FAN_ONDIR) && (metadata->mask & (FAN_ATTRIB | FAN_MOVED_FROM | FAN_MOVED_TO))
+        && dir_cache != NULL)
+    {
+        dircache_forget_access(dir_cache);
+    }
+
+    /* Without FAN_RENAME, renames are pieced together from their moves.
+       A move we can't pair up stands in for its rename instead. */
+
+    int count = 0;
+    unsigned int standing_in = 0;
+    int ignored = ignores_origin(watch, metadata->pid);
+    if (watch->pair_renames && !ignored && (metadata->mask & (FAN_MOVED_FROM | FAN_MOVED_TO))
+        && (wanted_bits(config, (metadata->mask & FAN_ONDIR) | FAN_RENAME) & FAN_RENAME))
+    {
+        if ((char *) metadata - watch->events_buf == watch->paired_move_pos) {
+            watch->paired_move_pos = -1;
+        } else {
+            count = pair_rename(watch, metadata, events);
+            if (count == -1)
+                return -1;
+            if (watch->paired_move_pos == -1)
+                standing_in = metadata->mask & (FAN_MOVED_FROM | FAN_MOVED_TO);
+        }
+    }
+
+    if (parse_event_info(metadata, &fid, &file_name) == -1)
+        return count;
+
+    /* Drop events nobody wants before paying to resolve them,
+       including those with excluded names, and those made by processes
+       we ignore. We still need directory changes to keep our own state
+       right. */
+
+    int dir_changed = changes_dirs(metadata->mask);
+    int name_verdict = check_event_name(config, metadata->mask, file_name);
+    int excluded = name_verdict == FILTER_EXCLUDE;
+    unsigned int want_mask = (excluded || ignored) ? 0 : wanted_bits(config, metadata->mask) | standing_in;
+    if (!want_mask && !dir_changed) {
+        stats_add(ignored ? STAT_DROPPED_ORIGIN : excluded ? STAT_DROPPED_FILTER : STAT_DROPPED_MASK, 1);
+        return count;
+    }
+
+    /* Map the handle to a path, straight into the arena, where the full
+       path is then put together. */
+
+    char *path = watch->arena + watch->arena_used;
+    DirInfo *dir = NULL;
+    int found = resolve_event_dir(watch, fid, path, &dir);
+    if (found == 0) {
+        stats_add(STAT_DROPPED_OUTSIDE, 1);
+        return count;
+    } else if (found == -1) {
+        if (errno != ESTALE)
+            return -1;
+
+        /* If we can't tell which directory moved, we can't tell
+           which cached paths it invalidated either. */
+        if (dir_changed && dir_cache != NULL)
+            dircache_clear(dir_cache);
+        stats_add(STAT_ESTALE, 1);
+        watch->estale_pending = 1;
+        return count;
+    }
+
+    size_t path_len = strlen(path);
+    char *full_path = path;
+    size_t full_path_len = path_len;
+    if (file_name != NULL)
+        full_path_len += snprintf(path + path_len, ARENA_ENTRY_MAX - path_len, "/%s", file_name);
+
+    /* A directory moving or going away makes every cached path
+       at or below it stale, whether or not we report the event. */
+
+    if (dir_changed && dir_cache != NULL && file_name != NULL
+        && (metadata->mask & DIRCACHE_INVALIDATE_MASK))
+    {
+        dircache_invalidate_path(dir_cache, full_path);
+    }
+
+    /* Find which root we're under, which also checks we're under
+       one at all if the table didn't already tell us. */
+
+    int root = roots_match(watch->roots, path, path_len);
+    if (root == -1) {
+        stats_add(STAT_DROPPED_OUTSIDE, 1);
+        return count;
+    }
+
+    /* Check the rest of the filter, and that we have access to the
+       location of the event. This comes before the scan below, which
+       may move dir in memory. */
+
+    int verdict = ENTRY_VISIBLE;
+    if (want_mask) {
+        verdict = check_entry(watch, root, full_path, path_len, dir, file_name, (metadata->mask & FAN_ONDIR) != 0, name_verdict);
+        if (verdict == -1)
+            return -1;
+        if (verdict == ENTRY_EXCLUDED) {
+            excluded = 1;
+            want_mask = 0;
+        }
+    }
+
+    /* New directories in the tree need marks and table entries of
+       their own, along with anything already created inside them. */
+
+    if ((watch->tree_mode || watch->mark_mode == MARK_INODES) && dir_changed && file_name != NULL
+        && (metadata->mask & (FAN_CREATE | FAN_MOVED_TO))
+        && scan_tree(watch, root, full_path) == -1)
+    {
+        return -1;
+    }
+
+    /* Only report the events that were asked for; the marks may
+       include extra events for our own benefit. */
+
+    if (!want_mask) {
+        stats_add(ignored ? STAT_DROPPED_ORIGIN : excluded ? STAT_DROPPED_FILTER : STAT_DROPPED_MASK, 1);
+        return count;
+    }
+
+    if (verdict == ENTRY_NO_ACCESS) {
+        stats_add(STAT_DROPPED_ACCESS, 1);
+        return count;
+    }
+
+    /* A file closed after writing that holds just what it did last time
+       wasn't really changed. Anything we can't open counts as changed. */
+
+    if (watch->contents != NULL && (want_mask & FAN_CLOSE_WRITE) && !(metadata->mask & FAN_ONDIR)) {
+        int fd = open_as_real_user(watch->real_uid, watch->effective_uid, full_path);
+        if (fd != -1) {
+            if (contents_unchanged(watch->contents, full_path, fd))
+                want_mask &= ~FAN_CLOSE_WRITE;
+            close(fd);
+        }
+        if (!want_mask) {
+            stats_add(STAT_DROPPED_UNCHANGED, 1);
+            return count;
+        }
+    }
+
+    /* We passed the checks, report the event */
+
+    Event *event = &events[count];
+    event->mask = want_mask;
+    event->flags = (metadata->mask & FAN_ONDIR) ? EVENT_IS_DIR : 0;
+    event->path = full_path;
+    event->path_len = full_path_len;
+    event->timestamp_ns = watch->batch_time;
+    event->root = root;
+    event->from_path = NULL;
+    event->from_path_len = 0;
+    watch->arena_used += full_path_len + 1;
+
+    stats_add(STAT_EMITTED, 1);
+    stats_record(HIST_RESOLVE_NS, monotonic_ns() - event_start);
+    return count + 1;
+}
+
+/* Reads more events after whatever is left of the last read, which the
+   kernel should only ever leave as whole records. But be safe about one
+   cut off at the end of the buffer: keep it to finish this time. */
+static ssize_t read_events(Ogwatch *watch) {
+    size_t carry_len = watch->events_len - watch->events_pos;
+    if (carry_len > 0) {
+        struct fanotify_event_metadata *metadata = (struct fanotify_event_metadata *) (watch->events_buf + watch->events_pos);
+        if (carry_len >= FAN_EVENT_METADATA_LEN
+            && (metadata->event_len < FAN_EVENT_METADATA_LEN
+                || metadata->event_len > watch->config.read_buffer_size))
+        {
+            errno = EBADMSG;
+            return -1;
+        }
+        memmove(watch->events_buf, metadata, carry_len);
+    }
+    if (watch->paired_move_pos != -1)
+        watch->paired_move_pos -= watch->events_pos;
+    watch->events_pos = 0;
+    watch->events_len = carry_len;
+    watch->origins_cached = 0;
+
+    char *buf = watch->events_buf + carry_len;
+    size_t buf_size = watch->config.read_buffer_size - carry_len;
+    ssize_t len;
+    if (watch->replay != NULL) {
+        len = trace_next_read(watch->replay, buf, buf_size, &watch->batch_time);
+        if (len == 0) {
+            watch->replay_ended = 1;
+            errno = EAGAIN;
+            return -1;
+        }
+        if (len == -1)
+            return -1;
+    } else {
+        len = read(watch->fd, buf, buf_size);
+        if (len == -1)
+            return -1;
+        watch->batch_time = monotonic_ns();
+        if (watch->recording != NULL)
+            trace_write_read(watch->recording, watch->batch_time, buf, len);
+    }
+    stats_add(STAT_READS, 1);
+    stats_add(STAT_READ_BYTES, len);
+    stats_record(HIST_READ_BYTES, len);
+    watch->events_len += len;
+
+    if (watch->prefetcher != NULL)
+        prefetch_batch(watch, watch->events_buf, watch->events_len);
+    return len;
+}
+
+ssize_t ogwatch_read_batch(Ogwatch *watch, Event *events, size_t max_events) {
+    size_t count = 0;
+
+    if (watch->error != 0) {
+        errno = watch->error;
+        watch->error = 0;
+        return -1;
+    }
+    /* Reads of files we hash come back as events from this thread, which
+       the group reports by thread id when it's pairing renames. */
+    if (watch->contents != NULL)
+        watch->own_pid = watch->pair_renames ? (pid_t) syscall(SYS_gettid) : getpid();
+
+    // Paths of events still held back from last time are still in use
+    if (watch->held_next == watch->num_held)
+        watch->arena_used = 0;
+
+    while (count < max_events) {
+        if (watch->held_next < watch->num_held) {
+            events[count++] = watch->held[watch->held_next++];
+            continue;
+        }
+
+        // Each root gets an overflow event of its own, however many calls that takes
+        if (watch->overflow_next != -1) {
+            int root = watch->overflow_next;
+            const char *path = roots_path(watch->roots, root);
+            Event overflow = { 0, EVENT_OVERFLOW | EVENT_IS_DIR, path, strlen(path), watch->batch_time, root, NULL, 0 };
+            events[count++] = overflow;
+            if (++watch->overflow_next == roots_count(watch->roots))
+                watch->overflow_next = -1;
+            continue;
+        }
+
+        /* Only read more once everything so far is out, so a busy queue
+           can't keep a batch from ever ending. */
 
-            /* metadata->fd is set to FAN_NOFD when the group identifies
-            objects by file handles.  To obtain a file descriptor for
-            the file object corresponding to an event you can use the
-            struct file_handle that's provided within the
-            fanotify_event_info_fid in conjunction with the
-            open_by_handle_at(2) system call.  A check for ESTALE is
-            done to accommodate for the situation where the file handle
-            for the object was deleted prior to this system call. */
-
-            event_fd = open_by_handle_at(mount_fd, file_handle, O_RDONLY);
-            if (event_fd == -1) {
-                if (errno == ESTALE) {
-                    estale_pending = 1;
-                    continue;
-                } else {
-                    perror("open_by_handle_at");
-                    exit(EXIT_FAILURE);
+        ssize_t remaining = watch->events_len - watch->events_pos;
+        struct fanotify_event_metadata *metadata = (struct fanotify_event_metadata *) (watch->events_buf + watch->events_pos);
+        if (!FAN_EVENT_OK(metadata, remaining)) {
+            if (count > 0)
+                break;
+            if (read_events(watch) == -1) {
+                if (errno != EAGAIN && errno != EINTR)
+                    return -1;
+
+                // The queue is quiet, so now's the time for an ESTALE
+                if (watch->estale_pending && ogwatch_timeout(watch) == 0) {
+                    Event estale = { 0, EVENT_ESTALE, "", 0, monotonic_ns(), -1, NULL, 0 };
+                    events[count++] = estale;
+                    watch->estale_pending = 0;
+                    watch->estale_time_ns = estale.timestamp_ns;
                 }
+                break;
             }
+            continue;
+        }
 
-            snprintf(procfd_path, sizeof(procfd_path), "/proc/self/fd/%d",
-                    event_fd);
+        if (ARENA_SIZE - watch->arena_used < ARENA_RECORD_MAX)
+            break;
 
-            /* Retrieve and print the path of the modified dentry. */
+        watch->events_pos += metadata->event_len;
+        Event *record_events = events + count;
+        if (max_events - count < MAX_EVENTS_PER_RECORD)
+            record_events = watch->held;
+        int ret = process_event(watch, metadata, record_events);
+        if (ret == -1) {
+            // Whatever we have so far still goes out
+            if (count == 0)
+                return -1;
+            watch->error = errno;
+            break;
+        }
 
-            path_len = readlink(procfd_path, path, sizeof(path) - 1);
-            if (path_len == -1) {
-                perror("readlink");
-                exit(EXIT_FAILURE);
-            }
-            path[path_len] = 0;
+        // Short of room, the record's events wait in held for their turn
+        if (record_events == watch->held) {
+            watch->num_held = ret;
+            watch->held_next = 0;
+            continue;
+        }
+        count += ret;
+    }
 
-            /* Do our cleanup now, so we can just 'continue' in order not to print */
+    // The trace keeps up with what we report, so one cut short still covers it
+    if (watch->recording != NULL && trace_flush(watch->recording) == -1) {
+        if (count == 0)
+            return -1;
+        watch->error = errno;
+    }
+    return count;
+}
 
-            if (close(event_fd) == -1) {
-                perror("close");
-                exit(EXIT_FAILURE);
-            }
+int ogwatch_replay_done(const Ogwatch *watch) {
+    ssize_t remaining = watch->events_len - watch->events_pos;
+    struct fanotify_event_metadata *metadata = (struct fanotify_event_metadata *) (watch->events_buf + watch->events_pos);
+    return watch->replay_ended && !FAN_EVENT_OK(metadata, remaining) && watch->held_next == watch->num_held
+        && watch->overflow_next == -1 && !watch->estale_pending;
+}
+
+/* A baseline of everything in the trees, walked once the marks are in
+   place, so that anything that changes while we walk also turns up as an
+   event afterwards. The walk goes a level at a time, with a pool job per
+   directory, and the entries are reported from the calling thread in the
+   order their directories were listed. */
+
+// Directories to list at a go, which bounds how many listings we hold
+#define SCAN_CHUNK_DIRS 1024
+#define SCAN_DENTS_SIZE (32 * 1024)
+
+typedef struct {
+    char *path;         // Terminated, and ours to free
+    size_t path_len;
+    int root;
+    dev_t dev;          // The root's filesystem, which the walk stays on
+} ScanDir;
+
+typedef struct {
+    size_t path_offset; // Into the listing's paths
+    size_t path_len;
+    int root;
+    int is_dir;
+    int descend;        // A directory to list in turn, not another root
+} ScanEntry;
 
-            /* Check that we're in the watched subdir */
+typedef struct {
+    char *paths;        // Of each entry, back to back and terminated
+    size_t paths_used;
+    size_t paths_size;
+    ScanEntry *entries;
+    size_t num_entries;
+    size_t max_entries;
+    int error;          // What stopped the listing, or 0
+} ScanListing;
 
-            if (strncmp(path, watch_path, strlen(watch_path)) != 0)
+typedef struct {
+    Ogwatch *watch;
+    ScanDir *dirs;
+    ScanListing *listings;
+} ScanChunk;
+
+static void add_scan_entry(Ogwatch *watch, const ScanDir *dir, ScanListing *listing, const char *name, int is_dir) {
+    size_t name_len = strlen(name);
+    size_t needed = dir->path_len + name_len + 2;
+    if (listing->paths_used + needed > listing->paths_size) {
+        size_t new_size = listing->paths_size ? listing->paths_size : 64 * 1024;
+        while (listing->paths_used + needed > new_size)
+            new_size *= 2;
+        listing->paths = realloc(listing->paths, new_size);
+        if (listing->paths == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        listing->paths_size = new_size;
+    }
+
+    // Roots are canonical, so only "/" ends in a slash
+    char *path = listing->paths + listing->paths_used;
+    size_t path_len = dir->path_len;
+    memcpy(path, dir->path, path_len);
+    if (path_len > 1)
+        path[path_len++] = '/';
+    memcpy(path + path_len, name, name_len + 1);
+    path_len += name_len;
+
+    // A directory that's a root of its own belongs to that root, and is
+    // walked as one
+    int root = is_dir ? roots_match(watch->roots, path, path_len) : dir->root;
+    if (watch->config.filter != NULL
+        && filter_check_path(watch->config.filter, roots_relative_path(watch->roots, root, path), is_dir) == FILTER_EXCLUDE)
+    {
+        return;
+    }
+
+    if (listing->num_entries == listing->max_entries) {
+        listing->max_entries = listing->max_entries ? listing->max_entries * 2 : 1024;
+        listing->entries = realloc(listing->entries, listing->max_entries * sizeof(*listing->entries));
+        if (listing->entries == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    ScanEntry *entry = &listing->entries[listing->num_entries++];
+    entry->path_offset = listing->paths_used;
+    entry->path_len = path_len;
+    entry->root = root;
+    entry->is_dir = is_dir;
+    entry->descend = is_dir && root == dir->root;
+    listing->paths_used += path_len + 1;
+}
+
+/* Opens a directory to list with the real user's permissions, so that
+   the kernel checks they could read it and search everything above it.
+   Roots are canonical and the rest of the path is names we listed, so a
+   symlink anywhere in it is something swapped in since, and refused. */
+static int open_scan_dir(Ogwatch *watch, const char *path) {
+    setfsuid(watch->real_uid);
+    if ((uid_t) setfsuid(watch->real_uid) != watch->real_uid) {
+        errno = EPERM;
+        return -1;
+    }
+
+    struct open_how how = { .flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC,
+                            .resolve = RESOLVE_NO_SYMLINKS | RESOLVE_NO_MAGICLINKS };
+    int fd = syscall(SYS_openat2, AT_FDCWD, path, &how, sizeof(how));
+    if (fd == -1 && errno == ENOSYS)
+        fd = open(path, how.flags);
+    int saved_errno = errno;
+
+    setfsuid(watch->effective_uid);
+    if ((uid_t) setfsuid(watch->effective_uid) != watch->effective_uid) {
+        if (fd != -1)
+            close(fd);
+        errno = EPERM;
+        return -1;
+    }
+    errno = saved_errno;
+    return fd;
+}
+
+/* Lists one directory with getdents64(), looking entries up relative to
+   it only when the filesystem doesn't say what type they are. */
+static void list_scan_dir(size_t index, void *arg) {
+    ScanChunk *chunk = arg;
+    Ogwatch *watch = chunk->watch;
+    const ScanDir *dir = &chunk->dirs[index];
+    ScanListing *listing = &chunk->listings[index];
+    char dents[SCAN_DENTS_SIZE];
+
+    listing->paths_used = 0;
+    listing->num_entries = 0;
+    listing->error = 0;
+
+    /* Only what the real user could list themselves, and see events on,
+       which takes searching the directory as well as reading it. */
+    int access = check_dir_access(watch->real_uid, watch->effective_uid, dir->path);
+    if (access == ACCESS_ERROR) {
+        listing->error = errno;
+        return;
+    } else if (access != 1) {
+        return;
+    }
+
+    int fd = open_scan_dir(watch, dir->path);
+    if (fd == -1) {
+        // It may have gone away since its parent was listed, or been
+        // swapped for something else
+        if (errno != ENOENT && errno != ENOTDIR && errno != ELOOP && errno != EACCES)
+            listing->error = errno;
+        return;
+    }
+
+    // Nothing below a mount point reaches our marks
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == -1) {
+        listing->error = errno;
+        close(fd);
+        return;
+    }
+    if (statbuf.st_dev != dir->dev) {
+        close(fd);
+        return;
+    }
+
+    ssize_t len;
+    while ((len = getdents64(fd, dents, sizeof(dents))) > 0) {
+        for (ssize_t pos = 0; pos < len; ) {
+            struct dirent64 *dent = (struct dirent64 *) (dents + pos);
+            pos += dent->d_reclen;
+
+            const char *name = dent->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
                 continue;
 
-            /* Check that we have access to the location of the event */
+            int is_dir = dent->d_type == DT_DIR;
+            if (dent->d_type == DT_UNKNOWN) {
+                if (fstatat(fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) == -1) {
+                    if (errno == ENOENT)
+                        continue;
+                    listing->error = errno;
+                    close(fd);
+                    return;
+                }
+                is_dir = S_ISDIR(statbuf.st_mode);
+            }
+            add_scan_entry(watch, dir, listing, name, is_dir);
+        }
+    }
+    if (len == -1 && errno != ENOENT)
+        listing->error = errno;
+    close(fd);
+}
 
-            int full_path_len = strlen(path) + 1;
-            if (file_name != NULL)
-                full_path_len += strlen(file_name) + 1;
-            
-            char full_path[full_path_len];
-            if (file_name != NULL)
-                snprintf(full_path, full_path_len, "%s/%s", path, file_name);
-            else
-                snprintf(full_path, full_path_len, "%s", path);
+static void add_scan_dir(ScanDir **dirs, size_t *num_dirs, size_t *dirs_size, const char *path, size_t path_len,
+                         int root, dev_t dev)
+{
+    if (*num_dirs == *dirs_size) {
+        *dirs_size = *dirs_size ? *dirs_size * 2 : 64;
+        *dirs = realloc(*dirs, *dirs_size * sizeof(**dirs));
+        if (*dirs == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    ScanDir *dir = &(*dirs)[(*num_dirs)++];
+    dir->path = strndup(path, path_len);
+    if (dir->path == NULL) {
+        perror("strndup");
+        exit(EXIT_FAILURE);
+    }
+    dir->path_len = path_len;
+    dir->root = root;
+    dir->dev = dev;
+}
+
+int ogwatch_scan(Ogwatch *watch, int threads, OgwatchScanFunc func, void *arg) {
+    ScanDir *dirs = NULL, *next_dirs = NULL;
+    size_t num_dirs = 0, dirs_size = 0, num_next = 0, next_size = 0;
+    int error = 0;
 
-            if (!access_is_ok(real_uid, effective_uid, full_path))
+    for (int i = 0; i < roots_count(watch->roots); i++) {
+        const char *path = roots_path(watch->roots, i);
+        struct stat statbuf;
+        if (stat(path, &statbuf) == -1) {
+            if (errno == ENOENT)
                 continue;
+            error = errno;
+            break;
+        }
+        add_scan_dir(&dirs, &num_dirs, &dirs_size, path, strlen(path), i, statbuf.st_dev);
+    }
+
+    WorkerPool *pool = NULL;
+    if (error == 0) {
+        pool = pool_create(threads > 1 ? threads : 1);
+        if (pool == NULL)
+            error = errno;
+    }
+    ScanListing *listings = calloc(SCAN_CHUNK_DIRS, sizeof(*listings));
+    if (listings == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    while (num_dirs > 0 && error == 0) {
+        for (size_t start = 0; start < num_dirs && error == 0; start += SCAN_CHUNK_DIRS) {
+            size_t count = num_dirs - start < SCAN_CHUNK_DIRS ? num_dirs - start : SCAN_CHUNK_DIRS;
+            ScanChunk chunk = { watch, dirs + start, listings };
+            pool_run(pool, count, list_scan_dir, &chunk);
 
-            /* We passed the checks, print events */
+            uint64_t now = monotonic_ns();
+            for (size_t i = 0; i < count && error == 0; i++) {
+                const ScanListing *listing = &listings[i];
+                error = listing->error;
+                for (size_t j = 0; j < listing->num_entries && error == 0; j++) {
+                    const ScanEntry *entry = &listing->entries[j];
+                    const char *path = listing->paths + entry->path_offset;
+                    Event event = { 0, EVENT_SNAPSHOT | (entry->is_dir ? EVENT_IS_DIR : 0), path, entry->path_len,
+                                    now, entry->root, NULL, 0 };
+                    func(&event, arg);
 
-            if (!generic_mode) {
-                const char *dir_or_file = (metadata->mask & FAN_ONDIR) ? "|FAN_ONDIR" : "";
-                for (int i = 0; fanotify_events[i].name != NULL; i++) {
-                    if (metadata->mask & fanotify_events[i].value) {
-                        printf("%s%s %s/%s%c", fanotify_events[i].name, dir_or_file, path, file_name, terminator);
-                        fflush(stdout); // Ensure immediate output
+                    if (entry->descend) {
+                        add_scan_dir(&next_dirs, &num_next, &next_size, path, entry->path_len, entry->root,
+                                     dirs[start + i].dev);
                     }
                 }
-            } else {
-                printf("%s/%s%c", path, file_name, terminator);
-                fflush(stdout); // Ensure immediate output
             }
         }
+
+        // On to the next level down
+        for (size_t i = 0; i < num_dirs; i++)
+            free(dirs[i].path);
+        ScanDir *swap = dirs;
+        dirs = next_dirs;
+        next_dirs = swap;
+        num_dirs = num_next;
+        num_next = 0;
+        size_t swap_size = dirs_size;
+        dirs_size = next_size;
+        next_size = swap_size;
+    }
+
+    for (size_t i = 0; i < num_dirs; i++)
+        free(dirs[i].path);
+    for (size_t i = 0; i < num_next; i++)
+        free(next_dirs[i].path);
+    for (size_t i = 0; i < SCAN_CHUNK_DIRS; i++) {
+        free(listings[i].paths);
+        free(listings[i].entries);
     }
+    free(listings);
+    free(dirs);
+    free(next_dirs);
+    if (pool != NULL)
+        pool_destroy(pool);
+
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+void ogwatch_close(Ogwatch *watch) {
+    for (int i = 0; i < roots_count(watch->roots); i++) {
+        int shared = 0;
+        for (int j = 0; j < i; j++) {
+            if (watch->root_info[j].mount_fd == watch->root_info[i].mount_fd)
+                shared = 1;
+        }
+        if (!shared && watch->root_info[i].mount_fd != -1)
+            close(watch->root_info[i].mount_fd);
+    }
+
+    if (watch->prefetcher != NULL)
+        prefetcher_destroy(watch->prefetcher);
+    if (watch->dir_cache != NULL)
+        dircache_destroy(watch->dir_cache);
+    if (watch->contents != NULL)
+        contents_destroy(watch->contents);
+    if (watch->recording != NULL)
+        trace_writer_destroy(watch->recording);
+    if (watch->replay != NULL)
+        trace_reader_destroy(watch->replay);
+    roots_destroy(watch->roots);
+    if (watch->fd != -1)
+        close(watch->fd);
+    free(watch->root_info);
+    free(watch->handle);
+    free(watch->events_buf);
+    free(watch->arena);
+    free(watch);
 }
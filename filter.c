@@ -0,0 +1,193 @@
+/*
+
+Copyright (C) 2024, Andrew Moise <andrew.moise@gmail.com>
+
+Licensed under GNU Affero General Public License, Version 3
+
+*/
+
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+
+/* Most patterns people write are a plain name, "*.ext" or "name*", which
+   a compare does as well as fnmatch() and much faster. Each rule is
+   compiled into the cheapest way of matching it. */
+typedef enum {
+    MATCH_LITERAL,
+    MATCH_SUFFIX,       // "*" followed by text
+    MATCH_PREFIX,       // Text followed by "*"
+    MATCH_GLOB
+} MatchKind;
+
+typedef struct {
+    char *source;       // As given
+    char *pattern;      // Without the "*" for suffix and prefix matches
+    size_t len;
+    MatchKind kind;
+    int on_path;        // Match the path below the root, not the name
+    int dir_only;
+    int exclude;
+} FilterRule;
+
+struct PathFilter {
+    FilterRule *rules;
+    int count;
+    int capacity;
+};
+
+PathFilter *filter_create() {
+    PathFilter *filter = malloc(sizeof(*filter));
+    if (filter == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    filter->rules = NULL;
+    filter->count = 0;
+    filter->capacity = 0;
+    return filter;
+}
+
+void filter_destroy(PathFilter *filter) {
+    for (int i = 0; i < filter->count; i++) {
+        free(filter->rules[i].source);
+        free(filter->rules[i].pattern);
+    }
+    free(filter->rules);
+    free(filter);
+}
+
+static int has_wildcards(const char *str, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (str[i] == '*' || str[i] == '?' || str[i] == '[' || str[i] == '\\')
+            return 1;
+    }
+    return 0;
+}
+
+void filter_add(PathFilter *filter, const char *pattern, int exclude) {
+    if (filter->count == filter->capacity) {
+        filter->capacity = filter->capacity ? filter->capacity * 2 : 16;
+        filter->rules = realloc(filter->rules, filter->capacity * sizeof(*filter->rules));
+        if (filter->rules == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    FilterRule *rule = &filter->rules[filter->count++];
+    rule->exclude = exclude;
+    rule->source = strdup(pattern);
+    if (rule->source == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+
+    // A leading slash just anchors the pattern to the root
+    rule->on_path = 0;
+    while (*pattern == '/') {
+        rule->on_path = 1;
+        pattern++;
+    }
+
+    size_t len = strlen(pattern);
+    rule->dir_only = 0;
+    while (len > 0 && pattern[len - 1] == '/') {
+        rule->dir_only = 1;
+        len--;
+    }
+    if (memchr(pattern, '/', len) != NULL)
+        rule->on_path = 1;
+
+    /* Only whole names get the cheap matches; on a path, "*" mustn't
+       cross a slash. */
+
+    rule->kind = MATCH_GLOB;
+    if (!has_wildcards(pattern, len)) {
+        rule->kind = MATCH_LITERAL;
+    } else if (!rule->on_path && len > 1 && pattern[0] == '*' && !has_wildcards(pattern + 1, len - 1)) {
+        rule->kind = MATCH_SUFFIX;
+        pattern++;
+        len--;
+    } else if (!rule->on_path && len > 1 && pattern[len - 1] == '*' && !has_wildcards(pattern, len - 1)) {
+        rule->kind = MATCH_PREFIX;
+        len--;
+    }
+
+    rule->pattern = strndup(pattern, len);
+    if (rule->pattern == NULL) {
+        perror("strndup");
+        exit(EXIT_FAILURE);
+    }
+    rule->len = len;
+}
+
+int filter_is_empty(const PathFilter *filter) {
+    return filter->count == 0;
+}
+
+int filter_count(const PathFilter *filter) {
+    return filter->count;
+}
+
+const char *filter_rule(const PathFilter *filter, int index, int *exclude) {
+    *exclude = filter->rules[index].exclude;
+    return filter->rules[index].source;
+}
+
+static int rule_matches(const FilterRule *rule, const char *subject, int is_dir) {
+    if (rule->dir_only && !is_dir)
+        return 0;
+
+    size_t len = strlen(subject);
+    switch (rule->kind) {
+        case MATCH_LITERAL:
+            return len == rule->len && memcmp(subject, rule->pattern, len) == 0;
+        case MATCH_SUFFIX:
+            return len >= rule->len && memcmp(subject + len - rule->len, rule->pattern, rule->len) == 0;
+        case MATCH_PREFIX:
+            return len >= rule->len && memcmp(subject, rule->pattern, rule->len) == 0;
+        default:
+            return fnmatch(rule->pattern, subject, rule->on_path ? FNM_PATHNAME : 0) == 0;
+    }
+}
+
+int filter_check_name(const PathFilter *filter, const char *name, int is_dir) {
+    for (int i = filter->count - 1; i >= 0; i--) {
+        const FilterRule *rule = &filter->rules[i];
+        if (rule->on_path)
+            return FILTER_NEEDS_PATH;
+        if (rule_matches(rule, name, is_dir))
+            return rule->exclude ? FILTER_EXCLUDE : FILTER_INCLUDE;
+    }
+    return FILTER_INCLUDE;
+}
+
+int filter_check_path(const PathFilter *filter, const char *rel_path, int is_dir) {
+    const char *slash = strrchr(rel_path, '/');
+    const char *name = (slash != NULL) ? slash + 1 : rel_path;
+
+    for (int i = filter->count - 1; i >= 0; i--) {
+        const FilterRule *rule = &filter->rules[i];
+        if (rule_matches(rule, rule->on_path ? rel_path : name, is_dir))
+            return rule->exclude ? FILTER_EXCLUDE : FILTER_INCLUDE;
+    }
+    return FILTER_INCLUDE;
+}
+
+int filter_excludes(const PathFilter *filter, const char *rel_path, int is_dir) {
+    size_t len = strlen(rel_path);
+    char prefix[len + 1];
+
+    for (size_t i = 0; i < len; i++) {
+        if (rel_path[i] != '/')
+            continue;
+        memcpy(prefix, rel_path, i);
+        prefix[i] = '\0';
+        if (filter_check_path(filter, prefix, 1) == FILTER_EXCLUDE)
+            return 1;
+    }
+    return len > 0 && filter_check_path(filter, rel_path, is_dir) == FILTER_EXCLUDE;
+}
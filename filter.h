@@ -0,0 +1,35 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+// Verdicts
+#define FILTER_INCLUDE 0
+#define FILTER_EXCLUDE 1
+#define FILTER_NEEDS_PATH 2     // Can't tell from the name alone
+
+// Ordered --include and --exclude glob rules, where the last rule that
+// matches wins. A pattern without a slash matches names at any depth; one
+// with a slash matches the path below the root. A trailing slash limits a
+// rule to directories.
+typedef struct PathFilter PathFilter;
+
+PathFilter *filter_create();
+void filter_destroy(PathFilter *filter);
+void filter_add(PathFilter *filter, const char *pattern, int exclude);
+int filter_is_empty(const PathFilter *filter);
+
+// The rules in the order added, as they were given to filter_add()
+int filter_count(const PathFilter *filter);
+const char *filter_rule(const PathFilter *filter, int index, int *exclude);
+
+// Checks an entry by its name alone, without knowing where it is
+int filter_check_name(const PathFilter *filter, const char *name, int is_dir);
+
+// Checks an entry by its path below the root, without a leading slash. This
+// doesn't look at the directories above it; see filter_excludes().
+int filter_check_path(const PathFilter *filter, const char *rel_path, int is_dir);
+
+// Whether an entry is excluded, either itself or along with a directory
+// somewhere above it.
+int filter_excludes(const PathFilter *filter, const char *rel_path, int is_dir);
+
+#endif
@@ -15,6 +15,8 @@ Licensed under GNU Affero General Public License, Version 3
 #include <sys/time.h>
 
 #include "ogwatch.h"
+#include "coalesce.h"
+#include "stats.h"
 
 static EventMap fsevents_events[] = {
     {"None", kFSEventStreamEventFlagNone},
@@ -64,13 +66,53 @@ unsigned int get_generic_dir_events_mask() {
 }
 
 typedef struct {
-    const char *watch_path;
+    const WatchOptions *options;
+    const RootSet *roots;
     int generic_mode;
     unsigned int file_events_mask;
     unsigned int dir_events_mask;
     char terminator;
+    OutputFormat format;
+    Coalescer **pending_paths;  // Per root, with -w; the stream latency is the window
 } EventWatcherContext;
 
+typedef struct {
+    EventWatcherContext *contextData;
+    int root;
+} PendingRoot;
+
+static void report_path(const char *path, size_t path_len, int is_dir, void *arg) {
+    const PendingRoot *pending = arg;
+    EventWatcherContext *contextData = pending->contextData;
+    Event event = { 0, is_dir ? EVENT_IS_DIR : 0, path, path_len, monotonic_ns(), pending->root, NULL, 0 };
+
+    if (contextData->format == OUTPUT_TEXT) {
+        output_number_event(contextData->options, &event);
+        output_printf("%.*s%c", (int) path_len, path, contextData->terminator);
+    } else {
+        output_event(contextData->options, &event);
+    }
+}
+
+// Events were dropped, and we can't tell where; every root needs a rescan
+static void report_dropped(EventWatcherContext *contextData, uint64_t now) {
+    for (int i = 0; i < roots_count(contextData->roots); i++) {
+        const char *root = roots_path(contextData->roots, i);
+
+        Event event = { 0, EVENT_OVERFLOW | EVENT_IS_DIR, root, strlen(root), now, i, NULL, 0 };
+
+        if (contextData->pending_paths != NULL) {
+            coalescer_clear(contextData->pending_paths[i]);
+            coalescer_add(contextData->pending_paths[i], root, strlen(root), 1);
+        } else if (contextData->format != OUTPUT_TEXT) {
+            output_event(contextData->options, &event);
+        } else {
+            output_number_event(contextData->options, &event);
+            output_printf("%s%c", root, contextData->terminator);
+        }
+    }
+}
+
 void eventCallback(ConstFSEventStreamRef streamRef,
                    void *clientCallBackInfo,
                    size_t numEvents,
@@ -80,6 +122,7 @@ void eventCallback(ConstFSEventStreamRef streamRef,
 {
     char **paths = eventPaths;
     EventWatcherContext *contextData = (EventWatcherContext *)clientCallBackInfo;
+    uint64_t now = monotonic_ns();
 
     for (size_t i = 0; i < numEvents; i++) {
         const char *dir_or_file;
@@ -99,8 +142,11 @@ void eventCallback(ConstFSEventStreamRef streamRef,
             dir_or_file = "|???";
         }
 
-        if (!(want_flags & eventFlags[i]))
+        stats_add(STAT_EVENTS, 1);
+        if (!(want_flags & eventFlags[i])) {
+            stats_add(STAT_DROPPED_MASK, 1);
             continue;
+        }
 
         // Debounce double rename events
         if (i > 0
@@ -111,6 +157,56 @@ void eventCallback(ConstFSEventStreamRef streamRef,
             continue;
         }
 
+        int dropped = (eventFlags[i] & (kFSEventStreamEventFlagUserDropped | kFSEventStreamEventFlagKernelDropped)) != 0;
+        int root = roots_match(contextData->roots, paths[i], strlen(paths[i]));
+
+        // FSEvents can't leave anything out for us, so filter here
+        if (!dropped && root != -1 && contextData->options->filter != NULL
+            && filter_excludes(contextData->options->filter,
+                               roots_relative_path(contextData->roots, root, paths[i]),
+                               (eventFlags[i] & kFSEventStreamEventFlagItemIsDir) != 0))
+        {
+            stats_add(STAT_DROPPED_FILTER, 1);
+            continue;
+        }
+
+        if (dropped)
+            stats_add(STAT_OVERFLOWS, 1);
+        else
+            stats_add(STAT_EMITTED, 1);
+
+        if (dropped && (contextData->generic_mode || contextData->format != OUTPUT_TEXT)) {
+            // Sadness. Queue overflowed; we just invalidate the whole tree.
+            report_dropped(contextData, now);
+            continue;
+        }
+
+        if (contextData->pending_paths != NULL && root != -1) {
+            // Each callback is one window's worth; report each path once
+            int is_dir = (eventFlags[i] & (kFSEventStreamEventFlagItemIsDir | kFSEventStreamEventFlagMustScanSubDirs)) != 0;
+            coalescer_add(contextData->pending_paths[root], paths[i], strlen(paths[i]), is_dir);
+            continue;
+        }
+
+        // One record per event, with all its flags
+        Event event;
+        event.mask = eventFlags[i] & want_flags;
+        event.flags = (eventFlags[i] & kFSEventStreamEventFlagItemIsDir) ? EVENT_IS_DIR : 0;
+        if (dropped)
+            event.flags |= EVENT_OVERFLOW;
+        event.path = paths[i];
+        event.path_len = strlen(event.path);
+        event.timestamp_ns = now;
+        event.root = root;
+        event.from_path = NULL;
+        event.from_path_len = 0;
+
+        if (contextData->format != OUTPUT_TEXT) {
+            output_event(contextData->options, &event);
+            continue;
+        }
+        output_number_event(contextData->options, &event);
+
         if (!contextData->generic_mode) {
             // Iterate through each event flag
             for (int j = 0; fsevents_events[j].name != NULL; j++) {
@@ -124,43 +220,81 @@ void eventCallback(ConstFSEventStreamRef streamRef,
 
                 if (eventFlags[i] & fsevents_events[j].value) {
                     // Check if it's a directory or symlink for printing, based on your logic
-                    printf("%s%s %s%c", fsevents_events[j].name, dir_or_file, paths[i], contextData->terminator);
-                    fflush(stdout); // Ensure immediate output
+                    output_printf("%s%s %s%c", fsevents_events[j].name, dir_or_file, paths[i], contextData->terminator);
                 }
             }
         } else {
             // Generic mode: just print the path
-            if (eventFlags[i] & (kFSEventStreamEventFlagUserDropped | kFSEventStreamEventFlagKernelDropped)) {
-                // Sadness. Queue overflowed; we just invalidate the whole directory.
-                printf("%s%c", contextData->watch_path, contextData->terminator);
-            } else {
-                printf("%s%c", paths[i], contextData->terminator);
-            }
-            fflush(stdout); // Ensure immediate output
+            output_printf("%s%c", paths[i], contextData->terminator);
         }
     }
+
+    if (contextData->pending_paths != NULL) {
+        for (int i = 0; i < roots_count(contextData->roots); i++) {
+            PendingRoot pending = { contextData, i };
+            coalescer_drain(contextData->pending_paths[i], report_path, &pending);
+        }
+    }
+
+    // Everything from this callback goes out in one write
+    output_flush();
 }
 
-void event_watch_loop(const char *watch_path, unsigned int file_events_mask, unsigned int dir_events_mask, int generic_mode, char terminator) {
+void event_watch_loop(const WatchOptions *options) {
+    if (options->listen_path != NULL || options->connect_path != NULL || options->record_path != NULL
+        || options->replay_path != NULL)
+    {
+        fprintf(stderr, "--listen, --connect, --record and --replay need fanotify.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    const RootSet *roots = options->roots;
+    int num_roots = roots_count(roots);
     EventWatcherContext contextData;
-    contextData.watch_path = watch_path;
-    contextData.generic_mode = generic_mode;
-    contextData.file_events_mask = file_events_mask;
-    contextData.dir_events_mask = dir_events_mask;
-    contextData.terminator = terminator;
+    contextData.options = options;
+    contextData.roots = roots;
+    contextData.generic_mode = options->generic_mode;
+    contextData.file_events_mask = options->file_events_mask;
+    contextData.dir_events_mask = options->dir_events_mask;
+    contextData.terminator = options->terminator;
+    contextData.format = options->format;
+    contextData.pending_paths = NULL;
+    if (stats_start("main", options->stats_fd, options->stats_interval_ms, -1) == -1) {
+        perror("Failed to start stats");
+        exit(EXIT_FAILURE);
+    }
+    if (options->coalesce_window_ms > 0) {
+        contextData.pending_paths = malloc(num_roots * sizeof(*contextData.pending_paths));
+        if (contextData.pending_paths == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < num_roots; i++)
+            contextData.pending_paths[i] = coalescer_create(COALESCE_MAX_PATHS, COALESCE_MAX_BYTES);
+    }
 
     FSEventStreamContext context = {0, &contextData, NULL, NULL, NULL};
     FSEventStreamRef stream;
     CFAbsoluteTime latency = 0.03; // Latency in seconds
+    if (options->coalesce_window_ms > 0)
+        latency = options->coalesce_window_ms / 1000.0;
 
-    CFStringRef mypath = CFStringCreateWithCString(NULL, watch_path, kCFStringEncodingUTF8);
-    CFArrayRef pathsToWatch = CFArrayCreate(NULL, (const void **)&mypath, 1, NULL);
-    if (!pathsToWatch || !mypath) {
+    // One stream covers every root
+    CFMutableArrayRef pathsToWatch = CFArrayCreateMutable(NULL, num_roots, &kCFTypeArrayCallBacks);
+    if (!pathsToWatch) {
         fprintf(stderr, "Failed to create paths to watch\n");
-        if (mypath) CFRelease(mypath);
-        if (pathsToWatch) CFRelease(pathsToWatch);
         exit(EXIT_FAILURE);
     }
+    for (int i = 0; i < num_roots; i++) {
+        CFStringRef mypath = CFStringCreateWithCString(NULL, roots_path(roots, i), kCFStringEncodingUTF8);
+        if (!mypath) {
+            fprintf(stderr, "Failed to create paths to watch\n");
+            CFRelease(pathsToWatch);
+            exit(EXIT_FAILURE);
+        }
+        CFArrayAppendValue(pathsToWatch, mypath);
+        CFRelease(mypath);
+    }
 
     // Create the event stream.
     stream = FSEventStreamCreate(NULL,
@@ -174,7 +308,6 @@ void event_watch_loop(const char *watch_path, unsigned int file_events_mask, uns
     if (!stream) {
         fprintf(stderr, "Failed to create FSEvent stream\n");
         CFRelease(pathsToWatch);
-        CFRelease(mypath);
         exit(EXIT_FAILURE);
     }
 
@@ -185,7 +318,6 @@ void event_watch_loop(const char *watch_path, unsigned int file_events_mask, uns
         fprintf(stderr, "Failed to start FSEvent stream\n");
         FSEventStreamRelease(stream);
         CFRelease(pathsToWatch);
-        CFRelease(mypath);
         exit(EXIT_FAILURE);
     }
  
@@ -197,6 +329,5 @@ void event_watch_loop(const char *watch_path, unsigned int file_events_mask, uns
     FSEventStreamInvalidate(stream);
     FSEventStreamRelease(stream);
     CFRelease(pathsToWatch);
-    CFRelease(mypath);
 }
 
@@ -0,0 +1,374 @@
+/*
+
+Copyright (C) 2024, Andrew Moise <andrew.moise@gmail.com>
+
+Licensed under GNU Affero General Public License, Version 3
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ogwatch.h"
+#include "journal.h"
+
+#define JOURNAL_MAGIC 0x4c4e524a5747474fULL    // "OGGWJRNL", little-endian
+#define JOURNAL_VERSION 1
+
+// The ring starts a page in, after the header
+#define JOURNAL_DATA_OFFSET 4096
+
+// How many times a reader tries for a clean copy before giving up
+#define JOURNAL_READ_ATTEMPTS 10
+
+/* Positions are counts of bytes ever written, taken modulo the ring size
+   to find where they are, so head - tail is always how much is in use.
+   The writer publishes head after a record is complete, and moves tail on
+   before overwriting anything, so a reader that sees tail unchanged after
+   copying knows its copy is good. */
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t data_size;
+    uint64_t head;          // Where the next record goes
+    uint64_t tail;          // Where the oldest record starts
+    uint64_t next_seq;      // For the next record
+} JournalHeader;
+
+// Each record is padded out to a multiple of 8 bytes
+typedef struct {
+    uint32_t length;        // Of header, paths and padding together
+    uint32_t flags;         // EVENT_* and JOURNAL_* flags
+    uint64_t sequence;
+    uint64_t time_ns;       // CLOCK_REALTIME, which unlike CLOCK_MONOTONIC means something after a reboot
+    uint32_t path_len;
+    uint32_t from_path_len; // For a rename, the path it was renamed from follows the path
+} JournalRecord;
+
+#define RECORD_LENGTH(paths_len) ((sizeof(JournalRecord) + (paths_len) + 7) & ~(size_t) 7)
+
+struct Journal {
+    int fd;                 // Holds the lock
+    JournalHeader *header;
+    char *data;
+    uint64_t data_size;
+};
+
+static uint64_t realtime_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* The journal is named on the command line of what may be a setuid
+   binary, so it's only ever opened with the user's own permissions. */
+static int open_as_real_user(const char *path, int flags) {
+    uid_t effective_uid = geteuid();
+    gid_t effective_gid = getegid();
+
+    if (setegid(getgid()) == -1 || seteuid(getuid()) == -1) {
+        perror("Failed to drop privileges");
+        exit(EXIT_FAILURE);
+    }
+    int fd = open(path, flags | O_CLOEXEC, 0600);
+    int saved_errno = errno;
+    if (seteuid(effective_uid) == -1 || setegid(effective_gid) == -1) {
+        perror("Failed to restore privileges");
+        exit(EXIT_FAILURE);
+    }
+    errno = saved_errno;
+    return fd;
+}
+
+// Whether a header describes a ring we can carry on writing to
+static int header_is_sane(const JournalHeader *header, uint64_t data_size) {
+    return header->version == JOURNAL_VERSION
+        && header->data_size == data_size
+        && header->tail <= header->head
+        && header->head - header->tail <= data_size
+        && header->tail % 8 == 0 && header->head % 8 == 0;
+}
+
+/* Starts the ring over, empty. New sequence numbers start from the time in
+   µs, so they're past anything a consumer could have had from an earlier
+   journal at the same path. */
+static void reset_journal(Journal *journal) {
+    JournalHeader *header = journal->header;
+    header->magic = JOURNAL_MAGIC;
+    header->version = JOURNAL_VERSION;
+    header->reserved = 0;
+    header->data_size = journal->data_size;
+    header->head = 0;
+    header->tail = 0;
+    header->next_seq = realtime_ns() / 1000;
+}
+
+Journal *journal_open(const char *path, size_t data_size) {
+    data_size &= ~(size_t) 7;
+
+    int fd = open_as_real_user(path, O_RDWR | O_CREAT);
+    if (fd == -1) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+        if (errno == EWOULDBLOCK)
+            fprintf(stderr, "%s: In use by another ogwatch\n", path);
+        else
+            perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Refuse to clobber anything that isn't a journal. One of another size
+       starts over at the new size. */
+
+    struct stat sb;
+    JournalHeader old;
+    if (fstat(fd, &sb) == -1) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    memset(&old, 0, sizeof(old));
+    if (sb.st_size > 0 && (pread(fd, &old, sizeof(old), 0) != sizeof(old) || old.magic != JOURNAL_MAGIC)) {
+        fprintf(stderr, "%s: Not an ogwatch journal\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    off_t file_size = JOURNAL_DATA_OFFSET + data_size;
+    if (sb.st_size != file_size && ftruncate(fd, file_size) == -1) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    void *map = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    Journal *journal = malloc(sizeof(*journal));
+    if (journal == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    journal->fd = fd;
+    journal->header = map;
+    journal->data = (char *) map + JOURNAL_DATA_OFFSET;
+    journal->data_size = data_size;
+
+    if (sb.st_size != file_size || !header_is_sane(journal->header, data_size))
+        reset_journal(journal);
+
+    // Whatever happened while we weren't running is lost to us
+    journal_append(journal, JOURNAL_SESSION, "", 0, NULL, 0);
+    return journal;
+}
+
+/* Moves tail on past the oldest records until there are bytes free after
+   head. Returns 0 if what's there doesn't look like records, which only
+   a crash partway through writing could leave behind. */
+static int make_room(Journal *journal, uint64_t head, uint64_t bytes) {
+    JournalHeader *header = journal->header;
+    uint64_t tail = header->tail;
+
+    while (head + bytes - tail > journal->data_size) {
+        uint64_t pos = tail % journal->data_size;
+        uint64_t to_end = journal->data_size - pos;
+        if (to_end < sizeof(JournalRecord)) {
+            tail += to_end;
+            continue;
+        }
+
+        const JournalRecord *record = (const JournalRecord *) (journal->data + pos);
+        if (record->length < sizeof(JournalRecord) || record->length > to_end || record->length % 8 != 0)
+            return 0;
+        tail += record->length;
+    }
+
+    __atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return 1;
+}
+
+uint64_t journal_append(Journal *journal, unsigned int flags, const char *path, size_t path_len,
+                        const char *from_path, size_t from_path_len)
+{
+    JournalHeader *header = journal->header;
+    uint64_t length = RECORD_LENGTH(path_len + from_path_len);
+
+    /* Records don't wrap around the end of the ring; we skip to the start
+       instead, leaving a padding record if there's room for one. */
+
+    uint64_t head = header->head;
+    uint64_t to_end = journal->data_size - head % journal->data_size;
+    uint64_t skip = to_end < length ? to_end : 0;
+
+    if (!make_room(journal, head, skip + length)) {
+        reset_journal(journal);
+        head = 0;
+        skip = 0;
+        flags = JOURNAL_SESSION;
+        path_len = 0;
+        from_path_len = 0;
+        length = RECORD_LENGTH(0);
+    }
+
+    if (skip >= sizeof(JournalRecord)) {
+        JournalRecord *padding = (JournalRecord *) (journal->data + head % journal->data_size);
+        memset(padding, 0, sizeof(*padding));
+        padding->length = skip;
+        padding->flags = JOURNAL_PADDING;
+    }
+    head += skip;
+
+    JournalRecord *record = (JournalRecord *) (journal->data + head % journal->data_size);
+    uint64_t sequence = header->next_seq;
+    record->length = length;
+    record->flags = flags;
+    record->sequence = sequence;
+    record->time_ns = realtime_ns();
+    record->path_len = path_len;
+    record->from_path_len = from_path_len;
+    memcpy(record + 1, path, path_len);
+    if (from_path_len > 0)
+        memcpy((char *) (record + 1) + path_len, from_path, from_path_len);
+
+    header->next_seq = sequence + 1;
+    __atomic_store_n(&header->head, head + length, __ATOMIC_RELEASE);
+    return sequence;
+}
+
+/* Copies everything between tail and head out of the ring, retrying if
+   the writer catches up with us. Returns the copy and sets *len and
+   *copy_tail, or returns NULL if it never got a clean one. */
+static char *copy_records(const JournalHeader *header, const char *data, uint64_t data_size,
+                          size_t *len, uint64_t *copy_tail)
+{
+    char *copy = malloc(data_size);
+    if (copy == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int attempt = 0; attempt < JOURNAL_READ_ATTEMPTS; attempt++) {
+        uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+        if (tail > head || head - tail > data_size)
+            continue;
+
+        uint64_t pos = tail % data_size, used = head - tail;
+        uint64_t first = used < data_size - pos ? used : data_size - pos;
+        memcpy(copy, data + pos, first);
+        memcpy(copy + first, data, used - first);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&header->tail, __ATOMIC_RELAXED) == tail) {
+            *len = used;
+            *copy_tail = tail;
+            return copy;
+        }
+    }
+
+    free(copy);
+    return NULL;
+}
+
+int journal_read_since(const char *path, uint64_t since, JournalPathFunc func, void *arg, uint64_t *last) {
+    int fd = open_as_real_user(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    struct stat sb;
+    JournalHeader header;
+    if (fstat(fd, &sb) == -1 || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+        || header.magic != JOURNAL_MAGIC || header.version != JOURNAL_VERSION
+        || (uint64_t) sb.st_size != JOURNAL_DATA_OFFSET + header.data_size)
+    {
+        fprintf(stderr, "%s: Not an ogwatch journal\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    uint64_t data_size = header.data_size;
+    uint64_t tail;
+    size_t len;
+    char *copy = copy_records(map, (const char *) map + JOURNAL_DATA_OFFSET, data_size, &len, &tail);
+    munmap(map, sb.st_size);
+    if (copy == NULL) {
+        *last = since;
+        return 1;
+    }
+
+    /* Walk the copy twice: first to see whether it covers everything since
+       then, and only then to hand over the paths. Sequence numbers have no
+       gaps, so the first record tells us whether we've lost any. */
+
+    int rescan = 0;
+    uint64_t first_seq = 0;
+    *last = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        size_t offset = 0;
+        uint64_t pos = tail % data_size;
+        while (offset < len) {
+            uint64_t to_end = data_size - (pos + offset) % data_size;
+            if (to_end < sizeof(JournalRecord)) {
+                offset += to_end;
+                continue;
+            }
+
+            const JournalRecord *record = (const JournalRecord *) (copy + offset);
+            if (record->length < sizeof(JournalRecord) || record->length > len - offset
+                || record->length % 8 != 0
+                || sizeof(JournalRecord) + (uint64_t) record->path_len + record->from_path_len > record->length)
+            {
+                rescan = 1;
+                break;
+            }
+            offset += record->length;
+            if (record->flags & JOURNAL_PADDING)
+                continue;
+
+            if (pass == 0) {
+                if (first_seq == 0)
+                    first_seq = record->sequence;
+                *last = record->sequence;
+                if (record->sequence > since && (record->flags & (JOURNAL_SESSION | EVENT_ESTALE)))
+                    rescan = 1;
+            } else if (record->sequence > since && !(record->flags & EVENT_BARRIER)) {
+                // Both sides of a rename changed
+                const char *paths = (const char *) (record + 1);
+                int is_dir = (record->flags & (EVENT_IS_DIR | EVENT_OVERFLOW)) != 0;
+                if (record->from_path_len > 0)
+                    func(paths + record->path_len, record->from_path_len, is_dir, arg);
+                func(paths, record->path_len, is_dir, arg);
+            }
+        }
+
+        // Records we no longer have, or a number this journal never gave out
+        if (pass == 0 && (first_seq == 0 || since + 1 < first_seq || since > *last))
+            rescan = 1;
+        if (rescan)
+            break;
+    }
+
+    free(copy);
+    return rescan;
+}
@@ -0,0 +1,39 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEFAULT_JOURNAL_SIZE (16 * 1024 * 1024)
+#define MIN_JOURNAL_SIZE (64 * 1024)
+#define MAX_JOURNAL_SIZE (1024 * 1024 * 1024)
+
+// Record flags besides the EVENT_* ones
+#define JOURNAL_SESSION 0x10000     // ogwatch started; it may have missed anything before
+#define JOURNAL_PADDING 0x20000     // Filler up to the end of the ring
+
+/* An on-disk ring of the paths ogwatch has reported, each with a sequence
+   number that carries on across restarts, so that a consumer can catch up
+   on what it missed instead of rescanning everything. The file is mapped
+   shared, so readers see records as soon as they're written, and records
+   survive ogwatch itself going away. One writer at a time. */
+typedef struct Journal Journal;
+
+// Opens or creates a journal for writing, with data_size bytes of ring,
+// and starts a new session in it. Exits on failure.
+Journal *journal_open(const char *path, size_t data_size);
+
+// Appends a record, and returns its sequence number. from_path is where a
+// renamed path was renamed from, or NULL.
+uint64_t journal_append(Journal *journal, unsigned int flags, const char *path, size_t path_len,
+                        const char *from_path, size_t from_path_len);
+
+typedef void (*JournalPathFunc)(const char *path, size_t path_len, int is_dir, void *arg);
+
+// Passes each path recorded after sequence number since to func (both of
+// them, for a rename), oldest first, and sets *last to the newest sequence
+// number. Returns 1 instead if the journal can't say everything that
+// changed since then, and the consumer needs to rescan everything.
+int journal_read_since(const char *path, uint64_t since, JournalPathFunc func, void *arg, uint64_t *last);
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef LIBOGWATCH_H
+#define LIBOGWATCH_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "ogwatch.h"
+
+/* The fanotify backend as a library, for programs that want events
+   straight from the kernel without going through ogwatch's output. The
+   usual loop is to poll ogwatch_fd() for input, with ogwatch_timeout() as
+   the timeout, and call ogwatch_read_batch() until it returns 0.
+
+   Errors come back as -1 (or NULL) with errno set. Once reading has
+   failed, the watch may have missed changes to the tree, and should be
+   closed. Running out of memory still ends the process, as it does
+   everywhere else in ogwatch. A watch must only be used from one thread
+   at a time, and no two watches may be opened or read from concurrently:
+   directory walks go through nftw(), which has no way to pass them
+   context. */
+
+typedef struct Ogwatch Ogwatch;
+
+typedef struct {
+    unsigned int file_events_mask;  // FAN_* events to report on files
+    unsigned int dir_events_mask;   // And on directories
+    size_t read_buffer_size;        // Bytes of events to read per syscall, or 0 for the default
+    int scoped_marks;               // Mark only the watched trees, not their filesystems
+    int threads;                    // Threads to resolve events with; 0 or 1 for just the caller's
+    int bounded_queue;              // Let the kernel drop events rather than queue without limit
+    const PathFilter *filter;       // Must outlive the watch, or NULL
+    const OriginFilter *ignore;     // Processes whose changes to leave out; must outlive the watch, or NULL
+    size_t unchanged_max_size;      // Drop close-writes that left files up to this big as they were; 0 for off
+} OgwatchConfig;
+
+// Starts an empty watch. Needs CAP_SYS_ADMIN.
+Ogwatch *ogwatch_open(const OgwatchConfig *config);
+
+// Starts watching a directory and everything below it, and returns the
+// index events under it will carry. Adding the same directory twice
+// returns the index it already has. If it fails, the watch is left with
+// the roots it had.
+int ogwatch_add_root(Ogwatch *watch, const char *path);
+
+int ogwatch_root_count(const Ogwatch *watch);
+const char *ogwatch_root_path(const Ogwatch *watch, int root);
+
+/* Saves everything the watch reads from the kernel from here on to fd,
+   which it takes over, as a trace for ogwatch_open_replay(). Call it once
+   the roots are added. The trace holds events from anywhere the marks
+   reach, which may be the whole filesystem, so keep it as safe as that. */
+int ogwatch_record(Ogwatch *watch, int fd);
+
+/* Opens a watch that reads its events back from a trace on fd, which it
+   takes over, instead of from the kernel, and needs no privileges. The
+   roots are the recording watch's, and what handles resolved to, access
+   checks included, is as it was then. The masks and filter still apply,
+   as long as they leave in whatever they need to; ignore and
+   unchanged_max_size don't. There's nothing to poll: ogwatch_fd() is -1,
+   and ogwatch_read_batch() returns 0 only once it's quiet, at the end. */
+Ogwatch *ogwatch_open_replay(const OgwatchConfig *config, int fd);
+
+// Whether a replay has given out everything in its trace
+int ogwatch_replay_done(const Ogwatch *watch);
+
+// Readable when there are events to read
+int ogwatch_fd(const Ogwatch *watch);
+
+// How many ms until ogwatch_read_batch() has something to report even
+// without new input, or -1 if only once ogwatch_fd() is readable
+int ogwatch_timeout(const Ogwatch *watch);
+
+// Fills events with up to max_events events, without blocking, and returns
+// how many; 0 means there are none right now. Their paths are terminated,
+// and good until the next call or ogwatch_close().
+ssize_t ogwatch_read_batch(Ogwatch *watch, Event *events, size_t max_events);
+
+/* Walks the trees under every root as they are now, with this many
+   threads, and passes func an EVENT_SNAPSHOT event for each file and
+   directory below a root that the real user could see events on, from the
+   calling thread. The event's path is only good until func returns. With
+   the roots already added, anything that changes during the walk is also
+   there to read as events afterwards. Doesn't cross into other mounts. */
+typedef void (*OgwatchScanFunc)(const Event *event, void *arg);
+int ogwatch_scan(Ogwatch *watch, int threads, OgwatchScanFunc func, void *arg);
+
+void ogwatch_close(Ogwatch *watch);
+
+#endif
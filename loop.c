@@ -0,0 +1,204 @@
+/*
+
+Copyright (C) 2024, Andrew Moise <andrew.moise@gmail.com>
+
+Licensed under GNU Affero General Public License, Version 3
+
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "loop.h"
+#include "ogwatch.h"
+
+// Ready fds to take from the kernel at a time
+#define LOOP_BATCH_SIZE 64
+
+typedef struct {
+    LoopFdFunc func;
+    void *arg;
+    uint32_t generation;    // Tells a reused fd apart from the one it replaced
+} LoopWatch;
+
+struct EventLoop {
+    int epoll_fd;
+    int timer_fd;
+    uint64_t timer_armed_ns;            // What timer_fd is set for, or 0
+    LoopWatch *watches;                 // Indexed by fd
+    int watches_size;
+    uint32_t next_generation;
+    LoopTimer *timers[LOOP_MAX_TIMERS];
+    int num_timers;
+    int stopping;
+};
+
+EventLoop *loop_create() {
+    EventLoop *loop = calloc(1, sizeof(*loop));
+    if (loop == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop->timer_fd == -1) {
+        perror("timerfd_create");
+        exit(EXIT_FAILURE);
+    }
+
+    // The timerfd is the one fd without a watch; it's the -1 generation
+    struct epoll_event event = { EPOLLIN, { .u64 = UINT64_MAX } };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->timer_fd, &event) == -1) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+    loop->next_generation = 1;
+    return loop;
+}
+
+static void control(EventLoop *loop, int op, int fd, unsigned int events) {
+    struct epoll_event event;
+    event.events = events;
+    event.data.u64 = ((uint64_t) loop->watches[fd].generation << 32) | (uint32_t) fd;
+    if (epoll_ctl(loop->epoll_fd, op, fd, &event) == -1) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void loop_add(EventLoop *loop, int fd, unsigned int events, LoopFdFunc func, void *arg) {
+    if (fd >= loop->watches_size) {
+        int new_size = loop->watches_size ? loop->watches_size : 64;
+        while (new_size <= fd)
+            new_size *= 2;
+        LoopWatch *watches = realloc(loop->watches, new_size * sizeof(*watches));
+        if (watches == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        memset(watches + loop->watches_size, 0, (new_size - loop->watches_size) * sizeof(*watches));
+        loop->watches = watches;
+        loop->watches_size = new_size;
+    }
+
+    LoopWatch *watch = &loop->watches[fd];
+    watch->func = func;
+    watch->arg = arg;
+    watch->generation = loop->next_generation++;
+    control(loop, EPOLL_CTL_ADD, fd, events);
+}
+
+void loop_modify(EventLoop *loop, int fd, unsigned int events) {
+    control(loop, EPOLL_CTL_MOD, fd, events);
+}
+
+/* Events for it that already came back from epoll_wait() are dropped,
+   since the generation no longer matches. */
+void loop_remove(EventLoop *loop, int fd) {
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+    loop->watches[fd].func = NULL;
+    loop->watches[fd].generation = 0;
+}
+
+// Sets the timerfd for the earliest deadline, if it isn't already
+static void arm_timer(EventLoop *loop) {
+    uint64_t earliest = 0;
+    for (int i = 0; i < loop->num_timers; i++) {
+        uint64_t deadline = loop->timers[i]->deadline_ns;
+        if (deadline != 0 && (earliest == 0 || deadline < earliest))
+            earliest = deadline;
+    }
+    if (earliest == loop->timer_armed_ns)
+        return;
+
+    // All zeroes disarms it
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = earliest / 1000000000;
+    spec.it_value.tv_nsec = earliest % 1000000000;
+    if (timerfd_settime(loop->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+        perror("timerfd_settime");
+        exit(EXIT_FAILURE);
+    }
+    loop->timer_armed_ns = earliest;
+}
+
+void loop_set_timer(EventLoop *loop, LoopTimer *timer, int timeout_ms) {
+    int i;
+    for (i = 0; i < loop->num_timers && loop->timers[i] != timer; i++)
+        ;
+    if (i == loop->num_timers) {
+        if (loop->num_timers == LOOP_MAX_TIMERS) {
+            fprintf(stderr, "Too many timers\n");
+            exit(EXIT_FAILURE);
+        }
+        loop->timers[loop->num_timers++] = timer;
+    }
+
+    timer->deadline_ns = timeout_ms == -1 ? 0 : monotonic_ns() + (uint64_t) timeout_ms * 1000000;
+}
+
+// Calls back every timer that's due
+static void run_timers(EventLoop *loop) {
+    uint64_t expirations;
+    if (read(loop->timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+        perror("read from timerfd");
+        exit(EXIT_FAILURE);
+    }
+    loop->timer_armed_ns = 0;
+
+    uint64_t now = monotonic_ns();
+    for (int i = 0; i < loop->num_timers; i++) {
+        LoopTimer *timer = loop->timers[i];
+        if (timer->deadline_ns != 0 && timer->deadline_ns <= now) {
+            timer->deadline_ns = 0;
+            timer->func(timer->arg);
+        }
+    }
+}
+
+void loop_run(EventLoop *loop) {
+    struct epoll_event events[LOOP_BATCH_SIZE];
+
+    loop->stopping = 0;
+    while (!loop->stopping) {
+        arm_timer(loop);
+        int count = epoll_wait(loop->epoll_fd, events, LOOP_BATCH_SIZE, -1);
+        if (count == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < count && !loop->stopping; i++) {
+            if (events[i].data.u64 == UINT64_MAX) {
+                run_timers(loop);
+                continue;
+            }
+
+            int fd = (int) (uint32_t) events[i].data.u64;
+            uint32_t generation = events[i].data.u64 >> 32;
+            LoopWatch *watch = &loop->watches[fd];
+            if (watch->func != NULL && watch->generation == generation)
+                watch->func(fd, events[i].events, watch->arg);
+        }
+    }
+}
+
+void loop_stop(EventLoop *loop) {
+    loop->stopping = 1;
+}
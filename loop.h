@@ -0,0 +1,40 @@
+#ifndef LOOP_H
+#define LOOP_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/* A small epoll event loop: callbacks for ready fds, and timers for
+   deadlines, all behind one epoll_wait(). Timers share a single timerfd,
+   armed for whichever is due first. Everything runs on the thread that
+   calls loop_run(). */
+typedef struct EventLoop EventLoop;
+
+typedef void (*LoopFdFunc)(int fd, unsigned int events, void *arg);
+typedef void (*LoopTimerFunc)(void *arg);
+
+// A deadline, owned by the caller and handed to loop_set_timer()
+typedef struct {
+    LoopTimerFunc func;
+    void *arg;
+    uint64_t deadline_ns;   // CLOCK_MONOTONIC, or 0 if not set
+} LoopTimer;
+
+#define LOOP_MAX_TIMERS 8
+
+EventLoop *loop_create();
+
+// Calls func whenever fd has any of events (EPOLLIN, EPOLLOUT), or hangs up
+void loop_add(EventLoop *loop, int fd, unsigned int events, LoopFdFunc func, void *arg);
+void loop_modify(EventLoop *loop, int fd, unsigned int events);
+void loop_remove(EventLoop *loop, int fd);
+
+// Makes a timer fire in timeout_ms, or never if that's -1. Setting it
+// again moves it; a timer that fires is unset before its func is called.
+void loop_set_timer(EventLoop *loop, LoopTimer *timer, int timeout_ms);
+
+// Waits for fds and timers and calls them back, until loop_stop()
+void loop_run(EventLoop *loop);
+void loop_stop(EventLoop *loop);
+
+#endif
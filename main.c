@@ -9,6 +9,7 @@ Licensed under GNU Affero General Public License, Version 3
 #define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,6 +20,7 @@ Licensed under GNU Affero General Public License, Version 3
 #include <unistd.h>
 
 #include "ogwatch.h"
+#include "coalesce.h"
 
 // Parses the event names from the command line arguments and returns the corresponding fanotify mask.
 unsigned int parse_events(char *events_str) {
@@ -38,14 +40,181 @@ unsigned int parse_events(char *events_str) {
     return mask;
 }
 
+// Parses a byte count with an optional K or M suffix. Returns 0 if invalid.
+size_t parse_size(const char *size_str) {
+    char *end;
+
+    // strtoull() would take "-1" as ULLONG_MAX
+    if (*size_str < '0' || *size_str > '9')
+        return 0;
+
+    errno = 0;
+    unsigned long long size = strtoull(size_str, &end, 10);
+    if (errno != 0)
+        return 0;
+
+    unsigned long long multiplier = 1;
+    if (*end == 'K' || *end == 'k') {
+        multiplier = 1024;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        multiplier = 1024 * 1024;
+        end++;
+    }
+
+    if (*end != '\0' || size > ULLONG_MAX / multiplier || size * multiplier > SIZE_MAX)
+        return 0;
+    return size * multiplier;
+}
+
+/* Roots, and files of them, are named on the command line of what may be
+   a setuid binary, so they're only looked up with the user's own
+   permissions. */
+typedef struct {
+    uid_t uid;
+    gid_t gid;
+} EffectiveIds;
+
+static void drop_to_real_user(EffectiveIds *saved) {
+    saved->uid = geteuid();
+    saved->gid = getegid();
+    if (setegid(getgid()) == -1 || seteuid(getuid()) == -1) {
+        perror("Failed to drop privileges");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void restore_privileges(const EffectiveIds *saved) {
+    if (seteuid(saved->uid) == -1 || setegid(saved->gid) == -1) {
+        perror("Failed to restore privileges");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Canonicalizes a watch root as the user, which is what events will carry
+static int canonical_root(const char *path, char *canonical) {
+    EffectiveIds saved;
+
+    drop_to_real_user(&saved);
+    char *result = realpath(path, canonical);
+    int saved_errno = errno;
+    restore_privileges(&saved);
+    errno = saved_errno;
+    return result == NULL ? -1 : 0;
+}
+
+// Adds a watch root by its canonical path
+void add_root(RootSet *roots, const char *path) {
+    char canonical[PATH_MAX];
+
+    if (canonical_root(path, canonical) == -1) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    roots_add(roots, canonical);
+}
+
+/* Adds the watch roots listed in a file, one per line. A line that isn't
+   a directory is reported by its number rather than what's on it, which
+   would otherwise echo whatever file the user managed to point us at. */
+void add_roots_from_file(RootSet *roots, const char *file_name) {
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t line_len;
+    int line_number = 0;
+    char canonical[PATH_MAX];
+
+    EffectiveIds saved;
+
+    drop_to_real_user(&saved);
+    int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    int saved_errno = errno;
+    restore_privileges(&saved);
+    errno = saved_errno;
+
+    FILE *file = fd == -1 ? NULL : fdopen(fd, "r");
+    if (file == NULL) {
+        perror(file_name);
+        exit(EXIT_FAILURE);
+    }
+
+    while ((line_len = getline(&line, &line_size, file)) != -1) {
+        line_number++;
+        if (line_len > 0 && line[line_len - 1] == '\n')
+            line[--line_len] = '\0';
+        if (line_len == 0)
+            continue;
+        if (canonical_root(line, canonical) == -1) {
+            fprintf(stderr, "%s:%d: %s\n", file_name, line_number, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        roots_add(roots, canonical);
+    }
+    if (ferror(file)) {
+        perror(file_name);
+        exit(EXIT_FAILURE);
+    }
+
+    free(line);
+    fclose(file);
+}
+
+static void print_journal_path(const char *path, size_t path_len, int is_dir, void *arg) {
+    char terminator = *(const char *) arg;
+    printf("%.*s%c", (int) path_len, path, terminator);
+}
+
+static void add_journal_path(const char *path, size_t path_len, int is_dir, void *arg) {
+    coalescer_add(arg, path, path_len, is_dir);
+}
+
+/* Prints each path changed since a sequence number, once, or RESCAN if the
+   journal can't say. Either way, the number to ask from next time comes
+   last. */
+void print_journal_since(const char *journal_path, uint64_t since, char terminator) {
+    Coalescer *changed = coalescer_create(COALESCE_MAX_PATHS, COALESCE_MAX_BYTES);
+    uint64_t last;
+
+    if (journal_read_since(journal_path, since, add_journal_path, changed, &last))
+        printf("RESCAN%c", terminator);
+    else
+        coalescer_drain(changed, print_journal_path, &terminator);
+    printf("SEQ %llu%c", (unsigned long long) last, terminator);
+}
+
 // Help message function
 void print_help() {
-    printf("Usage: ogwatch [options] <directory>\n");
+    printf("Usage: ogwatch [options] <directory>...\n");
     printf("Options:\n");
     printf("  -f <file_events>   Comma-separated list of file events to see.\n");
     printf("  -d <dir_events>    Comma-separated list of directory events to see.\n");
+    printf("  -R <file>          Also watch the directories listed in this file, one per line.\n");
     printf("  -0                 Use null character as terminator for output lines.\n");
     printf("  -g                 Enable generic output mode, printing only paths.\n");
+    printf("  -b <size>          Bytes of events to read at a time, 64K to 1M (fanotify only).\n");
+    printf("  -s                 Scope kernel marks to the watched tree (fanotify only).\n");
+    printf("  -P                 Run in a single process, without privilege separation (fanotify only).\n");
+    printf("  -q                 Use a bounded kernel event queue; report the root if it overflows (fanotify only).\n");
+    printf("  -j <threads>       Resolve events, and walk the tree for --initial-scan, with this many threads (fanotify only).\n");
+    printf("  -w <ms>            Report each changed path once per window of this many ms (generic mode).\n");
+    printf("  --format=<format>  Output format: text (the default), binary or ndjson.\n");
+    printf("  --initial-scan     Report everything in the tree, then BARRIER, then the changes since (fanotify only).\n");
+    printf("  --exclude=<glob>   Leave out matching paths, and everything below matching directories.\n");
+    printf("  --include=<glob>   Keep matching paths that an earlier --exclude left out.\n");
+    printf("  --ignore-pid=<pid> Leave out changes made by this process, or anything it starts (fanotify only).\n");
+    printf("  --ignore-cgroup=<cgroup>  Leave out changes made from this cgroup, or any below it (fanotify only).\n");
+    printf("  --ignore-self-tree Leave out changes made by whatever started ogwatch, or anything it starts (fanotify only).\n");
+    printf("  --skip-unchanged[=<size>]  Leave out FAN_CLOSE_WRITE when the file's contents didn't change;\n");
+    printf("                     files bigger than size (default 16M) are never skipped (fanotify only).\n");
+    printf("  --stats-fd=<fd>    Write stats here on SIGUSR1, instead of to stderr.\n");
+    printf("  --stats-interval=<ms>  Also write stats this often.\n");
+    printf("  --journal=<file>   Also record every reported path here, for catching up after a restart.\n");
+    printf("  --journal-size=<size>  Bytes of history the journal keeps, 64K to 1024M (default 16M).\n");
+    printf("  --since=<seq>      Print what the journal has recorded since this sequence number, and exit.\n");
+    printf("  --listen=<socket>  Serve events to other ogwatch processes on this socket (fanotify only).\n");
+    printf("  --connect=<socket> Get events from the ogwatch serving on this socket (fanotify only).\n");
+    printf("  --record=<file>    Also save a trace of the events the kernel reports, for --replay; root only (fanotify only).\n");
+    printf("  --replay=<file>    Put a trace's events through the output again, as fast as it goes, instead of watching (fanotify only).\n");
     printf("  -h                 Display this help message and exit.\n");
     printf("\nEvents:\n");
     printf("The events you can monitor are specific to the backend in use. On this\n");
@@ -72,8 +241,57 @@ int main(int argc, char *argv[]) {
     int generic_mode = 0;
     int opt;
     char terminator = '\n';
+    size_t read_buffer_size = DEFAULT_READ_BUFFER_SIZE;
+    int scoped_marks = 0;
+    int privsep = 1;
+    int threads = 0;
+    int bounded_queue = 0;
+    int coalesce_window_ms = 0;
+    OutputFormat format = OUTPUT_TEXT;
+    RootSet *roots = roots_create();
+    PathFilter *filter = filter_create();
+    OriginFilter *ignore = origin_create();
+    int stats_fd = STDERR_FILENO;
+    int stats_interval_ms = 0;
+    const char *journal_path = NULL;
+    size_t journal_size = DEFAULT_JOURNAL_SIZE;
+    int since_given = 0;
+    uint64_t since = 0;
+    const char *listen_path = NULL;
+    const char *connect_path = NULL;
+    int reader_options = 0;
+    int initial_scan = 0;
+    size_t unchanged_max_size = 0;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
 
-    while ((opt = getopt(argc, argv, "f:d:0gh")) != -1) {
+    // Long options without a short form get values past the ASCII range
+    enum { OPT_FORMAT = 256, OPT_EXCLUDE, OPT_INCLUDE, OPT_STATS_FD, OPT_STATS_INTERVAL, OPT_JOURNAL,
+           OPT_JOURNAL_SIZE, OPT_SINCE, OPT_LISTEN, OPT_CONNECT, OPT_INITIAL_SCAN,
+           OPT_IGNORE_PID, OPT_IGNORE_CGROUP, OPT_IGNORE_SELF_TREE, OPT_SKIP_UNCHANGED,
+           OPT_RECORD, OPT_REPLAY };
+    static const struct option long_options[] = {
+        {"format", required_argument, NULL, OPT_FORMAT},
+        {"exclude", required_argument, NULL, OPT_EXCLUDE},
+        {"include", required_argument, NULL, OPT_INCLUDE},
+        {"stats-fd", required_argument, NULL, OPT_STATS_FD},
+        {"stats-interval", required_argument, NULL, OPT_STATS_INTERVAL},
+        {"journal", required_argument, NULL, OPT_JOURNAL},
+        {"journal-size", required_argument, NULL, OPT_JOURNAL_SIZE},
+        {"since", required_argument, NULL, OPT_SINCE},
+        {"listen", required_argument, NULL, OPT_LISTEN},
+        {"connect", required_argument, NULL, OPT_CONNECT},
+        {"initial-scan", no_argument, NULL, OPT_INITIAL_SCAN},
+        {"ignore-pid", required_argument, NULL, OPT_IGNORE_PID},
+        {"ignore-cgroup", required_argument, NULL, OPT_IGNORE_CGROUP},
+        {"ignore-self-tree", no_argument, NULL, OPT_IGNORE_SELF_TREE},
+        {"skip-unchanged", optional_argument, NULL, OPT_SKIP_UNCHANGED},
+        {"record", required_argument, NULL, OPT_RECORD},
+        {"replay", required_argument, NULL, OPT_REPLAY},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "f:d:b:j:w:R:0gsPqh", long_options, NULL)) != -1) {
         switch (opt) {
             case 'f':
                 file_events_mask = parse_events(optarg);
@@ -84,9 +302,151 @@ int main(int argc, char *argv[]) {
             case 'g':
                 generic_mode = 1;
                 break;
+            case 'R':
+                add_roots_from_file(roots, optarg);
+                break;
             case '0':
                 terminator = '\0';
                 break;
+            case 's':
+                scoped_marks = 1;
+                reader_options = 1;
+                break;
+            case 'P':
+                privsep = 0;
+                reader_options = 1;
+                break;
+            case 'q':
+                bounded_queue = 1;
+                reader_options = 1;
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                if (threads < 1 || threads > MAX_THREADS) {
+                    fprintf(stderr, "Invalid thread count '%s' (must be 1 to %d).\n", optarg, MAX_THREADS);
+                    exit(EXIT_FAILURE);
+                }
+                reader_options = 1;
+                break;
+            case 'w':
+                coalesce_window_ms = atoi(optarg);
+                if (coalesce_window_ms < 1 || coalesce_window_ms > MAX_COALESCE_WINDOW_MS) {
+                    fprintf(stderr, "Invalid window '%s' (must be 1 to %d ms).\n", optarg, MAX_COALESCE_WINDOW_MS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'b':
+                read_buffer_size = parse_size(optarg);
+                if (read_buffer_size < MIN_READ_BUFFER_SIZE || read_buffer_size > MAX_READ_BUFFER_SIZE) {
+                    fprintf(stderr, "Invalid read buffer size '%s' (must be 64K to 1M).\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                reader_options = 1;
+                break;
+            case OPT_FORMAT:
+                if (strcmp(optarg, "text") == 0) {
+                    format = OUTPUT_TEXT;
+                } else if (strcmp(optarg, "binary") == 0) {
+                    format = OUTPUT_BINARY;
+                } else if (strcmp(optarg, "ndjson") == 0) {
+                    format = OUTPUT_NDJSON;
+                } else {
+                    fprintf(stderr, "Invalid format '%s' (must be text, binary or ndjson).\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_EXCLUDE:
+                filter_add(filter, optarg, 1);
+                break;
+            case OPT_INCLUDE:
+                filter_add(filter, optarg, 0);
+                break;
+            case OPT_STATS_FD:
+                stats_fd = atoi(optarg);
+                if (fcntl(stats_fd, F_GETFD) == -1) {
+                    fprintf(stderr, "Invalid stats fd '%s' (must be open).\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_STATS_INTERVAL:
+                stats_interval_ms = atoi(optarg);
+                if (stats_interval_ms < 1) {
+                    fprintf(stderr, "Invalid stats interval '%s' (must be at least 1 ms).\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_JOURNAL:
+                journal_path = optarg;
+                break;
+            case OPT_JOURNAL_SIZE:
+                journal_size = parse_size(optarg);
+                if (journal_size < MIN_JOURNAL_SIZE || journal_size > MAX_JOURNAL_SIZE) {
+                    fprintf(stderr, "Invalid journal size '%s' (must be 64K to 1024M).\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_SINCE: {
+                char *end;
+                errno = 0;
+                since = strtoull(optarg, &end, 10);
+                if (errno != 0 || end == optarg || *end != '\0') {
+                    fprintf(stderr, "Invalid sequence number '%s'.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                since_given = 1;
+                break;
+            }
+            case OPT_LISTEN:
+                listen_path = optarg;
+                break;
+            case OPT_CONNECT:
+                connect_path = optarg;
+                break;
+            case OPT_INITIAL_SCAN:
+                initial_scan = 1;
+                break;
+            case OPT_IGNORE_PID: {
+                char *end;
+                errno = 0;
+                long pid = strtol(optarg, &end, 10);
+                if (errno != 0 || end == optarg || *end != '\0' || pid < 1 || pid > INT_MAX) {
+                    fprintf(stderr, "Invalid pid '%s'.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                origin_add_pid(ignore, pid);
+                reader_options = 1;
+                break;
+            }
+            case OPT_IGNORE_CGROUP:
+                if (origin_add_cgroup(ignore, optarg) == -1) {
+                    fprintf(stderr, "Invalid cgroup '%s' (must be a cgroup2 directory, or start with /).\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                reader_options = 1;
+                break;
+            case OPT_IGNORE_SELF_TREE:
+                // Whatever started us, and so everything else it starts
+                origin_add_pid(ignore, getppid());
+                reader_options = 1;
+                break;
+            case OPT_SKIP_UNCHANGED:
+                unchanged_max_size = DEFAULT_UNCHANGED_MAX_SIZE;
+                if (optarg != NULL) {
+                    unchanged_max_size = parse_size(optarg);
+                    if (unchanged_max_size == 0) {
+                        fprintf(stderr, "Invalid size '%s'.\n", optarg);
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                reader_options = 1;
+                break;
+            case OPT_RECORD:
+                record_path = optarg;
+                reader_options = 1;
+                break;
+            case OPT_REPLAY:
+                replay_path = optarg;
+                break;
             case 'h':
                 print_help();
                 exit(EXIT_SUCCESS);
@@ -95,11 +455,71 @@ int main(int argc, char *argv[]) {
                 exit(EXIT_FAILURE);
         }
     }
-    if (optind >= argc) {
+
+    if (since_given) {
+        if (journal_path == NULL) {
+            fprintf(stderr, "--since needs --journal.\n");
+            exit(EXIT_FAILURE);
+        }
+        print_journal_since(journal_path, since, terminator);
+        exit(EXIT_SUCCESS);
+    }
+
+    for (int i = optind; i < argc; i++)
+        add_root(roots, argv[i]);
+    if (roots_count(roots) == 0 && replay_path == NULL) {
         fprintf(stderr, "Missing path argument. Use -h for help.\n");
         exit(EXIT_FAILURE);
     }
 
+    /* A replay's roots and everything about reading from the kernel were
+       settled when it was recorded. */
+
+    if (replay_path != NULL && roots_count(roots) > 0) {
+        fprintf(stderr, "--replay takes its directories from the trace.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (replay_path != NULL && (listen_path != NULL || connect_path != NULL || record_path != NULL || initial_scan
+                                || !origin_is_empty(ignore) || unchanged_max_size))
+    {
+        fprintf(stderr, "--replay can't go with --listen, --connect, --record, --initial-scan, --ignore-* or --skip-unchanged.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* The trace has events from wherever the marks reach, which may be the
+       whole filesystem, and a replay shows all of it. */
+
+    if (record_path != NULL && getuid() != 0) {
+        fprintf(stderr, "--record needs to be run by root.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (record_path != NULL && listen_path != NULL) {
+        fprintf(stderr, "--record can't go with --listen.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (listen_path != NULL && connect_path != NULL) {
+        fprintf(stderr, "--listen and --connect can't go together.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (listen_path != NULL && (journal_path != NULL || coalesce_window_ms || !filter_is_empty(filter))) {
+        fprintf(stderr, "--journal, -w, --exclude and --include are up to each client with --listen.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (initial_scan && (listen_path != NULL || connect_path != NULL)) {
+        fprintf(stderr, "--initial-scan can't go with --listen or --connect.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (connect_path != NULL && reader_options) {
+        fprintf(stderr, "-b, -s, -P, -q, -j, --ignore-*, --skip-unchanged and --record are up to the daemon with --connect.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (coalesce_window_ms && !generic_mode) {
+        fprintf(stderr, "-w only applies to generic mode (-g).\n");
+        exit(EXIT_FAILURE);
+    }
+
     if (!file_events_mask && !dir_events_mask) {
         if (!generic_mode) {
             file_events_mask = get_default_file_events_mask();
@@ -110,7 +530,32 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    event_watch_loop(argv[optind], file_events_mask, dir_events_mask, generic_mode, terminator);
+    WatchOptions options;
+    options.roots = roots;
+    options.file_events_mask = file_events_mask;
+    options.dir_events_mask = dir_events_mask;
+    options.generic_mode = generic_mode;
+    options.terminator = terminator;
+    options.read_buffer_size = read_buffer_size;
+    options.scoped_marks = scoped_marks;
+    options.privsep = privsep;
+    options.threads = threads;
+    options.bounded_queue = bounded_queue;
+    options.coalesce_window_ms = coalesce_window_ms;
+    options.initial_scan = initial_scan;
+    options.format = format;
+    options.filter = filter_is_empty(filter) ? NULL : filter;
+    options.ignore = origin_is_empty(ignore) ? NULL : ignore;
+    options.unchanged_max_size = unchanged_max_size;
+    options.stats_fd = stats_fd;
+    options.stats_interval_ms = stats_interval_ms;
+    options.journal = journal_path != NULL ? journal_open(journal_path, journal_size) : NULL;
+    options.listen_path = listen_path;
+    options.connect_path = connect_path;
+    options.record_path = record_path;
+    options.replay_path = replay_path;
+
+    event_watch_loop(&options);
 
     // Can't happen that we get here, we always exit from signal...
     exit(EXIT_SUCCESS);
@@ -1,6 +1,14 @@
 #ifndef EVENT_WATCHER_H
 #define EVENT_WATCHER_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include "filter.h"
+#include "journal.h"
+#include "origin.h"
+#include "roots.h"
+
 // A structure to hold event name and value
 typedef struct {
     char *name;
@@ -14,6 +22,106 @@ unsigned int get_default_dir_events_mask();
 unsigned int get_generic_file_events_mask();
 unsigned int get_generic_dir_events_mask();
 
-void event_watch_loop(const char *path, unsigned int file_events_mask, unsigned int dir_events_mask, int generic_mode, char terminator);
+#define DEFAULT_READ_BUFFER_SIZE (64 * 1024)
+#define MIN_READ_BUFFER_SIZE (64 * 1024)
+#define MAX_READ_BUFFER_SIZE (1024 * 1024)
+#define MAX_THREADS 64
+#define DEFAULT_SCAN_THREADS 8
+#define DEFAULT_UNCHANGED_MAX_SIZE (16 * 1024 * 1024)
+#define MAX_COALESCE_WINDOW_MS 60000
+
+// Event flags
+#define EVENT_IS_DIR 0x1    // The event is on a directory
+#define EVENT_ESTALE 0x2    // Something changed, but was gone before we could see what
+#define EVENT_OVERFLOW 0x4  // Events were lost; the path (the watch root, or below it if output stalled) needs a full rescan
+#define EVENT_SNAPSHOT 0x8  // Not a change: the path was there when the initial scan went by
+#define EVENT_BARRIER 0x10  // The initial scan is done; everything after it is a change
+
+// One event on its way to the output stage
+typedef struct {
+    unsigned int mask;      // Backend-specific event bits, already filtered
+    unsigned int flags;
+    const char *path;       // Not necessarily terminated
+    size_t path_len;
+    uint64_t timestamp_ns;  // CLOCK_MONOTONIC, when we got the event
+    int root;               // Index of the watch root it's under, or -1 if not known
+    const char *from_path;  // For a rename, where it was, under the same root; otherwise NULL
+    size_t from_path_len;
+} Event;
+
+typedef enum {
+    OUTPUT_TEXT,            // Lines of event names and paths, or just paths with -g
+    OUTPUT_BINARY,          // An OutputRecordHeader and the path, per event
+    OUTPUT_NDJSON           // A JSON object per line, per event
+} OutputFormat;
+
+/* Header of each --format=binary record. It's followed by the path bytes,
+   and then for a rename the path it was renamed from, with no terminators.
+   Fields are in the host's byte order. */
+typedef struct {
+    uint32_t length;        // Of header and paths together
+    uint32_t mask;          // Backend-specific event bits
+    uint32_t flags;         // EVENT_* flags
+    uint32_t path_len;
+    int32_t root;           // Index of the watch root, in the order given, or -1
+    uint32_t from_path_len; // Zero unless it's a rename
+    uint64_t timestamp_ns;  // CLOCK_MONOTONIC
+    uint64_t sequence;      // Counts up from 1 with no gaps, or from the journal's next number with --journal
+} OutputRecordHeader;
+
+// Everything the command line can configure about a watch
+typedef struct {
+    const RootSet *roots;    // Canonical paths to watch, at least one unless listening
+    unsigned int file_events_mask;
+    unsigned int dir_events_mask;
+    int generic_mode;
+    char terminator;
+    size_t read_buffer_size; // Bytes of events to read per syscall (fanotify only)
+    int scoped_marks;        // Mark only the watched tree, not its filesystem (fanotify only)
+    int privsep;             // Format and write output in a separate, unprivileged process (fanotify only)
+    int threads;             // Threads to resolve events with, or 0 if not given (fanotify only)
+    int bounded_queue;       // Let the kernel drop events rather than queue without limit (fanotify only)
+    int coalesce_window_ms;  // Report each changed path at most once per window, or 0 (generic mode)
+    int initial_scan;        // Report everything in the tree, then a barrier, before any changes (fanotify only)
+    OutputFormat format;
+    const PathFilter *filter; // --include and --exclude rules, or NULL if none
+    const OriginFilter *ignore; // Processes whose changes aren't reported, or NULL (fanotify only)
+    size_t unchanged_max_size; // Drop close-writes that left files up to this big as they were, or 0 (fanotify only)
+    int stats_fd;            // Where stats go on SIGUSR1
+    int stats_interval_ms;   // Also write stats this often, or 0
+    Journal *journal;        // Where reported events are recorded too, or NULL
+    const char *listen_path; // Serve events to clients on this socket instead, or NULL (fanotify only)
+    const char *connect_path; // Get events from the daemon on this socket, or NULL (fanotify only)
+    const char *record_path; // Also save a trace of what the kernel reports here, or NULL (fanotify only)
+    const char *replay_path; // Read events back from this trace instead of watching, or NULL (fanotify only)
+} WatchOptions;
+
+void event_watch_loop(const WatchOptions *options);
+
+// Buffered stdout; backends call output_flush() once per batch of events
+void output_printf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void output_write(const void *data, size_t len);
+void output_flush();
+
+/* Without blocking: when whoever reads our output falls behind, events
+   can be held back and folded together instead of waiting on them. Once
+   output_set_nonblocking() has been called, output_try_flush() writes
+   what stdout will take and returns whether that was everything, and
+   output_has_room() says whether another event can be written out yet.
+   output_flush() still waits. */
+void output_set_nonblocking();
+int output_try_flush();
+int output_has_room();
+
+// Gives an event being reported its sequence number, and records it in the
+// journal if there is one. output_event() does this itself; other output
+// calls it once per event.
+uint64_t output_number_event(const WatchOptions *options, const Event *event);
+
+// Writes an event as one record in a machine-readable format
+void output_event(const WatchOptions *options, const Event *event);
+
+// The current CLOCK_MONOTONIC time, for Event.timestamp_ns
+uint64_t monotonic_ns();
 
 #endif
@@ -0,0 +1,210 @@
+/*
+
+Copyright (C) 2024, Andrew Moise <andrew.moise@gmail.com>
+
+Licensed under GNU Affero General Public License, Version 3
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Only Linux has cgroups, but the rest builds anywhere
+#ifdef __linux__
+#include <sys/statfs.h>
+#else
+#include <sys/mount.h>
+#endif
+
+#include "origin.h"
+
+#ifndef CGROUP2_SUPER_MAGIC
+#define CGROUP2_SUPER_MAGIC 0x63677270
+#endif
+
+// How far up the process tree to look for an ignored ancestor
+#define ORIGIN_MAX_DEPTH 64
+
+struct OriginFilter {
+    pid_t *pids;
+    int num_pids;
+    int pids_capacity;
+    char **cgroups;     // As /proc/<pid>/cgroup names them, without a trailing slash
+    int num_cgroups;
+    int cgroups_capacity;
+};
+
+OriginFilter *origin_create() {
+    OriginFilter *filter = calloc(1, sizeof(*filter));
+    if (filter == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    return filter;
+}
+
+void origin_destroy(OriginFilter *filter) {
+    for (int i = 0; i < filter->num_cgroups; i++)
+        free(filter->cgroups[i]);
+    free(filter->cgroups);
+    free(filter->pids);
+    free(filter);
+}
+
+int origin_is_empty(const OriginFilter *filter) {
+    return filter->num_pids == 0 && filter->num_cgroups == 0;
+}
+
+void origin_add_pid(OriginFilter *filter, pid_t pid) {
+    if (filter->num_pids == filter->pids_capacity) {
+        filter->pids_capacity = filter->pids_capacity ? filter->pids_capacity * 2 : 16;
+        filter->pids = realloc(filter->pids, filter->pids_capacity * sizeof(*filter->pids));
+        if (filter->pids == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    filter->pids[filter->num_pids++] = pid;
+}
+
+/* A directory on the cgroup2 filesystem is named by its path below the
+   mount point, which we find by going up until we leave the filesystem. */
+static int cgroup_dir_name(const char *dir, char *name, size_t name_size) {
+    char path[PATH_MAX];
+    struct statfs fs;
+
+    if (realpath(dir, path) == NULL || statfs(path, &fs) == -1 || fs.f_type != CGROUP2_SUPER_MAGIC)
+        return -1;
+
+    char mount[PATH_MAX];
+    strcpy(mount, path);
+    while (1) {
+        char *slash = strrchr(mount, '/');
+        if (slash == NULL || slash == mount)
+            break;
+        *slash = '\0';
+        if (statfs(mount, &fs) == -1 || fs.f_type != CGROUP2_SUPER_MAGIC) {
+            *slash = '/';
+            break;
+        }
+    }
+
+    size_t mount_len = strlen(mount);
+    snprintf(name, name_size, "%s", path[mount_len] != '\0' ? path + mount_len : "/");
+    return 0;
+}
+
+int origin_add_cgroup(OriginFilter *filter, const char *cgroup) {
+    char name[PATH_MAX];
+
+    if (cgroup_dir_name(cgroup, name, sizeof(name)) == -1) {
+        if (cgroup[0] != '/') {
+            errno = EINVAL;
+            return -1;
+        }
+        snprintf(name, sizeof(name), "%s", cgroup);
+    }
+    size_t len = strlen(name);
+    while (len > 1 && name[len - 1] == '/')
+        name[--len] = '\0';
+
+    if (filter->num_cgroups == filter->cgroups_capacity) {
+        filter->cgroups_capacity = filter->cgroups_capacity ? filter->cgroups_capacity * 2 : 16;
+        filter->cgroups = realloc(filter->cgroups, filter->cgroups_capacity * sizeof(*filter->cgroups));
+        if (filter->cgroups == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    filter->cgroups[filter->num_cgroups] = strdup(name);
+    if (filter->cgroups[filter->num_cgroups] == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    filter->num_cgroups++;
+    return 0;
+}
+
+// Reads a file from /proc for a process, as a string. Returns its length, or -1.
+static ssize_t read_proc_file(pid_t pid, const char *file, char *buf, size_t buf_size) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/%s", (int) pid, file);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    ssize_t len = read(fd, buf, buf_size - 1);
+    close(fd);
+    if (len == -1)
+        return -1;
+    buf[len] = '\0';
+    return len;
+}
+
+static int in_ignored_cgroup(const OriginFilter *filter, pid_t pid) {
+    char buf[PATH_MAX + 64];
+
+    // The cgroup2 hierarchy is the line with no controllers: "0::<path>"
+    if (read_proc_file(pid, "cgroup", buf, sizeof(buf)) == -1)
+        return 0;
+    char *line = buf;
+    while (strncmp(line, "0::", 3) != 0) {
+        line = strchr(line, '\n');
+        if (line == NULL)
+            return 0;
+        line++;
+    }
+    char *cgroup = line + 3;
+    cgroup[strcspn(cgroup, "\n")] = '\0';
+
+    for (int i = 0; i < filter->num_cgroups; i++) {
+        const char *ignored = filter->cgroups[i];
+        size_t len = strlen(ignored);
+        if (strncmp(cgroup, ignored, len) == 0
+            && (cgroup[len] == '\0' || cgroup[len] == '/' || (len == 1 && ignored[0] == '/')))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int is_ignored_pid(const OriginFilter *filter, pid_t pid) {
+    for (int i = 0; i < filter->num_pids; i++) {
+        if (filter->pids[i] == pid)
+            return 1;
+    }
+    return 0;
+}
+
+/* Walks up the process tree through /proc. A thread's status gives the
+   process it belongs to, and every process's gives its parent. */
+static int has_ignored_ancestor(const OriginFilter *filter, pid_t pid) {
+    char buf[1024];
+
+    for (int depth = 0; depth < ORIGIN_MAX_DEPTH && pid > 0; depth++) {
+        if (read_proc_file(pid, "status", buf, sizeof(buf)) == -1)
+            return 0;
+        const char *tgid = strstr(buf, "\nTgid:");
+        const char *ppid = strstr(buf, "\nPPid:");
+        if (tgid == NULL || ppid == NULL)
+            return 0;
+        if (is_ignored_pid(filter, atoi(tgid + 6)))
+            return 1;
+        pid = atoi(ppid + 6);
+        if (is_ignored_pid(filter, pid))
+            return 1;
+    }
+    return 0;
+}
+
+int origin_ignores(const OriginFilter *filter, pid_t pid) {
+    if (filter->num_pids > 0 && (is_ignored_pid(filter, pid) || has_ignored_ancestor(filter, pid)))
+        return 1;
+    return filter->num_cgroups > 0 && in_ignored_cgroup(filter, pid);
+}
@@ -0,0 +1,28 @@
+#ifndef ORIGIN_H
+#define ORIGIN_H
+
+#include <sys/types.h>
+
+// Processes whose changes aren't reported, for --ignore-pid,
+// --ignore-cgroup and --ignore-self-tree: a process is ignored if it or
+// one of its ancestors was given by pid, or it's in a given cgroup or one
+// below it. Only cgroup v2 is understood.
+typedef struct OriginFilter OriginFilter;
+
+OriginFilter *origin_create();
+void origin_destroy(OriginFilter *filter);
+int origin_is_empty(const OriginFilter *filter);
+
+// Ignores a process, and everything it starts while it's running
+void origin_add_pid(OriginFilter *filter, pid_t pid);
+
+// Ignores a cgroup and everything below it, given either as its directory
+// under the cgroup2 mount or as /proc/<pid>/cgroup names it. Returns -1,
+// with errno set to EINVAL, if it's neither.
+int origin_add_cgroup(OriginFilter *filter, const char *cgroup);
+
+// Whether changes made by a process (or thread) are ignored. A process
+// that's gone already can't be told apart from any other, so it isn't.
+int origin_ignores(const OriginFilter *filter, pid_t pid);
+
+#endif
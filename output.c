@@ -0,0 +1,315 @@
+/*
+
+Copyright (C) 2024, Andrew Moise <andrew.moise@gmail.com>
+
+Licensed under GNU Affero General Public License, Version 3
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ogwatch.h"
+
+#define OUTPUT_BUF_SIZE (64 * 1024)
+
+/* Lines for a whole batch of events accumulate here, and go out with a
+   single write() when the batch is done. */
+
+static char output_buf[OUTPUT_BUF_SIZE];
+static size_t output_len = 0;
+static int output_nonblocking = 0;
+static int output_is_socket = 0;
+
+static ssize_t write_some(const char *data, size_t len) {
+    if (output_is_socket)
+        return send(STDOUT_FILENO, data, len, MSG_DONTWAIT);
+    return write(STDOUT_FILENO, data, len);
+}
+
+static void write_all(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write_some(data, len);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN && output_nonblocking) {
+                struct pollfd pollfd = { STDOUT_FILENO, POLLOUT, 0 };
+                poll(&pollfd, 1, -1);
+                continue;
+            }
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        data += written;
+        len -= written;
+    }
+}
+
+/* stdout's open file description may be shared, with a shell's terminal
+   say, so rather than set O_NONBLOCK on it, we open pipes and terminals
+   again for ourselves, and send to sockets with MSG_DONTWAIT. Writes to
+   files don't wait for a reader, so they stay as they are. */
+void output_set_nonblocking() {
+    struct stat st;
+    if (fstat(STDOUT_FILENO, &st) == -1)
+        return;
+
+    if (S_ISSOCK(st.st_mode)) {
+        output_is_socket = 1;
+        output_nonblocking = 1;
+        return;
+    }
+    if (!S_ISFIFO(st.st_mode) && !S_ISCHR(st.st_mode))
+        return;
+
+    /* We may be root, so only if stdout was opened for writing already;
+       opening it again mustn't give anything new. If that doesn't work,
+       blocking writes still do. */
+    int flags = fcntl(STDOUT_FILENO, F_GETFL);
+    if (flags == -1 || (flags & O_ACCMODE) == O_RDONLY)
+        return;
+    int fd = open("/proc/self/fd/1", O_WRONLY | O_NONBLOCK | O_NOCTTY);
+    if (fd == -1)
+        return;
+    if (dup2(fd, STDOUT_FILENO) != -1)
+        output_nonblocking = 1;
+    close(fd);
+}
+
+void output_flush() {
+    write_all(output_buf, output_len);
+    output_len = 0;
+}
+
+int output_try_flush() {
+    if (!output_nonblocking) {
+        output_flush();
+        return 1;
+    }
+
+    size_t sent = 0;
+    while (sent < output_len) {
+        ssize_t written = write_some(output_buf + sent, output_len - sent);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                break;
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        sent += written;
+    }
+    memmove(output_buf, output_buf + sent, output_len - sent);
+    output_len -= sent;
+    return output_len == 0;
+}
+
+/* Half the buffer is kept free, so that whatever one event turns into
+   fits without waiting. */
+int output_has_room() {
+    if (output_len > OUTPUT_BUF_SIZE / 2)
+        output_try_flush();
+    return output_len <= OUTPUT_BUF_SIZE / 2;
+}
+
+void output_printf(const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    int len = vsnprintf(output_buf + output_len, OUTPUT_BUF_SIZE - output_len, format, args);
+    va_end(args);
+    if (len < 0) {
+        perror("vsnprintf");
+        exit(EXIT_FAILURE);
+    }
+    if ((size_t) len < OUTPUT_BUF_SIZE - output_len) {
+        output_len += len;
+        return;
+    }
+
+    /* Didn't fit; make room and try again. */
+
+    output_flush();
+    if ((size_t) len < OUTPUT_BUF_SIZE) {
+        va_start(args, format);
+        vsnprintf(output_buf, OUTPUT_BUF_SIZE, format, args);
+        va_end(args);
+        output_len = len;
+        return;
+    }
+
+    /* Bigger than the whole buffer, so it goes out on its own. */
+
+    char *line = malloc(len + 1);
+    if (line == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    va_start(args, format);
+    vsnprintf(line, len + 1, format, args);
+    va_end(args);
+    write_all(line, len);
+    free(line);
+}
+
+void output_write(const void *data, size_t len) {
+    if (len > OUTPUT_BUF_SIZE - output_len)
+        output_flush();
+    if (len >= OUTPUT_BUF_SIZE) {
+        write_all(data, len);
+        return;
+    }
+    memcpy(output_buf + output_len, data, len);
+    output_len += len;
+}
+
+// The length of the well-formed UTF-8 character at s, or 0 if there isn't one
+static size_t utf8_char_len(const unsigned char *s, size_t avail) {
+    unsigned char lo = 0x80, hi = 0xbf;     // Where the second byte can be
+    size_t len;
+
+    if (s[0] < 0x80)
+        return 1;
+    if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+        len = 2;
+    } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+        len = 3;
+        if (s[0] == 0xe0)
+            lo = 0xa0;      // Overlong
+        else if (s[0] == 0xed)
+            hi = 0x9f;      // Surrogates
+    } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+        len = 4;
+        if (s[0] == 0xf0)
+            lo = 0x90;      // Overlong
+        else if (s[0] == 0xf4)
+            hi = 0x8f;      // Past U+10FFFF
+    } else {
+        return 0;
+    }
+
+    if (avail < len || s[1] < lo || s[1] > hi)
+        return 0;
+    for (size_t i = 2; i < len; i++) {
+        if (s[i] < 0x80 || s[i] > 0xbf)
+            return 0;
+    }
+    return len;
+}
+
+/* Paths are bytes, not necessarily UTF-8. Anything JSON can't carry as-is
+   is escaped, and a byte that isn't part of a well-formed UTF-8 character
+   becomes the lone surrogate U+DC00 plus its value, as Python's
+   surrogateescape has it. No real character maps there, so the bytes can
+   always be had back, and every line stays parseable. */
+static void write_json_string(const char *str, size_t len) {
+    const unsigned char *bytes = (const unsigned char *) str;
+    size_t run = 0, i = 0;
+
+    output_write("\"", 1);
+    while (i < len) {
+        unsigned char c = bytes[i];
+        size_t char_len = utf8_char_len(bytes + i, len - i);
+        if (char_len > 1 || (char_len == 1 && c >= 0x20 && c != '"' && c != '\\')) {
+            i += char_len;
+            continue;
+        }
+
+        output_write(str + run, i - run);
+        if (c == '"' || c == '\\')
+            output_printf("\\%c", c);
+        else if (c < 0x20)
+            output_printf("\\u%04x", c);
+        else
+            output_printf("\\udc%02x", c);
+        run = ++i;
+    }
+    output_write(str + run, len - run);
+    output_write("\"", 1);
+}
+
+static uint64_t last_sequence = 0;
+
+/* With a journal, an event's number is its place in the journal, so that
+   a consumer can pick up from it after a restart. */
+uint64_t output_number_event(const WatchOptions *options, const Event *event) {
+    if (options->journal != NULL)
+        return journal_append(options->journal, event->flags, event->path, event->path_len,
+                              event->from_path, event->from_path_len);
+    return ++last_sequence;
+}
+
+void output_event(const WatchOptions *options, const Event *event) {
+    uint64_t sequence = output_number_event(options, event);
+
+    if (options->format == OUTPUT_BINARY) {
+        OutputRecordHeader header;
+        header.length = sizeof(header) + event->path_len + event->from_path_len;
+        header.mask = event->mask;
+        header.flags = event->flags;
+        header.path_len = event->path_len;
+        header.root = event->root;
+        header.from_path_len = event->from_path_len;
+        header.timestamp_ns = event->timestamp_ns;
+        header.sequence = sequence;
+        output_write(&header, sizeof(header));
+        output_write(event->path, event->path_len);
+        if (event->from_path != NULL)
+            output_write(event->from_path, event->from_path_len);
+        return;
+    }
+
+    output_printf("{\"seq\":%llu,\"time_ns\":%llu,\"mask\":%u,\"events\":[",
+                  (unsigned long long) sequence, (unsigned long long) event->timestamp_ns, event->mask);
+
+    const char *separator = "";
+    if (event->flags & EVENT_ESTALE) {
+        output_printf("\"ESTALE\"");
+        separator = ",";
+    }
+    if (event->flags & EVENT_OVERFLOW) {
+        output_printf("%s\"OVERFLOW\"", separator);
+        separator = ",";
+    }
+    if (event->flags & EVENT_SNAPSHOT) {
+        output_printf("%s\"SNAPSHOT\"", separator);
+        separator = ",";
+    }
+    if (event->flags & EVENT_BARRIER) {
+        output_printf("%s\"BARRIER\"", separator);
+        separator = ",";
+    }
+    EventMap *events = get_full_events_list();
+    for (int i = 0; events[i].name != NULL; i++) {
+        if (events[i].value != 0 && (event->mask & events[i].value) == events[i].value) {
+            output_printf("%s\"%s\"", separator, events[i].name);
+            separator = ",";
+        }
+    }
+
+    output_printf("],\"dir\":%s,\"root\":", (event->flags & EVENT_IS_DIR) ? "true" : "false");
+    if (event->root != -1) {
+        const char *root = roots_path(options->roots, event->root);
+        write_json_string(root, strlen(root));
+    } else {
+        output_printf("null");
+    }
+    output_printf(",\"path\":");
+    write_json_string(event->path, event->path_len);
+    if (event->from_path != NULL) {
+        output_printf(",\"from\":");
+        write_json_string(event->from_path, event->from_path_len);
+    }
+    output_write("}\n", 2);
+}
@@ -0,0 +1,136 @@
+/*
+
+Copyright (C) 2024, Andrew Moise <andrew.moise@gmail.com>
+
+Licensed under GNU Affero General Public License, Version 3
+
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+struct WorkerPool {
+    int threads;
+    pthread_t *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+
+    // The current batch; all guarded by lock
+    unsigned long generation;
+    PoolJobFunc func;
+    void *arg;
+    size_t count;
+    size_t next;
+    size_t finished;
+    int stopping;
+};
+
+/* Takes jobs from the current batch until there are none left. Called
+   with the lock held, and returns with it held. */
+static void run_jobs(WorkerPool *pool) {
+    while (pool->next < pool->count) {
+        size_t index = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        pool->func(index, pool->arg);
+        pthread_mutex_lock(&pool->lock);
+
+        if (++pool->finished == pool->count)
+            pthread_cond_signal(&pool->work_done);
+    }
+}
+
+static void *worker_main(void *arg) {
+    WorkerPool *pool = arg;
+    unsigned long seen_generation = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->generation == seen_generation && !pool->stopping)
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        if (pool->stopping)
+            break;
+        seen_generation = pool->generation;
+        run_jobs(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+WorkerPool *pool_create(int threads) {
+    WorkerPool *pool = malloc(sizeof(*pool));
+    if (pool == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memset(pool, 0, sizeof(*pool));
+    pool->threads = threads;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+
+    pool->workers = malloc(threads * sizeof(*pool->workers));
+    if (pool->workers == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 1; i < threads; i++) {
+        int err = pthread_create(&pool->workers[i], NULL, worker_main, pool);
+        if (err != 0) {
+            // Stop the ones we did start
+            pool->threads = i;
+            pool_destroy(pool);
+            errno = err;
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+void pool_run(WorkerPool *pool, size_t count, PoolJobFunc func, void *arg) {
+    if (count == 0)
+        return;
+
+    // Not worth waking anybody up for
+    if (count == 1 || pool->threads == 1) {
+        for (size_t i = 0; i < count; i++)
+            func(i, arg);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->func = func;
+    pool->arg = arg;
+    pool->count = count;
+    pool->next = 0;
+    pool->finished = 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_ready);
+
+    run_jobs(pool);
+    while (pool->finished < pool->count)
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(WorkerPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 1; i < pool->threads; i++)
+        pthread_join(pool->workers[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->work_done);
+    free(pool->workers);
+    free(pool);
+}
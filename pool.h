@@ -0,0 +1,22 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+// A fixed set of threads for running a batch of independent jobs
+typedef struct WorkerPool WorkerPool;
+
+typedef void (*PoolJobFunc)(size_t index, void *arg);
+
+// Starts threads - 1 worker threads; the caller's thread makes up the rest.
+// Returns NULL, with errno set, if they can't all be started.
+WorkerPool *pool_create(int threads);
+
+// Runs func(i, arg) for every i in [0, count) across the pool, and returns
+// once all of them are done.
+void pool_run(WorkerPool *pool, size_t count, PoolJobFunc func, void *arg);
+
+// Stops the worker threads, waiting for them to exit, and frees the pool
+void pool_destroy(WorkerPool *pool);
+
+#endif
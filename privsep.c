@@ -0,0 +1,259 @@
+/*
+
+Copyright (C) 2024, Andrew Moise <andrew.moise@gmail.com>
+
+Licensed under GNU Affero General Public License, Version 3
+
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "loop.h"
+#include "privsep.h"
+#include "stats.h"
+
+#define CHANNEL_BUF_SIZE (256 * 1024)
+
+/* The privileged process does more than resolve handles: it also applies
+   the path filter, the access checks, --ignore-* and --skip-unchanged,
+   and only what passes all of them crosses over. The access check has to
+   look at the filesystem as the real user at the time of the event,
+   through setfsuid() and back, which only root can do. So does hashing a
+   file the user may not be able to read, or reading /proc for another
+   user's process before its pid is reused. The path filter also decides
+   which directories get marks at all. And keeping all of it on this side
+   means a path the user mustn't see never leaves the root process, so
+   nothing the unprivileged one does can leak it. What's left to the
+   output process is debouncing, formatting, the journal and output. */
+
+/* Events cross the socket as --format=binary records, without sequence
+   numbers; those are the output stage's to give out. Both ends are the
+   same binary, so no need to worry about byte order or versions. */
+typedef OutputRecordHeader RecordHeader;
+
+static int channel_fd = -1;
+static char send_buf[CHANNEL_BUF_SIZE];
+static size_t send_len = 0;
+
+void privsep_flush() {
+    const char *data = send_buf;
+
+    while (send_len > 0) {
+        ssize_t written = write(channel_fd, data, send_len);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("write to output process");
+            exit(EXIT_FAILURE);
+        }
+        data += written;
+        send_len -= written;
+    }
+}
+
+void privsep_send(const Event *event) {
+    RecordHeader header;
+    header.length = sizeof(header) + event->path_len + event->from_path_len;
+    header.mask = event->mask;
+    header.flags = event->flags;
+    header.path_len = event->path_len;
+    header.timestamp_ns = event->timestamp_ns;
+    header.root = event->root;
+    header.from_path_len = event->from_path_len;
+    header.sequence = 0;
+
+    if (header.length > CHANNEL_BUF_SIZE - send_len)
+        privsep_flush();
+    if (header.length > CHANNEL_BUF_SIZE) {
+        fprintf(stderr, "Event path too long to send\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(send_buf + send_len, &header, sizeof(header));
+    if (event->path_len > 0)
+        memcpy(send_buf + send_len + sizeof(header), event->path, event->path_len);
+    if (event->from_path_len > 0)
+        memcpy(send_buf + send_len + sizeof(header) + event->path_len, event->from_path, event->from_path_len);
+    send_len += header.length;
+}
+
+void privsep_drop_privileges() {
+    if (setgid(getgid()) == -1 || setuid(getuid()) == -1) {
+        perror("Failed to drop privileges");
+        exit(EXIT_FAILURE);
+    }
+    if (getuid() != 0 && (setuid(0) != -1 || seteuid(0) != -1)) {
+        fprintf(stderr, "Privileges were not dropped\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void handle_tick(void *arg) {
+    output_stage_flush(arg);
+}
+
+static void handle_room(int fd, unsigned int events, void *arg) {
+    output_stage_flush(arg);
+}
+
+void output_stage_init(OutputStage *stage, EventLoop *loop, const WatchOptions *options, TickFunc tick) {
+    stage->options = options;
+    stage->tick = tick;
+    stage->loop = loop;
+    stage->tick_timer = (LoopTimer) { handle_tick, stage, 0 };
+    stage->waiting_for_room = 0;
+}
+
+/* The tick says 0 ms when it has more to write than stdout has room for;
+   that's for when stdout has room again, not straight away. */
+void output_stage_flush(OutputStage *stage) {
+    int timeout = stage->tick(stage->options, 0);
+    int flushed = output_try_flush();
+
+    if (flushed && stage->waiting_for_room) {
+        loop_remove(stage->loop, STDOUT_FILENO);
+        stage->waiting_for_room = 0;
+    } else if (!flushed && !stage->waiting_for_room) {
+        loop_add(stage->loop, STDOUT_FILENO, EPOLLOUT, handle_room, stage);
+        stage->waiting_for_room = 1;
+    }
+    loop_set_timer(stage->loop, &stage->tick_timer, (timeout == 0 && !flushed) ? -1 : timeout);
+}
+
+typedef struct {
+    const WatchOptions *options;
+    ReportFunc report;
+    EventLoop *loop;
+    OutputStage output;
+    char recv_buf[CHANNEL_BUF_SIZE];
+    size_t recv_len;
+} RecordReader;
+
+static void handle_records_ready(int fd, unsigned int events, void *arg) {
+    RecordReader *reader = arg;
+
+    ssize_t len = read(fd, reader->recv_buf + reader->recv_len, sizeof(reader->recv_buf) - reader->recv_len);
+    if (len == -1) {
+        if (errno == EINTR || errno == EAGAIN)
+            return;
+        perror("read from event process");
+        exit(EXIT_FAILURE);
+    }
+    if (len == 0) {
+        loop_stop(reader->loop);
+        return;
+    }
+    reader->recv_len += len;
+
+    /* Report every whole record we have, and keep the rest for when the
+       remainder of it arrives. */
+
+    size_t offset = 0;
+    while (reader->recv_len - offset >= sizeof(RecordHeader)) {
+        RecordHeader header;
+        memcpy(&header, reader->recv_buf + offset, sizeof(header));
+        if (header.length < sizeof(header) + (uint64_t) header.path_len + header.from_path_len
+            || header.length > sizeof(reader->recv_buf))
+        {
+            fprintf(stderr, "Malformed event record\n");
+            exit(EXIT_FAILURE);
+        }
+        if (header.length > reader->recv_len - offset)
+            break;
+
+        Event event;
+        event.mask = header.mask;
+        event.flags = header.flags;
+        event.path = reader->recv_buf + offset + sizeof(header);
+        event.path_len = header.path_len;
+        event.timestamp_ns = header.timestamp_ns;
+        event.root = header.root;
+        event.from_path = header.from_path_len > 0 ? event.path + header.path_len : NULL;
+        event.from_path_len = header.from_path_len;
+        reader->report(reader->options, &event);
+
+        offset += header.length;
+    }
+    memmove(reader->recv_buf, reader->recv_buf + offset, reader->recv_len - offset);
+    reader->recv_len -= offset;
+
+    output_stage_flush(&reader->output);
+}
+
+void privsep_report_records(int fd, const WatchOptions *options, ReportFunc report, TickFunc tick) {
+    static RecordReader reader;
+
+    reader.options = options;
+    reader.report = report;
+    reader.loop = loop_create();
+    output_stage_init(&reader.output, reader.loop, options, tick);
+    reader.recv_len = 0;
+
+    loop_add(reader.loop, fd, EPOLLIN, handle_records_ready, &reader);
+    loop_run(reader.loop);
+
+    tick(options, 1);
+    output_flush();
+}
+
+/* Reads events from the privileged process until it goes away, and
+   reports them. Exits with the privileged process's status. */
+static void run_output_process(const WatchOptions *options, ReportFunc report, TickFunc tick, pid_t reader_pid) {
+    // Asking us for stats gets them from the reader too
+    if (stats_start("output", options->stats_fd, options->stats_interval_ms, reader_pid) == -1) {
+        perror("Failed to start stats");
+        exit(EXIT_FAILURE);
+    }
+
+    privsep_report_records(channel_fd, options, report, tick);
+
+    int status;
+    if (waitpid(reader_pid, &status, 0) == -1) {
+        perror("waitpid");
+        exit(EXIT_FAILURE);
+    }
+    if (WIFEXITED(status))
+        exit(WEXITSTATUS(status));
+    exit(EXIT_FAILURE);
+}
+
+void privsep_start(const WatchOptions *options, ReportFunc report, TickFunc tick) {
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+
+    /* The unprivileged side stays the parent, so whoever started us waits
+       until all the output is written. */
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+
+    /* If the output process goes away, we find out from SIGPIPE the next
+       time we send it something. */
+
+    if (pid == 0) {
+        close(fds[1]);
+        channel_fd = fds[0];
+        return;
+    }
+
+    close(fds[0]);
+    channel_fd = fds[1];
+    privsep_drop_privileges();
+    run_output_process(options, report, tick, pid);
+}
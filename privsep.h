@@ -0,0 +1,45 @@
+#ifndef PRIVSEP_H
+#define PRIVSEP_H
+
+#include "loop.h"
+#include "ogwatch.h"
+
+typedef void (*ReportFunc)(const WatchOptions *options, const Event *event);
+
+// Gives the output stage a chance to write anything it has held back. Returns
+// how many ms until it next needs calling, or -1 if only for new events.
+// With final set, everything held back must go out now.
+typedef int (*TickFunc)(const WatchOptions *options, int final);
+
+/* Drives the output stage from an event loop: gives it its ticks, on time,
+   and writes out what it has without blocking. While stdout is full, it
+   waits for room on the loop, and the output stage holds events back. */
+typedef struct {
+    const WatchOptions *options;
+    TickFunc tick;
+    EventLoop *loop;
+    LoopTimer tick_timer;
+    int waiting_for_room;
+} OutputStage;
+
+void output_stage_init(OutputStage *stage, EventLoop *loop, const WatchOptions *options, TickFunc tick);
+
+// Call after each batch of events given to the output stage
+void output_stage_flush(OutputStage *stage);
+
+// Forks off an unprivileged process that receives events, passes them to
+// report() and writes the output. Returns only in the privileged process,
+// which then hands events over with privsep_send().
+void privsep_start(const WatchOptions *options, ReportFunc report, TickFunc tick);
+
+// Gives up root for good, including the ability to get it back
+void privsep_drop_privileges();
+
+void privsep_send(const Event *event);
+void privsep_flush();
+
+// Reads --format=binary records from fd and passes them to report(), until
+// the other end closes it
+void privsep_report_records(int fd, const WatchOptions *options, ReportFunc report, TickFunc tick);
+
+#endif
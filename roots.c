@@ -0,0 +1,192 @@
+/*
+
+Copyright (C) 2024, Andrew Moise <andrew.moise@gmail.com>
+
+Licensed under GNU Affero General Public License, Version 3
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "roots.h"
+
+/* One node per path component. Siblings are a plain list: a directory
+   rarely holds more than a few roots, and matching a path costs one walk
+   down, however many roots there are. */
+typedef struct RootNode {
+    char *name;
+    size_t name_len;
+    int root;               // Index of the root ending here, or -1
+    struct RootNode *children;
+    struct RootNode *next_sibling;
+} RootNode;
+
+struct RootSet {
+    RootNode top;           // "/"
+    char **paths;
+    int count;
+    int capacity;
+};
+
+static void *xmalloc(size_t size) {
+    void *ptr = malloc(size);
+    if (ptr == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+RootSet *roots_create() {
+    RootSet *roots = xmalloc(sizeof(*roots));
+    memset(&roots->top, 0, sizeof(roots->top));
+    roots->top.root = -1;
+    roots->capacity = 16;
+    roots->count = 0;
+    roots->paths = xmalloc(roots->capacity * sizeof(*roots->paths));
+    return roots;
+}
+
+static void free_children(RootNode *node) {
+    RootNode *child = node->children;
+    while (child != NULL) {
+        RootNode *next = child->next_sibling;
+        free_children(child);
+        free(child->name);
+        free(child);
+        child = next;
+    }
+}
+
+void roots_destroy(RootSet *roots) {
+    free_children(&roots->top);
+    for (int i = 0; i < roots->count; i++)
+        free(roots->paths[i]);
+    free(roots->paths);
+    free(roots);
+}
+
+static RootNode *find_child(const RootNode *node, const char *name, size_t name_len) {
+    for (RootNode *child = node->children; child != NULL; child = child->next_sibling) {
+        if (child->name_len == name_len && memcmp(child->name, name, name_len) == 0)
+            return child;
+    }
+    return NULL;
+}
+
+// Finds the next component at or after *pos, skipping slashes. Returns 0 at the end.
+static int next_component(const char *path, size_t path_len, size_t *pos, const char **name, size_t *name_len) {
+    while (*pos < path_len && path[*pos] == '/')
+        (*pos)++;
+    if (*pos == path_len)
+        return 0;
+
+    *name = path + *pos;
+    while (*pos < path_len && path[*pos] != '/')
+        (*pos)++;
+    *name_len = path + *pos - *name;
+    return 1;
+}
+
+int roots_add(RootSet *roots, const char *path) {
+    RootNode *node = &roots->top;
+    const char *name;
+    size_t name_len, pos = 0, path_len = strlen(path);
+
+    while (next_component(path, path_len, &pos, &name, &name_len)) {
+        RootNode *child = find_child(node, name, name_len);
+        if (child == NULL) {
+            child = xmalloc(sizeof(*child));
+            child->name = xmalloc(name_len);
+            memcpy(child->name, name, name_len);
+            child->name_len = name_len;
+            child->root = -1;
+            child->children = NULL;
+            child->next_sibling = node->children;
+            node->children = child;
+        }
+        node = child;
+    }
+
+    if (node->root != -1)
+        return node->root;
+
+    if (roots->count == roots->capacity) {
+        roots->capacity *= 2;
+        roots->paths = realloc(roots->paths, roots->capacity * sizeof(*roots->paths));
+        if (roots->paths == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    roots->paths[roots->count] = strdup(path);
+    if (roots->paths[roots->count] == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    node->root = roots->count;
+    return roots->count++;
+}
+
+/* Clears the root at the end of path, below node, and frees whatever
+   nodes that leaves with nothing under them. Returns whether node itself
+   is left with nothing. */
+static int prune(RootNode *node, const char *path, size_t path_len, size_t pos) {
+    const char *name;
+    size_t name_len;
+
+    if (!next_component(path, path_len, &pos, &name, &name_len)) {
+        node->root = -1;
+        return node->children == NULL;
+    }
+
+    RootNode **link = &node->children;
+    while (*link != NULL && ((*link)->name_len != name_len || memcmp((*link)->name, name, name_len) != 0))
+        link = &(*link)->next_sibling;
+    if (*link != NULL && prune(*link, path, path_len, pos)) {
+        RootNode *child = *link;
+        *link = child->next_sibling;
+        free(child->name);
+        free(child);
+    }
+    return node->root == -1 && node->children == NULL;
+}
+
+void roots_remove_last(RootSet *roots) {
+    char *path = roots->paths[--roots->count];
+    prune(&roots->top, path, strlen(path), 0);
+    free(path);
+}
+
+int roots_count(const RootSet *roots) {
+    return roots->count;
+}
+
+const char *roots_path(const RootSet *roots, int index) {
+    return roots->paths[index];
+}
+
+int roots_match(const RootSet *roots, const char *path, size_t path_len) {
+    const RootNode *node = &roots->top;
+    int match = node->root;
+    const char *name;
+    size_t name_len, pos = 0;
+
+    while (next_component(path, path_len, &pos, &name, &name_len)) {
+        node = find_child(node, name, name_len);
+        if (node == NULL)
+            break;
+        if (node->root != -1)
+            match = node->root;
+    }
+    return match;
+}
+
+const char *roots_relative_path(const RootSet *roots, int index, const char *path) {
+    path += strlen(roots->paths[index]);
+    if (*path == '/')
+        path++;
+    return path;
+}
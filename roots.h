@@ -0,0 +1,31 @@
+#ifndef ROOTS_H
+#define ROOTS_H
+
+#include <stddef.h>
+
+// The directories being watched, in the order given, with a trie over
+// their path components for finding which one a path belongs to.
+typedef struct RootSet RootSet;
+
+RootSet *roots_create();
+void roots_destroy(RootSet *roots);
+
+// Adds a canonical path, and returns its index. Adding the same path twice
+// returns the index it already has.
+int roots_add(RootSet *roots, const char *path);
+
+// Takes back the root added last, for when it couldn't be set up after all
+void roots_remove_last(RootSet *roots);
+
+int roots_count(const RootSet *roots);
+const char *roots_path(const RootSet *roots, int index);
+
+// Returns the index of the deepest root at or above path, or -1 if it is
+// under none of them.
+int roots_match(const RootSet *roots, const char *path, size_t path_len);
+
+// The part of a path at or below a root that comes after it, without a
+// leading slash ("" for the root itself)
+const char *roots_relative_path(const RootSet *roots, int index, const char *path);
+
+#endif
@@ -0,0 +1,170 @@
+/*
+
+Copyright (C) 2024, Andrew Moise <andrew.moise@gmail.com>
+
+Licensed under GNU Affero General Public License, Version 3
+
+*/
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ogwatch.h"
+#include "stats.h"
+
+uint64_t stats_counters[NUM_STATS];
+uint64_t stats_histograms[NUM_HISTS][STATS_BUCKETS];
+
+static const char *counter_names[NUM_STATS] = {
+    "reads", "read_bytes", "events", "dropped_mask", "dropped_outside",
+    "dropped_filter", "dropped_access", "dropped_origin",
+    "dropped_unchanged",
+    "estale", "overflows", "emitted",
+    "dir_cache_hits", "dir_cache_misses", "access_cache_hits",
+    "access_cache_misses", "output_records", "output_stalled"
+};
+
+static const char *histogram_names[NUM_HISTS] = {
+    "read_bytes", "resolve_ns", "latency_ns"
+};
+
+static const char *stats_process_name;
+static int stats_fd = -1;
+static pid_t stats_forward_pid = -1;
+
+/* The dump is written straight from the signal handler, so the event loop
+   needs no checks for it and a blocked read() doesn't hold it up. That
+   means no stdio here: only arithmetic and write(). Counters may be caught
+   halfway through a batch, which is fine for what they're for. */
+
+typedef struct {
+    char data[4096];
+    size_t len;
+} DumpBuffer;
+
+static void append_str(DumpBuffer *buf, const char *str) {
+    while (*str != '\0' && buf->len < sizeof(buf->data) - 1)
+        buf->data[buf->len++] = *str++;
+}
+
+static void append_u64(DumpBuffer *buf, uint64_t value) {
+    char digits[20];
+    int num_digits = 0;
+    do {
+        digits[num_digits++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    while (num_digits > 0 && buf->len < sizeof(buf->data) - 1)
+        buf->data[buf->len++] = digits[--num_digits];
+}
+
+static void append_field(DumpBuffer *buf, const char *name, const char *suffix, uint64_t value) {
+    append_str(buf, " ");
+    append_str(buf, name);
+    append_str(buf, suffix);
+    append_str(buf, "=");
+    append_u64(buf, value);
+}
+
+// The upper bound of the bucket the given fraction of values falls in
+static uint64_t percentile(const uint64_t *buckets, uint64_t count, uint64_t per_mille) {
+    uint64_t wanted = (count * per_mille + 999) / 1000, seen = 0;
+    for (int bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+        seen += buckets[bucket];
+        if (seen >= wanted && seen > 0)
+            return bucket == STATS_BUCKETS - 1 ? UINT64_MAX : (1ULL << bucket) - 1;
+    }
+    return 0;
+}
+
+static void dump_stats() {
+    DumpBuffer buf;
+    buf.len = 0;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    append_str(&buf, "ogwatch-stats process=");
+    append_str(&buf, stats_process_name);
+    append_field(&buf, "pid", "", getpid());
+    append_field(&buf, "time_ns", "", (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec);
+
+    for (int i = 0; i < NUM_STATS; i++)
+        append_field(&buf, counter_names[i], "", stats_counters[i]);
+
+    for (int i = 0; i < NUM_HISTS; i++) {
+        const uint64_t *buckets = stats_histograms[i];
+        uint64_t count = 0;
+        for (int bucket = 0; bucket < STATS_BUCKETS; bucket++)
+            count += buckets[bucket];
+        append_field(&buf, histogram_names[i], "_count", count);
+        append_field(&buf, histogram_names[i], "_p50", percentile(buckets, count, 500));
+        append_field(&buf, histogram_names[i], "_p90", percentile(buckets, count, 900));
+        append_field(&buf, histogram_names[i], "_p99", percentile(buckets, count, 990));
+        append_field(&buf, histogram_names[i], "_max", percentile(buckets, count, 1000));
+    }
+    append_str(&buf, "\n");
+
+    const char *data = buf.data;
+    size_t len = buf.len;
+    while (len > 0) {
+        ssize_t written = write(stats_fd, data, len);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        data += written;
+        len -= written;
+    }
+}
+
+static void handle_signal(int signal) {
+    int saved_errno = errno;
+    if (signal == SIGUSR1 && stats_forward_pid != -1)
+        kill(stats_forward_pid, SIGUSR1);
+    dump_stats();
+    errno = saved_errno;
+}
+
+int stats_start(const char *process_name, int fd, int interval_ms, pid_t forward_pid) {
+    stats_process_name = process_name;
+    stats_fd = fd;
+    stats_forward_pid = forward_pid;
+
+    // SA_RESTART, so that nothing else has to care about these
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaddset(&action.sa_mask, SIGUSR1);
+    sigaddset(&action.sa_mask, SIGALRM);
+
+    if (sigaction(SIGUSR1, &action, NULL) == -1)
+        return -1;
+
+    if (interval_ms > 0) {
+        if (sigaction(SIGALRM, &action, NULL) == -1)
+            return -1;
+        struct itimerval timer;
+        timer.it_interval.tv_sec = interval_ms / 1000;
+        timer.it_interval.tv_usec = (interval_ms % 1000) * 1000;
+        timer.it_value = timer.it_interval;
+        if (setitimer(ITIMER_REAL, &timer, NULL) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+uint64_t monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
@@ -0,0 +1,62 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Counters, each kept by whichever process does the counting. With
+// privilege separation, the reader counts events and the output process
+// counts output.
+typedef enum {
+    STAT_READS,                 // read() calls that returned events
+    STAT_READ_BYTES,
+    STAT_EVENTS,                // Records in those reads
+    STAT_DROPPED_MASK,          // Not an event type that was asked for
+    STAT_DROPPED_OUTSIDE,       // Not under any root
+    STAT_DROPPED_FILTER,        // Excluded by --exclude
+    STAT_DROPPED_ACCESS,        // The real user can't see it
+    STAT_DROPPED_ORIGIN,        // Caused by a process we were told to ignore
+    STAT_DROPPED_UNCHANGED,     // A close-write that left the file as it was
+    STAT_ESTALE,                // Directory gone before we could resolve it
+    STAT_OVERFLOWS,
+    STAT_EMITTED,               // Events passed on for output
+    STAT_DIR_CACHE_HITS,
+    STAT_DIR_CACHE_MISSES,
+    STAT_ACCESS_CACHE_HITS,
+    STAT_ACCESS_CACHE_MISSES,
+    STAT_OUTPUT_RECORDS,        // Events written out, before coalescing
+    STAT_OUTPUT_STALLED,        // Of those, held back because stdout was full
+    NUM_STATS
+} StatCounter;
+
+// Histograms, in power-of-two buckets
+typedef enum {
+    HIST_READ_BYTES,            // Per read()
+    HIST_RESOLVE_NS,            // From an event's turn in the batch to being emitted
+    HIST_LATENCY_NS,            // From the read() an event came in to its output
+    NUM_HISTS
+} StatHistogram;
+
+#define STATS_BUCKETS 64
+
+extern uint64_t stats_counters[NUM_STATS];
+extern uint64_t stats_histograms[NUM_HISTS][STATS_BUCKETS];
+
+/* Only the thread running the event loop or the output stage updates
+   these, so there's nothing to lock. */
+
+static inline void stats_add(StatCounter counter, uint64_t n) {
+    stats_counters[counter] += n;
+}
+
+static inline void stats_record(StatHistogram histogram, uint64_t value) {
+    int bucket = value ? 64 - __builtin_clzll(value) : 0;
+    stats_histograms[histogram][bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1]++;
+}
+
+// Dumps one line of stats to fd on SIGUSR1, and every interval_ms if that
+// isn't 0. SIGUSR1 is also passed on to forward_pid, unless it is -1.
+// Returns -1, with errno set, if the handler or timer can't be set up.
+int stats_start(const char *process_name, int fd, int interval_ms, pid_t forward_pid);
+
+#endif
@@ -0,0 +1,292 @@
+/*
+
+Copyright (C) 2024, Andrew Moise <andrew.moise@gmail.com>
+
+Licensed under GNU Affero General Public License, Version 3
+
+*/
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_MAGIC 0x454341525457474fULL     // "OGWTRACE", little-endian
+#define TRACE_VERSION 1
+
+// A record that isn't one of TRACE_DIR_*
+#define TRACE_READ 0
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t mark_mode;
+    uint32_t pair_renames;
+    uint32_t num_roots;         // Each follows as a uint32_t length and then the path
+    uint64_t read_buffer_size;
+} TraceHeader;
+
+typedef struct {
+    uint32_t type;              // TRACE_READ or TRACE_DIR_*
+    uint32_t length;            // Of what follows: the events, or the path
+    uint64_t value;             // When the read came in (CLOCK_MONOTONIC), or where the handle is
+} TraceRecord;
+
+struct TraceWriter {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t capacity;
+};
+
+static void append(TraceWriter *writer, const void *data, size_t len) {
+    if (writer->len + len > writer->capacity) {
+        while (writer->len + len > writer->capacity)
+            writer->capacity = writer->capacity ? writer->capacity * 2 : 64 * 1024;
+        writer->buf = realloc(writer->buf, writer->capacity);
+        if (writer->buf == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(writer->buf + writer->len, data, len);
+    writer->len += len;
+}
+
+TraceWriter *trace_writer_create(int fd, const TraceInfo *info, const RootSet *roots) {
+    TraceWriter *writer = calloc(1, sizeof(*writer));
+    if (writer == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    writer->fd = fd;
+
+    TraceHeader header = { TRACE_MAGIC, TRACE_VERSION, info->mark_mode, info->pair_renames, roots_count(roots),
+                           info->read_buffer_size };
+    append(writer, &header, sizeof(header));
+    for (int i = 0; i < roots_count(roots); i++) {
+        const char *path = roots_path(roots, i);
+        uint32_t len = strlen(path);
+        append(writer, &len, sizeof(len));
+        append(writer, path, len);
+    }
+    if (trace_flush(writer) == -1) {
+        trace_writer_destroy(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+void trace_writer_destroy(TraceWriter *writer) {
+    close(writer->fd);
+    free(writer->buf);
+    free(writer);
+}
+
+void trace_write_read(TraceWriter *writer, uint64_t time_ns, const void *data, size_t len) {
+    TraceRecord record = { TRACE_READ, len, time_ns };
+    append(writer, &record, sizeof(record));
+    append(writer, data, len);
+}
+
+void trace_write_dir(TraceWriter *writer, size_t offset, int result, const char *path) {
+    TraceRecord record = { result, result == TRACE_DIR_FOUND ? strlen(path) : 0, offset };
+    append(writer, &record, sizeof(record));
+    if (record.length > 0)
+        append(writer, path, record.length);
+}
+
+/* Everything since the last flush goes out in one write(), so that a
+   trace cut short by ogwatch being killed ends between reads. */
+int trace_flush(TraceWriter *writer) {
+    size_t written = 0;
+    while (written < writer->len) {
+        ssize_t len = write(writer->fd, writer->buf + written, writer->len - written);
+        if (len == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        written += len;
+    }
+    writer->len = 0;
+    return 0;
+}
+
+// One lookup from the recording, and whether the replay has made it yet
+typedef struct {
+    size_t offset;
+    int result;
+    size_t path_pos;            // In paths
+    int used;
+} TraceDir;
+
+struct TraceReader {
+    FILE *file;
+    TraceRecord next;           // The next read, already taken from the file
+    int at_end;
+
+    // The lookups made on the last read's events, in the order made
+    TraceDir *dirs;
+    size_t num_dirs;
+    size_t dirs_capacity;
+    size_t dirs_next;           // Where to start looking for the next one
+    char *paths;
+    size_t paths_len;
+    size_t paths_capacity;
+};
+
+static int read_exactly(FILE *file, void *buf, size_t len) {
+    return fread(buf, 1, len, file) == len ? 0 : -1;
+}
+
+// Takes the next record header, or marks the end of the trace
+static void read_next(TraceReader *reader) {
+    if (read_exactly(reader->file, &reader->next, sizeof(reader->next)) == -1)
+        reader->at_end = 1;
+}
+
+TraceReader *trace_reader_create(int fd, TraceInfo *info, RootSet *roots) {
+    FILE *file = fdopen(fd, "rb");
+    if (file == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    TraceHeader header;
+    if (read_exactly(file, &header, sizeof(header)) == -1 || header.magic != TRACE_MAGIC
+        || header.version != TRACE_VERSION)
+    {
+        fclose(file);
+        errno = EINVAL;
+        return NULL;
+    }
+    for (uint32_t i = 0; i < header.num_roots; i++) {
+        uint32_t len;
+        char path[PATH_MAX];
+        if (read_exactly(file, &len, sizeof(len)) == -1 || len >= sizeof(path)
+            || read_exactly(file, path, len) == -1)
+        {
+            fclose(file);
+            errno = EINVAL;
+            return NULL;
+        }
+        path[len] = '\0';
+        roots_add(roots, path);
+    }
+    info->mark_mode = header.mark_mode;
+    info->pair_renames = header.pair_renames;
+    info->read_buffer_size = header.read_buffer_size;
+
+    TraceReader *reader = calloc(1, sizeof(*reader));
+    if (reader == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    reader->file = file;
+    read_next(reader);
+    return reader;
+}
+
+void trace_reader_destroy(TraceReader *reader) {
+    fclose(reader->file);
+    free(reader->dirs);
+    free(reader->paths);
+    free(reader);
+}
+
+static void add_dir(TraceReader *reader, const TraceRecord *record, const char *path) {
+    if (reader->num_dirs == reader->dirs_capacity) {
+        reader->dirs_capacity = reader->dirs_capacity ? reader->dirs_capacity * 2 : 256;
+        reader->dirs = realloc(reader->dirs, reader->dirs_capacity * sizeof(*reader->dirs));
+        if (reader->dirs == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    size_t path_size = record->length + 1;
+    if (reader->paths_len + path_size > reader->paths_capacity) {
+        while (reader->paths_len + path_size > reader->paths_capacity)
+            reader->paths_capacity = reader->paths_capacity ? reader->paths_capacity * 2 : 64 * 1024;
+        reader->paths = realloc(reader->paths, reader->paths_capacity);
+        if (reader->paths == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    TraceDir *dir = &reader->dirs[reader->num_dirs++];
+    dir->offset = record->value;
+    dir->result = record->type;
+    dir->path_pos = reader->paths_len;
+    dir->used = 0;
+    memcpy(reader->paths + reader->paths_len, path, record->length);
+    reader->paths[reader->paths_len + record->length] = '\0';
+    reader->paths_len += path_size;
+}
+
+ssize_t trace_next_read(TraceReader *reader, void *buf, size_t buf_size, uint64_t *time_ns) {
+    if (reader->at_end)
+        return 0;
+    if (reader->next.type != TRACE_READ || reader->next.length > buf_size) {
+        errno = EBADMSG;
+        return -1;
+    }
+    // A trace cut off partway through a read ends before it
+    if (read_exactly(reader->file, buf, reader->next.length) == -1) {
+        reader->at_end = 1;
+        return 0;
+    }
+    ssize_t len = reader->next.length;
+    *time_ns = reader->next.value;
+
+    // Then everything that was looked up before the next read
+    reader->num_dirs = 0;
+    reader->dirs_next = 0;
+    reader->paths_len = 0;
+    char path[PATH_MAX];
+    while (1) {
+        read_next(reader);
+        if (reader->at_end || reader->next.type == TRACE_READ)
+            break;
+        if (reader->next.type > TRACE_DIR_GONE || reader->next.length >= sizeof(path)
+            || read_exactly(reader->file, path, reader->next.length) == -1)
+        {
+            errno = EBADMSG;
+            return -1;
+        }
+        add_dir(reader, &reader->next, path);
+    }
+    return len;
+}
+
+/* Lookups come back in the order they were recorded, unless the replay
+   is set up differently, so the search starts after the last one found.
+   A handle looked up more often than it was when recording gets the
+   last answer again. */
+int trace_lookup_dir(TraceReader *reader, size_t offset, const char **path) {
+    TraceDir *last = NULL;
+    for (size_t n = 0; n < reader->num_dirs; n++) {
+        size_t i = (reader->dirs_next + n) % reader->num_dirs;
+        TraceDir *dir = &reader->dirs[i];
+        if (dir->offset != offset)
+            continue;
+        if (!dir->used) {
+            dir->used = 1;
+            reader->dirs_next = i + 1;
+            last = dir;
+            break;
+        }
+        if (last == NULL || dir > last)
+            last = dir;
+    }
+    if (last == NULL)
+        return TRACE_DIR_OUTSIDE;
+    *path = reader->paths + last->path_pos;
+    return last->result;
+}
@@ -0,0 +1,60 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "roots.h"
+
+/* A trace of what the kernel told a watch, for --record and --replay: each
+   read() of fanotify events byte for byte, with when it came in, followed
+   by what the directory handles in it resolved to as the watch looked them
+   up. Played back, the same events go through everything after the kernel
+   again, without needing the kernel, the filesystem or root. It's only
+   meant to be read back by the same ogwatch on the same architecture. */
+typedef struct TraceWriter TraceWriter;
+typedef struct TraceReader TraceReader;
+
+// What the recording watch was like, which the replay has to be like too
+typedef struct {
+    uint32_t mark_mode;
+    uint32_t pair_renames;
+    uint64_t read_buffer_size;
+} TraceInfo;
+
+// What a directory handle resolved to
+enum {
+    TRACE_DIR_FOUND = 1,    // A path, under a root or not
+    TRACE_DIR_OUTSIDE,      // Not in the tree, or on a filesystem we don't watch
+    TRACE_DIR_GONE          // ESTALE
+};
+
+// Starts a trace on fd, which it takes over, with the roots being watched.
+// Returns NULL on error.
+TraceWriter *trace_writer_create(int fd, const TraceInfo *info, const RootSet *roots);
+void trace_writer_destroy(TraceWriter *writer);
+
+// Records a read() of len bytes of events, and then what the handle at
+// offset in the buffer they went into resolved to. Both are held until
+// trace_flush(), which returns -1 on error.
+void trace_write_read(TraceWriter *writer, uint64_t time_ns, const void *data, size_t len);
+void trace_write_dir(TraceWriter *writer, size_t offset, int result, const char *path);
+int trace_flush(TraceWriter *writer);
+
+// Opens a trace on fd for replay, taking it over, and adds its roots to
+// roots. Returns NULL, with errno set to EINVAL if fd doesn't hold a trace.
+TraceReader *trace_reader_create(int fd, TraceInfo *info, RootSet *roots);
+void trace_reader_destroy(TraceReader *reader);
+
+// Reads the next read()'s events into buf, and returns how many bytes
+// there were, or 0 at the end of the trace. Returns -1 if it's malformed
+// or won't fit.
+ssize_t trace_next_read(TraceReader *reader, void *buf, size_t buf_size, uint64_t *time_ns);
+
+// What the handle at offset in the last read's buffer resolved to, the
+// next time it was looked up, and its path if found. A handle the
+// recording watch never looked up counts as outside.
+int trace_lookup_dir(TraceReader *reader, size_t offset, const char **path);
+
+#endif
@@ -0,0 +1,450 @@
+/*
+
+Copyright (C) 2024, Andrew Moise <andrew.moise@gmail.com>
+
+Licensed under GNU Affero General Public License, Version 3
+
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libogwatch.h"
+#include "coalesce.h"
+#include "daemon.h"
+#include "loop.h"
+#include "privsep.h"
+#include "stats.h"
+
+/* The command line's side of the fanotify backend: it reads events through
+   libogwatch like any other client, and formats and writes them out. */
+
+// Events to take from the watch at a time
+#define WATCH_BATCH_SIZE 1024
+
+/* With -w, changed paths gather here and go out once per window instead
+   of once per event. Like the rest of the output stage, this lives in the
+   unprivileged process when there is one. Each root gets its own set, so
+   that running out of room never widens a rescan past its root. */
+static Coalescer **pending_paths = NULL;
+static int paths_pending = 0;
+static struct timespec window_start;
+
+/* When stdout is full, events are folded into paths to rescan here, so
+   that however long the reader stalls for, it costs us these sets and no
+   more, and we carry on taking events from the kernel meanwhile. The paths
+   go out as OVERFLOW records once there's room, ahead of anything newer. */
+static Coalescer **stalled_paths = NULL;
+static int paths_stalled = 0;
+static int estale_stalled = 0;
+
+// Paths to write out at a go, between checks that stdout has room
+#define DRAIN_BYTES (8 * 1024)
+
+typedef struct {
+    const WatchOptions *options;
+    int root;
+    unsigned int flags;     // Besides EVENT_IS_DIR
+} PendingRoot;
+
+// The set for a root, made when first needed
+static Coalescer *root_set(Coalescer ***sets, const WatchOptions *options, int root) {
+    if (*sets == NULL) {
+        *sets = calloc(roots_count(options->roots), sizeof(**sets));
+        if (*sets == NULL) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if ((*sets)[root] == NULL)
+        (*sets)[root] = coalescer_create(COALESCE_MAX_PATHS, COALESCE_MAX_BYTES);
+    return (*sets)[root];
+}
+
+static void report_path(const char *path, size_t path_len, int is_dir, void *arg) {
+    const PendingRoot *pending = arg;
+    const WatchOptions *options = pending->options;
+    Event event = { 0, pending->flags | (is_dir ? EVENT_IS_DIR : 0), path, path_len, monotonic_ns(), pending->root, NULL, 0 };
+
+    if (options->format != OUTPUT_TEXT) {
+        output_event(options, &event);
+        return;
+    }
+    output_number_event(options, &event);
+    if ((event.flags & EVENT_OVERFLOW) && !options->generic_mode)
+        output_printf("OVERFLOW %.*s%c", (int) path_len, path, options->terminator);
+    else
+        output_printf("%.*s%c", (int) path_len, path, options->terminator);
+}
+
+/* Writes out the paths in sets, a piece at a time for as long as stdout
+   has room, or all of them if final. Returns whether they're all out. */
+static int drain_paths(const WatchOptions *options, Coalescer **sets, unsigned int flags, int final) {
+    if (sets == NULL)
+        return 1;
+
+    for (int i = 0; i < roots_count(options->roots); i++) {
+        PendingRoot pending = { options, i, flags };
+        while (sets[i] != NULL && !coalescer_is_empty(sets[i])) {
+            if (!final && !output_has_room())
+                return 0;
+            coalescer_drain_some(sets[i], report_path, &pending, DRAIN_BYTES);
+        }
+    }
+    return 1;
+}
+
+static void coalesce_event(const WatchOptions *options, const Event *event) {
+    Coalescer *paths = root_set(&pending_paths, options, event->root);
+
+    if (!paths_pending) {
+        clock_gettime(CLOCK_MONOTONIC, &window_start);
+        paths_pending = 1;
+    }
+    if (event->from_path != NULL)
+        coalescer_add(paths, event->from_path, event->from_path_len, event->flags & EVENT_IS_DIR);
+    coalescer_add(paths, event->path, event->path_len, event->flags & EVENT_IS_DIR);
+}
+
+static void stall_event(const WatchOptions *options, const Event *event) {
+    stats_add(STAT_OUTPUT_STALLED, 1);
+
+    if (event->flags & EVENT_ESTALE) {
+        estale_stalled = 1;
+        return;
+    }
+
+    // An overflow means rescanning the whole root anyway
+    Coalescer *paths = root_set(&stalled_paths, options, event->root);
+    if (event->flags & EVENT_OVERFLOW)
+        coalescer_clear(paths);
+    if (event->from_path != NULL)
+        coalescer_add(paths, event->from_path, event->from_path_len, event->flags & EVENT_IS_DIR);
+    coalescer_add(paths, event->path, event->path_len, (event->flags & (EVENT_IS_DIR | EVENT_OVERFLOW)) != 0);
+    paths_stalled = 1;
+}
+
+static void write_event(const WatchOptions *options, const Event *event) {
+    char terminator = options->terminator;
+    int path_len = event->path_len;
+
+    if (options->format != OUTPUT_TEXT) {
+        output_event(options, event);
+        return;
+    }
+    output_number_event(options, event);
+
+    if ((event->flags & EVENT_OVERFLOW) && !options->generic_mode) {
+        output_printf("OVERFLOW %.*s%c", path_len, event->path, terminator);
+        return;
+    }
+
+    if (event->flags & EVENT_ESTALE) {
+        if (!options->generic_mode)
+            output_printf("ESTALE%c", terminator);
+        return;
+    }
+
+    // In generic mode, the barrier is the one empty path
+    if (event->flags & EVENT_BARRIER) {
+        output_printf("%s%c", options->generic_mode ? "" : "BARRIER", terminator);
+        return;
+    }
+    if ((event->flags & EVENT_SNAPSHOT) && !options->generic_mode) {
+        output_printf("SNAPSHOT%s %.*s%c", (event->flags & EVENT_IS_DIR) ? "|FAN_ONDIR" : "", path_len, event->path,
+                      terminator);
+        return;
+    }
+
+    if (!options->generic_mode) {
+        const char *dir_or_file = (event->flags & EVENT_IS_DIR) ? "|FAN_ONDIR" : "";
+        EventMap *events = get_full_events_list();
+        for (int i = 0; events[i].name != NULL; i++) {
+            if (!(event->mask & events[i].value))
+                continue;
+            if (event->from_path != NULL) {
+                output_printf("%s%s %.*s -> %.*s%c", events[i].name, dir_or_file, (int) event->from_path_len,
+                              event->from_path, path_len, event->path, terminator);
+            } else {
+                output_printf("%s%s %.*s%c", events[i].name, dir_or_file, path_len, event->path, terminator);
+            }
+        }
+    } else {
+        if (event->from_path != NULL)
+            output_printf("%.*s%c", (int) event->from_path_len, event->from_path, terminator);
+        output_printf("%.*s%c", path_len, event->path, terminator);
+    }
+}
+
+/* Writes out whatever was held back and is due: first anything stdout
+   had no room for, then the coalesced paths once their window is up. */
+int report_tick(const WatchOptions *options, int final) {
+    if (paths_stalled) {
+        if (!drain_paths(options, stalled_paths, EVENT_OVERFLOW, final))
+            return 0;
+        paths_stalled = 0;
+    }
+    if (estale_stalled) {
+        if (!final && !output_has_room())
+            return 0;
+        Event event = { 0, EVENT_ESTALE, "", 0, monotonic_ns(), -1, NULL, 0 };
+        write_event(options, &event);
+        estale_stalled = 0;
+    }
+
+    if (!paths_pending)
+        return -1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed = (now.tv_sec - window_start.tv_sec) * 1000 + (now.tv_nsec - window_start.tv_nsec) / 1000000;
+    if (elapsed < options->coalesce_window_ms && !final)
+        return options->coalesce_window_ms - elapsed;
+
+    if (!drain_paths(options, pending_paths, 0, final))
+        return 0;
+    paths_pending = 0;
+    return -1;
+}
+
+/* Formats an event for output. With privilege separation, this runs in
+   the unprivileged process. */
+void report_event(const WatchOptions *options, const Event *event) {
+    stats_add(STAT_OUTPUT_RECORDS, 1);
+    stats_record(HIST_LATENCY_NS, monotonic_ns() - event->timestamp_ns);
+
+    /* The initial scan goes out whole, however long the reader takes:
+       folded into rescans or coalesced, it would be no baseline at all. */
+
+    if (event->flags & (EVENT_SNAPSHOT | EVENT_BARRIER)) {
+        write_event(options, event);
+        return;
+    }
+
+    /* Rescanning the root covers anything we were holding back for it. */
+
+    if ((event->flags & EVENT_OVERFLOW) && pending_paths != NULL && pending_paths[event->root] != NULL)
+        coalescer_clear(pending_paths[event->root]);
+
+    if (options->coalesce_window_ms > 0 && !(event->flags & EVENT_ESTALE)) {
+        coalesce_event(options, event);
+        return;
+    }
+
+    if (paths_stalled || estale_stalled || !output_has_room()) {
+        stall_event(options, event);
+        return;
+    }
+    write_event(options, event);
+}
+
+// Hands an event to the output stage, here or in the unprivileged process
+void emit_event(const WatchOptions *options, const Event *event) {
+    if (options->privsep)
+        privsep_send(event);
+    else
+        report_event(options, event);
+}
+
+typedef struct {
+    const WatchOptions *options;
+    Ogwatch *watch;
+    EventLoop *loop;
+    LoopTimer estale_timer;     // For when the pending ESTALE is due
+    OutputStage output;         // Without a separate output process, output is ours to write
+} WatchLoop;
+
+static void flush_events(WatchLoop *state) {
+    if (state->options->privsep)
+        privsep_flush();
+    else
+        output_stage_flush(&state->output);
+}
+
+/* Takes everything the watch has for us. One write per batch; the last
+   batch is always flushed, so nothing sits in the buffer once the queue
+   goes idle. */
+static void read_watch(WatchLoop *state) {
+    static Event events[WATCH_BATCH_SIZE];
+    const WatchOptions *options = state->options;
+
+    ssize_t count;
+    while ((count = ogwatch_read_batch(state->watch, events, WATCH_BATCH_SIZE)) > 0) {
+        for (ssize_t i = 0; i < count; i++)
+            emit_event(options, &events[i]);
+        flush_events(state);
+    }
+    if (count == -1) {
+        perror("Reading events");
+        exit(EXIT_FAILURE);
+    }
+
+    loop_set_timer(state->loop, &state->estale_timer, ogwatch_timeout(state->watch));
+}
+
+static void emit_snapshot(const Event *event, void *arg) {
+    emit_event(arg, event);
+}
+
+/* Reports everything in the tree, then the barrier. The marks are in
+   place already, so changes made meanwhile wait in the kernel's queue,
+   and are read once we're done. */
+static void scan_roots(WatchLoop *state) {
+    const WatchOptions *options = state->options;
+    int threads = options->threads ? options->threads : DEFAULT_SCAN_THREADS;
+
+    if (ogwatch_scan(state->watch, threads, emit_snapshot, (void *) options) == -1) {
+        perror("Scanning");
+        exit(EXIT_FAILURE);
+    }
+    Event barrier = { 0, EVENT_BARRIER, "", 0, monotonic_ns(), -1, NULL, 0 };
+    emit_event(options, &barrier);
+    flush_events(state);
+}
+
+static void handle_watch_ready(int fd, unsigned int events, void *arg) {
+    read_watch(arg);
+}
+
+static void handle_estale_due(void *arg) {
+    read_watch(arg);
+}
+
+static void init_config(OgwatchConfig *config, const WatchOptions *options) {
+    config->file_events_mask = options->file_events_mask;
+    config->dir_events_mask = options->dir_events_mask;
+    config->read_buffer_size = options->read_buffer_size;
+    config->scoped_marks = options->scoped_marks;
+    config->threads = options->threads;
+    config->bounded_queue = options->bounded_queue;
+    config->filter = options->filter;
+    config->ignore = options->ignore;
+    config->unchanged_max_size = options->unchanged_max_size;
+}
+
+/* Puts a trace through the watch and the output stage, as fast as they
+   go, and exits once it's all written out. Output blocks rather than
+   stalling, so that what comes out doesn't depend on how fast it's read.
+   None of this needs root. */
+static void replay_trace(const WatchOptions *options) {
+    static WatchLoop state;
+    static WatchOptions replay_options;
+
+    privsep_drop_privileges();
+    int fd = open(options->replay_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror(options->replay_path);
+        exit(EXIT_FAILURE);
+    }
+
+    OgwatchConfig config;
+    init_config(&config, options);
+    Ogwatch *watch = ogwatch_open_replay(&config, fd);
+    if (watch == NULL) {
+        if (errno == EINVAL)
+            fprintf(stderr, "%s: Not an ogwatch trace\n", options->replay_path);
+        else
+            perror(options->replay_path);
+        exit(EXIT_FAILURE);
+    }
+
+    // The roots are the recording's, in the same order
+    RootSet *roots = roots_create();
+    for (int i = 0; i < ogwatch_root_count(watch); i++)
+        roots_add(roots, ogwatch_root_path(watch, i));
+    replay_options = *options;
+    replay_options.roots = roots;
+    options = &replay_options;
+
+    if (options->privsep)
+        privsep_start(options, report_event, report_tick);
+    if (stats_start(options->privsep ? "reader" : "main", options->stats_fd, options->stats_interval_ms, -1) == -1) {
+        perror("Failed to start stats");
+        exit(EXIT_FAILURE);
+    }
+
+    state.options = options;
+    state.watch = watch;
+    state.loop = loop_create();
+    state.estale_timer = (LoopTimer) { handle_estale_due, &state, 0 };
+    output_stage_init(&state.output, state.loop, options, report_tick);
+    while (!ogwatch_replay_done(watch))
+        read_watch(&state);
+
+    if (options->privsep) {
+        privsep_flush();
+    } else {
+        report_tick(options, 1);
+        output_flush();
+    }
+    exit(EXIT_SUCCESS);
+}
+
+void event_watch_loop(const WatchOptions *options) {
+    static WatchLoop state;
+
+    if (options->replay_path != NULL)
+        replay_trace(options);
+    if (options->listen_path != NULL)
+        daemon_serve(options);
+
+    // Whoever reads our output mustn't hold up reading events
+    output_set_nonblocking();
+    if (options->connect_path != NULL)
+        daemon_subscribe(options, report_event, report_tick);
+
+    /* Everything from here on can run as root; formatting and writing
+       output needn't, so they go to a process of their own. */
+
+    if (options->privsep)
+        privsep_start(options, report_event, report_tick);
+    if (stats_start(options->privsep ? "reader" : "main", options->stats_fd, options->stats_interval_ms, -1) == -1) {
+        perror("Failed to start stats");
+        exit(EXIT_FAILURE);
+    }
+
+    OgwatchConfig config;
+    init_config(&config, options);
+
+    Ogwatch *watch = ogwatch_open(&config);
+    if (watch == NULL) {
+        perror("Failed to start watching");
+        exit(EXIT_FAILURE);
+    }
+
+    // The roots are canonical already, so they keep their indexes
+    for (int i = 0; i < roots_count(options->roots); i++) {
+        const char *root = roots_path(options->roots, i);
+        if (ogwatch_add_root(watch, root) == -1) {
+            perror(root);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Only root can record, so the trace needn't be opened as anyone else
+    if (options->record_path != NULL) {
+        int fd = open(options->record_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd == -1 || ogwatch_record(watch, fd) == -1) {
+            perror(options->record_path);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    state.options = options;
+    state.watch = watch;
+    state.loop = loop_create();
+    state.estale_timer = (LoopTimer) { handle_estale_due, &state, 0 };
+    output_stage_init(&state.output, state.loop, options, report_tick);
+    if (options->initial_scan)
+        scan_roots(&state);
+
+    loop_add(state.loop, ogwatch_fd(watch), EPOLLIN, handle_watch_ready, &state);
+    loop_run(state.loop);
+    exit(EXIT_SUCCESS);
+}